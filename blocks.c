@@ -0,0 +1,404 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Fixed-size block modes
+ *
+ * Block list mode prints one line per fixed-size block of the input:
+ *   <offset> <length> <checksum>
+ *
+ * Diff mode checksums corresponding blocks of two inputs and prints the
+ * ranges where they differ, one per line:
+ *   <offset> <length>
+ * Blocks past the end of the shorter input always differ.
+ *
+ * Notes:
+ *  - Blocks are handed out to worker threads, which read them with
+ *    pread() so that any number of blocks can be in flight at once.
+ *  - Results go into a ring of slots that the main thread empties in
+ *    order.  Workers do not claim blocks more than a ring's length ahead
+ *    of the main thread, which bounds memory use for any input size.
+ *  - In diff mode, blocks of different lengths are known to differ and
+ *    are not read at all.
+ *  - Each worker keeps one read buffer and one method context for all
+ *    the blocks it checksums.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "checksum.h"
+
+// Largest single read when checksumming a block
+#define IO_SIZE         (1024 * 1024)
+
+// Result slots per worker thread
+#define SLOTS_PER_THREAD 8
+
+// Result of checksumming one block (of each input)
+struct block_slot
+{
+    int     done;
+    int     status;
+    int     differ;
+    uint8_t digest[2][MAX_OUTPUT_SIZE];
+};
+
+// State shared by the main thread and the workers
+struct block_pool
+{
+    pthread_mutex_t    lock;
+    pthread_cond_t     ready;       // a slot was filled in
+    pthread_cond_t     space;       // a slot was emptied, or it is time to stop
+    int                stop;
+
+    struct method_api* api;
+    int                fd[2];
+    uint64_t           size[2];
+    unsigned           nfiles;
+    uint64_t           block_size;
+    uint64_t           nblocks;
+
+    uint64_t           next;        // next block to be claimed by a worker
+    uint64_t           retired;     // blocks the main thread is done with
+    struct block_slot* slots;
+    unsigned           nslots;
+};
+
+// Local function prototypes
+static int      blocks_common   (struct block_pool* pool, unsigned threads,
+                                 uint64_t max_mismatches);
+static void*    block_worker    (void* arg);
+static int      hash_block      (struct method_api* api, void* storage,
+                                 int fd, uint64_t offset, uint64_t len,
+                                 uint8_t* buf, size_t buf_size,
+                                 uint8_t* digest);
+static uint64_t block_length    (const struct block_pool* pool,
+                                 unsigned file, uint64_t block);
+static int      input_size      (int fd, uint64_t* size);
+
+
+// Display a checksum for each fixed-size block of an input
+int blocks_run(struct method_api* api, int fd, uint64_t block_size,
+               unsigned threads)
+{
+    struct block_pool pool;
+
+    pool.api = api;
+    pool.nfiles = 1;
+    pool.fd[0] = fd;
+    pool.block_size = block_size;
+    if (input_size(fd, &pool.size[0]))
+        return 1;
+    pool.nblocks = (pool.size[0] + block_size - 1) / block_size;
+
+    return blocks_common(&pool, threads, 0);
+}
+
+// Display the ranges where two inputs differ.  Returns 0 if they are the
+// same, 1 if they differ, and 2 on error.
+int diff_run(struct method_api* api, int fd_a, int fd_b, uint64_t block_size,
+             uint64_t max_mismatches, unsigned threads)
+{
+    struct block_pool pool;
+    uint64_t longest;
+
+    pool.api = api;
+    pool.nfiles = 2;
+    pool.fd[0] = fd_a;
+    pool.fd[1] = fd_b;
+    pool.block_size = block_size;
+    if (input_size(fd_a, &pool.size[0]) || input_size(fd_b, &pool.size[1]))
+        return 2;
+    longest = (pool.size[0] > pool.size[1]) ? pool.size[0] : pool.size[1];
+    pool.nblocks = (longest + block_size - 1) / block_size;
+
+    return blocks_common(&pool, threads, max_mismatches);
+}
+
+
+// Hand out blocks to the workers and deal with the results in order.
+// In diff mode, stop once 'max_mismatches' blocks (if non-zero) differ.
+static int blocks_common(struct block_pool* pool, unsigned threads,
+                         uint64_t max_mismatches)
+{
+    struct block_slot* slot;
+    pthread_t* workers;
+    unsigned nworkers;
+    uint64_t block;
+    uint64_t mismatches = 0;
+    uint64_t range_start = 0, range_end = 0;
+    int in_range = 0;
+    int retval = 0;
+
+    if (threads == 0)
+        threads = 1;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->space, NULL);
+    pool->stop = 0;
+    pool->next = 0;
+    pool->retired = 0;
+    pool->nslots = threads * SLOTS_PER_THREAD;
+    pool->slots = calloc(pool->nslots, sizeof(*pool->slots));
+    workers = calloc(threads, sizeof(*workers));
+    if ((pool->slots == NULL) || (workers == NULL))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        free(pool->slots);
+        free(workers);
+        return (pool->nfiles == 2) ? 2 : 1;
+    }
+
+    for (nworkers = 0; nworkers < threads; ++nworkers)
+    {
+        if (pthread_create(&workers[nworkers], NULL, &block_worker, pool) != 0)
+            break;
+    }
+    if (nworkers == 0)
+    {
+        fprintf(stderr, "Unable to start worker threads\n");
+        retval = 1;
+        pool->nblocks = 0;
+    }
+
+    // Collect results in order
+    for (block = 0; block < pool->nblocks; ++block)
+    {
+        slot = &pool->slots[block % pool->nslots];
+        pthread_mutex_lock(&pool->lock);
+        while (!slot->done)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (slot->status)
+        {
+            fprintf(stderr, "Error processing block at offset %"PRIu64"\n",
+                    block * pool->block_size);
+            retval = 1;
+        }
+        else if (pool->nfiles == 1)
+        {
+            printf("%"PRIu64" %"PRIu64" ", block * pool->block_size,
+                   block_length(pool, 0, block));
+            print_digest(stdout, slot->digest[0], pool->api->output_size);
+        }
+        else if (slot->differ)
+        {
+            // Extend the current range of differences, or start a new one
+            if (!in_range)
+                range_start = block * pool->block_size;
+            range_end = block * pool->block_size + pool->block_size;
+            in_range = 1;
+            ++mismatches;
+        }
+        else if (in_range)
+        {
+            printf("%"PRIu64" %"PRIu64"\n", range_start, range_end - range_start);
+            in_range = 0;
+        }
+
+        // Free up the slot for another block
+        pthread_mutex_lock(&pool->lock);
+        slot->done = 0;
+        pool->retired = block + 1;
+        if (retval || ((max_mismatches != 0) && (mismatches >= max_mismatches)))
+            pool->stop = 1;
+        pthread_cond_broadcast(&pool->space);
+        pthread_mutex_unlock(&pool->lock);
+        if (pool->stop)
+            break;
+    }
+
+    // Finish off the last range of differences
+    if (in_range)
+    {
+        if (range_end > pool->size[0] && range_end > pool->size[1])
+            range_end = (pool->size[0] > pool->size[1]) ? pool->size[0] : pool->size[1];
+        printf("%"PRIu64" %"PRIu64"\n", range_start, range_end - range_start);
+    }
+    if ((pool->nfiles == 2) && (max_mismatches != 0) && (mismatches >= max_mismatches) &&
+        (block + 1 < pool->nblocks))
+    {
+        fprintf(stderr, "Stopped after %"PRIu64" differing blocks\n", mismatches);
+    }
+
+    // Stop the workers
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->space);
+    pthread_mutex_unlock(&pool->lock);
+    while (nworkers > 0)
+        pthread_join(workers[--nworkers], NULL);
+
+    pthread_cond_destroy(&pool->space);
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slots);
+    free(workers);
+
+    if (pool->nfiles == 2)
+        return retval ? 2 : (mismatches > 0);
+    return retval;
+}
+
+// Worker thread: claim blocks, checksum them and fill in their slots
+static void* block_worker(void* arg)
+{
+    struct block_pool* pool = arg;
+    struct block_slot* slot;
+    void* storage = NULL;
+    uint8_t* buf;
+    size_t buf_size;
+    uint64_t block;
+    uint64_t len[2];
+    unsigned f;
+
+    buf_size = (pool->block_size < IO_SIZE) ? pool->block_size : IO_SIZE;
+    buf = malloc(buf_size);
+    if (posix_memalign(&storage, CONTEXT_ALIGN, pool->api->context_size))
+        storage = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        // Wait for a free slot
+        while (!pool->stop && (pool->next < pool->nblocks) &&
+               (pool->next >= pool->retired + pool->nslots))
+            pthread_cond_wait(&pool->space, &pool->lock);
+        if (pool->stop || (pool->next >= pool->nblocks))
+            break;
+        block = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot = &pool->slots[block % pool->nslots];
+        slot->status = (buf == NULL) || (storage == NULL);
+        slot->differ = 0;
+        for (f = 0; f < pool->nfiles; ++f)
+            len[f] = block_length(pool, f, block);
+
+        // Blocks of different lengths differ without looking at them
+        if ((pool->nfiles == 2) && (len[0] != len[1]))
+        {
+            slot->differ = 1;
+        }
+        else
+        {
+            for (f = 0; (f < pool->nfiles) && !slot->status; ++f)
+            {
+                slot->status = hash_block(pool->api, storage, pool->fd[f],
+                                          block * pool->block_size, len[f],
+                                          buf, buf_size, slot->digest[f]);
+            }
+            if ((pool->nfiles == 2) && !slot->status)
+            {
+                slot->differ = memcmp(slot->digest[0], slot->digest[1],
+                                      pool->api->output_size) != 0;
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        slot->done = 1;
+        pthread_cond_broadcast(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(storage);
+    free(buf);
+    return NULL;
+}
+
+// Checksum 'len' bytes of an input, starting at 'offset', using the
+// worker's context storage
+static int hash_block(struct method_api* api, void* storage,
+                      int fd, uint64_t offset, uint64_t len,
+                      uint8_t* buf, size_t buf_size,
+                      uint8_t* digest)
+{
+    struct context ctx;
+    uint64_t start;
+    ssize_t got;
+    size_t want;
+    int retval = 0;
+
+    ctx.which = api->type;
+    ctx.context = storage;
+    ctx.threads = 1;
+    ctx.preallocated = 1;
+    if (api->sum_init(&ctx))
+        return 1;
+
+    while ((len > 0) && !retval)
+    {
+        want = (len < buf_size) ? len : buf_size;
+        start = throttle_start();
+        got = pread(fd, buf, want, offset);
+        if ((got < 0) && (errno == EINTR))
+            continue;
+        if (got <= 0)
+        {
+            // Read error, or the input got shorter
+            retval = 1;
+            break;
+        }
+        throttle_read(got, start);
+        PROBE2(read_done, api->type, got);
+        retval = method_process(api, &ctx, buf, got);
+        offset += got;
+        len -= got;
+    }
+
+    // Always finish, so that the context gets cleaned up
+    if (method_finish(api, &ctx, digest))
+        retval = 1;
+
+    return retval;
+}
+
+// Number of bytes of a block that lie within an input
+static uint64_t block_length(const struct block_pool* pool,
+                             unsigned file, uint64_t block)
+{
+    uint64_t offset = block * pool->block_size;
+
+    if (offset >= pool->size[file])
+        return 0;
+    if (pool->size[file] - offset < pool->block_size)
+        return pool->size[file] - offset;
+    return pool->block_size;
+}
+
+// Find the size of a seekable input (a regular file or a block device)
+static int input_size(int fd, uint64_t* size)
+{
+    off_t end;
+
+    end = lseek(fd, 0, SEEK_END);
+    if (end < 0)
+    {
+        fprintf(stderr, "Block modes need a seekable input\n");
+        return 1;
+    }
+
+    *size = end;
+    return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Content-defined chunking mode
+ *
+ * The input is cut into variable-size chunks at positions chosen by a
+ * rolling hash of the data, so that an insertion or deletion only moves
+ * the boundaries near it.  One line is printed per chunk:
+ *   <offset> <length> <checksum>
+ *
+ * Notes:
+ *  - Boundaries are found with the FastCDC algorithm: a Gear rolling hash,
+ *    no cut points before the minimum size, a stricter mask below the
+ *    average size and a looser one above it (normalization level 2), and
+ *    a forced cut at the maximum size.
+ *  - The Gear table is generated from a fixed seed, so boundaries are
+ *    stable between runs and builds.
+ *  - The input is read into a ring of large buffers ("slabs").  The main
+ *    thread scans a slab for boundaries and queues each chunk as soon as
+ *    it is found; worker threads checksum queued chunks straight out of
+ *    the slab.  A slab is reused (and its results printed, in order) once
+ *    all of its chunks are done.
+ *  - A chunk that runs off the end of a slab is copied to the start of the
+ *    next one, which is at most 'max' bytes per slab.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "checksum.h"
+
+// Smallest slab size; slabs are also at least four maximum-size chunks
+#define SLAB_SIZE       (4 * 1024 * 1024)
+
+// Number of slabs in addition to one per worker thread
+#define SPARE_SLABS     2
+
+// One chunk waiting to be (or having been) checksummed
+struct cdc_job
+{
+    struct cdc_job*  next;      // next job in the work queue
+    struct cdc_slab* slab;      // slab holding the chunk's data
+    uint64_t         offset;    // position of the chunk in the input
+    const uint8_t*   data;
+    size_t           len;
+    uint8_t          digest[MAX_OUTPUT_SIZE];
+    int              status;
+};
+
+// Read buffer along with the chunks found in it
+struct cdc_slab
+{
+    uint8_t*        buf;
+    struct cdc_job* jobs;
+    size_t          njobs;
+    size_t          pending;    // jobs not yet checksummed
+};
+
+// Work queue shared by the main thread and the workers
+struct cdc_pool
+{
+    pthread_mutex_t    lock;
+    pthread_cond_t     work;    // a job was queued, or it is time to stop
+    pthread_cond_t     done;    // a job was completed
+    struct cdc_job*    head;
+    struct cdc_job*    tail;
+    int                stop;
+    struct method_api* api;
+};
+
+// Rolling hash parameters
+struct cdc_masks
+{
+    uint64_t small;             // used below the average size
+    uint64_t large;             // used above the average size
+};
+
+static uint64_t gear[256];
+
+// Local function prototypes
+static void   gear_init     (void);
+static void   masks_init    (const struct cdc_params* params,
+                             struct cdc_masks* masks);
+static size_t cut_point     (const struct cdc_params* params,
+                             const struct cdc_masks* masks,
+                             const uint8_t* data, size_t len, int eof);
+static void*  cdc_worker    (void* arg);
+static void   queue_job     (struct cdc_pool* pool, struct cdc_job* job);
+static int    retire_slab   (struct cdc_pool* pool, struct cdc_slab* slab);
+
+
+// Split the input into chunks and display a checksum for each one
+int cdc_run(struct method_api* api, FILE* input,
+            const struct cdc_params* params, unsigned threads)
+{
+    struct cdc_pool pool;
+    struct cdc_masks masks;
+    struct cdc_slab* slabs;
+    struct cdc_slab* slab;
+    struct cdc_slab* prev = NULL;
+    pthread_t* workers;
+    unsigned nworkers = 0;
+    unsigned nslabs;
+    unsigned i, cur = 0;
+    size_t slab_size, max_jobs;
+    uint64_t start;
+    size_t len = 0, prev_len = 0, pos, cut;
+    size_t carry = 0;
+    uint64_t base = 0;
+    int eof = 0;
+    int retval = 0;
+
+    gear_init();
+    masks_init(params, &masks);
+
+    // Every slab must be able to hold a few maximum-size chunks
+    slab_size = SLAB_SIZE;
+    if (slab_size < 4 * params->max)
+        slab_size = 4 * params->max;
+    max_jobs = slab_size / params->min + 2;
+
+    if (threads == 0)
+        threads = 1;
+    nslabs = threads + SPARE_SLABS;
+
+    // Allocate buffers
+    slabs = calloc(nslabs, sizeof(*slabs));
+    workers = calloc(threads, sizeof(*workers));
+    if ((slabs == NULL) || (workers == NULL))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        free(slabs);
+        free(workers);
+        return 1;
+    }
+    for (i = 0; i < nslabs; ++i)
+    {
+        slabs[i].buf = malloc(slab_size);
+        slabs[i].jobs = malloc(max_jobs * sizeof(*slabs[i].jobs));
+        if ((slabs[i].buf == NULL) || (slabs[i].jobs == NULL))
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            retval = 1;
+            goto cleanup;
+        }
+    }
+
+    // Start the workers
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.head = pool.tail = NULL;
+    pool.stop = 0;
+    pool.api = api;
+    for (nworkers = 0; nworkers < threads; ++nworkers)
+    {
+        if (pthread_create(&workers[nworkers], NULL, &cdc_worker, &pool) != 0)
+            break;
+    }
+    if (nworkers == 0)
+    {
+        fprintf(stderr, "Unable to start worker threads\n");
+        retval = 1;
+        goto shutdown;
+    }
+
+    // Scan slabs in turn until the input runs out
+    while (!eof)
+    {
+        slab = &slabs[cur];
+        if (retire_slab(&pool, slab))
+            retval = 1;
+
+        // Move the unfinished chunk from the previous slab, then fill up
+        if (carry > 0)
+            memcpy(slab->buf, &prev->buf[prev_len - carry], carry);
+        start = throttle_start();
+        len = carry + fread(&slab->buf[carry], 1, slab_size - carry, input);
+        throttle_read(len - carry, start);
+        PROBE2(read_done, api->type, len - carry);
+        if (len < slab_size)
+        {
+            if (ferror(input))
+            {
+                fprintf(stderr, "Error reading from %s\n", (input == stdin) ? "stdin" : "input file");
+                retval = 1;
+                break;
+            }
+            eof = 1;
+        }
+
+        // Queue each chunk as soon as its end is found
+        for (pos = 0; pos < len; pos += cut)
+        {
+            cut = cut_point(params, &masks, &slab->buf[pos], len - pos, eof);
+            if (cut == 0)
+                break;
+
+            slab->jobs[slab->njobs].slab   = slab;
+            slab->jobs[slab->njobs].offset = base + pos;
+            slab->jobs[slab->njobs].data   = &slab->buf[pos];
+            slab->jobs[slab->njobs].len    = cut;
+            queue_job(&pool, &slab->jobs[slab->njobs++]);
+        }
+
+        carry = len - pos;
+        base += pos;
+        prev = slab;
+        prev_len = len;
+        cur = (cur + 1) % nslabs;
+    }
+
+    // Display whatever is still outstanding, oldest slab first
+    for (i = 0; i < nslabs; ++i)
+    {
+        if (retire_slab(&pool, &slabs[(cur + i) % nslabs]))
+            retval = 1;
+    }
+
+shutdown:
+    // Stop the workers
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < nworkers; ++i)
+        pthread_join(workers[i], NULL);
+    pthread_cond_destroy(&pool.done);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+
+cleanup:
+    for (i = 0; i < nslabs; ++i)
+    {
+        free(slabs[i].buf);
+        free(slabs[i].jobs);
+    }
+    free(slabs);
+    free(workers);
+
+    return retval;
+}
+
+
+// Fill in the Gear table from a fixed-seed generator (SplitMix64)
+static void gear_init(void)
+{
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    uint64_t z;
+    int i;
+
+    for (i = 0; i < 256; ++i)
+    {
+        z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Work out the boundary masks for the requested average chunk size.
+// The Gear hash shifts left, so its top bits depend on the most input
+// bytes; the masks use those bits.
+static void masks_init(const struct cdc_params* params, struct cdc_masks* masks)
+{
+    unsigned bits = 0;
+
+    while ((((size_t)2) << bits) <= params->avg)
+        ++bits;
+
+    masks->small = ~(uint64_t)0 << (64 - (bits + 2));
+    masks->large = (bits > 2) ? ~(uint64_t)0 << (64 - (bits - 2)) : 0;
+}
+
+// Find the length of the chunk at the start of 'data'.  Returns 0 if
+// the end of the chunk is beyond 'len' bytes and more input may follow.
+static size_t cut_point(const struct cdc_params* params,
+                        const struct cdc_masks* masks,
+                        const uint8_t* data, size_t len, int eof)
+{
+    uint64_t hash = 0;
+    size_t limit, normal, i;
+
+    if (len <= params->min)
+        return eof ? len : 0;
+
+    limit = (len < params->max) ? len : params->max;
+    normal = (params->avg < limit) ? params->avg : limit;
+
+    for (i = params->min; i < normal; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & masks->small))
+            return i + 1;
+    }
+    for (; i < limit; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & masks->large))
+            return i + 1;
+    }
+
+    // No boundary found: cut at the maximum size or the end of the input
+    if ((limit == params->max) || eof)
+        return limit;
+    return 0;
+}
+
+// Worker thread: checksum queued chunks until told to stop
+static void* cdc_worker(void* arg)
+{
+    struct cdc_pool* pool = arg;
+    struct cdc_job* job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while ((pool->head == NULL) && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->head == NULL)
+            break;
+
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->status = hash_buffer(pool->api, job->data, job->len, job->digest);
+
+        pthread_mutex_lock(&pool->lock);
+        --job->slab->pending;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Add a chunk to the end of the work queue
+static void queue_job(struct cdc_pool* pool, struct cdc_job* job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    ++job->slab->pending;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for all of a slab's chunks, display their results and empty it
+static int retire_slab(struct cdc_pool* pool, struct cdc_slab* slab)
+{
+    struct cdc_job* job;
+    int retval = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (slab->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (job = slab->jobs; job < &slab->jobs[slab->njobs]; ++job)
+    {
+        if (job->status)
+        {
+            fprintf(stderr, "Error processing chunk at offset %"PRIu64"\n", job->offset);
+            retval = 1;
+            continue;
+        }
+        printf("%"PRIu64" %zu ", job->offset, job->len);
+        print_digest(stdout, job->digest, pool->api->output_size);
+    }
+    slab->njobs = 0;
+
+    return retval;
+}
@@ -17,39 +17,89 @@
  * Flexible checksum utility
  */
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "method.h"
-
-// Structure for making a list of APIs
-struct method_list
-{
-    struct method_api*  api;
-    struct method_list* next;
-};
-static struct method_list* list = NULL;
-static struct method_list* list_tail = NULL;
+#include <unistd.h>
+#include "checksum.h"
 
 static struct method_api*  current_api = NULL;
 static FILE*               input = NULL;
 
+// Size of the read buffer when the method doesn't specify one
+#define DEFAULT_BUFFER_SIZE   (256 * 1024)
+
+// Read buffer size per thread for multi-threaded methods
+#define THREAD_BUFFER_SIZE    (1024 * 1024)
+
+// Most threads that may be asked for
+#define MAX_THREADS           256
+
+// A read buffer for that many threads must fit in a size_t
+_Static_assert(MAX_THREADS <= SIZE_MAX / THREAD_BUFFER_SIZE,
+               "read buffer for MAX_THREADS threads overflows size_t");
+
+// Largest key accepted by keyed methods, in bytes
+#define MAX_KEY_SIZE          4096
+
+// Smallest allowed minimum chunk size for content-defined chunking
+#define MIN_CHUNK_SIZE        64
+
+// Block size for diff mode when none is given
+#define DEFAULT_DIFF_BLOCK    (1024 * 1024)
+
+// Files opened ahead of the one being checksummed, for lists of files
+#define DEFAULT_READAHEAD     8
+
+// Most files that may be opened ahead
+#define MAX_READAHEAD         1024
+
 // Local function prototypes
 static void usage           (FILE* stream);
 static void cleanup         (void);
-static int  register_method (struct method_api* api);
-static int  register_methods(void);
+static int  parse_size_arg  (const char* str, size_t* value);
+static int  parse_rate      (const char* str, uint64_t* value);
+static long parse_key       (const char* str, uint8_t* key);
+static long read_key        (const char* path, uint8_t* key);
+static int  parse_delim     (const char* str);
+static size_t read_buffer_size(struct method_api* api, unsigned threads);
 
 
 
 int main(int argc, char** argv)
 {
     int retval;
-    struct method_list* ptr;
     struct context ctx;
     void* buf;
     size_t buf_size;
     size_t ret;
+    int argi;
+    unsigned threads = 1;
+    struct cdc_params cdc = { 0, 0, 0 };
+    uint64_t block_size = 0;
+    uint64_t max_mismatches = 0;
+    int diff = 0;
+    int find_dupes = 0;
+    int tar = 0;
+    const char* files_from = NULL;
+    unsigned readahead = DEFAULT_READAHEAD;
+    int stats = 0;
+    const char* serve_path = NULL;
+    int tee = 0;
+    const char* digest_path = NULL;
+    FILE* digest_out = stdout;
+    uint64_t max_rate = 0;
+    int adaptive = 0;
+    int idle = 0;
+    uint64_t start;
+    uint8_t key[MAX_KEY_SIZE];
+    long key_len = -1;
+    int delim = -1;
+    int fd_a, fd_b;
+    int sparse;
+    uint8_t digest[MAX_OUTPUT_SIZE];
 
     // Register cleanup function
     atexit(&cleanup);
@@ -69,35 +119,341 @@ int main(int argc, char** argv)
         usage(stderr);
         return 1;
     }
-    if ((strcmp(argv[1], "-h") == 0) || (strcmp(argv[1], "--help") == 0))
+
+    // Options come before the method
+    for (argi = 1; argi < argc; ++argi)
+    {
+        if ((strcmp(argv[argi], "-h") == 0) || (strcmp(argv[argi], "--help") == 0))
+        {
+            // TODO: add support for method-specific help, a la "-h -sha256"
+            usage(stdout);
+            return 0;
+        }
+        else if ((strcmp(argv[argi], "-t") == 0) || (strcmp(argv[argi], "--threads") == 0))
+        {
+            if ((++argi >= argc) || parse_uint(argv[argi], &threads) ||
+                (threads == 0) || (threads > MAX_THREADS))
+            {
+                fprintf(stderr, "Invalid thread count (at most %i threads)\n", MAX_THREADS);
+                usage(stderr);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--cdc") == 0)
+        {
+            if ((++argi >= argc) || parse_size_arg(argv[argi], &cdc.avg))
+            {
+                fprintf(stderr, "Invalid average chunk size\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--cdc-min") == 0)
+        {
+            if ((++argi >= argc) || parse_size_arg(argv[argi], &cdc.min))
+            {
+                fprintf(stderr, "Invalid minimum chunk size\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--cdc-max") == 0)
+        {
+            if ((++argi >= argc) || parse_size_arg(argv[argi], &cdc.max))
+            {
+                fprintf(stderr, "Invalid maximum chunk size\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--block-size") == 0)
+        {
+            if ((++argi >= argc) || parse_size(argv[argi], &block_size) || (block_size == 0))
+            {
+                fprintf(stderr, "Invalid block size\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--serve") == 0)
+        {
+            if (++argi >= argc)
+            {
+                fprintf(stderr, "No socket path given\n");
+                return 1;
+            }
+            serve_path = argv[argi];
+        }
+        else if (strcmp(argv[argi], "--tee") == 0)
+        {
+            tee = 1;
+        }
+        else if (strcmp(argv[argi], "--digest-file") == 0)
+        {
+            if (++argi >= argc)
+            {
+                fprintf(stderr, "No digest file given\n");
+                return 1;
+            }
+            digest_path = argv[argi];
+        }
+        else if (strcmp(argv[argi], "--files-from") == 0)
+        {
+            if (++argi >= argc)
+            {
+                fprintf(stderr, "No file list given\n");
+                return 1;
+            }
+            files_from = argv[argi];
+        }
+        else if (strcmp(argv[argi], "--readahead") == 0)
+        {
+            if ((++argi >= argc) || parse_uint(argv[argi], &readahead) ||
+                (readahead > MAX_READAHEAD))
+            {
+                fprintf(stderr, "Invalid readahead depth (at most %i files)\n", MAX_READAHEAD);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--stats") == 0)
+        {
+            stats = 1;
+        }
+        else if (strcmp(argv[argi], "--tar") == 0)
+        {
+            tar = 1;
+        }
+        else if (strcmp(argv[argi], "--per-line") == 0)
+        {
+            delim = '\n';
+        }
+        else if (strcmp(argv[argi], "--per-record") == 0)
+        {
+            if ((++argi >= argc) || ((delim = parse_delim(argv[argi])) < 0))
+            {
+                fprintf(stderr, "Invalid record delimiter\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--max-rate") == 0)
+        {
+            if ((++argi >= argc) || parse_rate(argv[argi], &max_rate))
+            {
+                fprintf(stderr, "Invalid rate\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--adaptive") == 0)
+        {
+            adaptive = 1;
+        }
+        else if (strcmp(argv[argi], "--idle") == 0)
+        {
+            idle = 1;
+        }
+        else if (strcmp(argv[argi], "--key") == 0)
+        {
+            if ((++argi >= argc) || ((key_len = parse_key(argv[argi], key)) < 0))
+            {
+                fprintf(stderr, "Invalid key (expected up to %i hex bytes)\n", MAX_KEY_SIZE);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--key-file") == 0)
+        {
+            if ((++argi >= argc) || ((key_len = read_key(argv[argi], key)) < 0))
+            {
+                fprintf(stderr, "Unable to read key file\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--diff") == 0)
+        {
+            diff = 1;
+        }
+        else if (strcmp(argv[argi], "--find-dupes") == 0)
+        {
+            find_dupes = 1;
+        }
+        else if (strcmp(argv[argi], "--max-mismatches") == 0)
+        {
+            if ((++argi >= argc) || parse_size(argv[argi], &max_mismatches))
+            {
+                fprintf(stderr, "Invalid mismatch count\n");
+                return 1;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    if ((cdc.avg != 0) && ((block_size != 0) || diff))
+    {
+        fprintf(stderr, "--cdc cannot be combined with --block-size or --diff\n");
+        return 1;
+    }
+    if ((delim >= 0) && ((cdc.avg != 0) || (block_size != 0) || diff || tee))
+    {
+        fprintf(stderr, "--per-line and --per-record cannot be combined with other modes\n");
+        return 1;
+    }
+    if (tee && ((cdc.avg != 0) || (block_size != 0) || diff))
+    {
+        fprintf(stderr, "--tee cannot be combined with --cdc, --block-size or --diff\n");
+        return 1;
+    }
+    if (tar && ((cdc.avg != 0) || (block_size != 0) || diff || tee || (delim >= 0)))
+    {
+        fprintf(stderr, "--tar cannot be combined with other modes\n");
+        return 1;
+    }
+    if (find_dupes && (tar || (cdc.avg != 0) || (block_size != 0) || diff || tee || (delim >= 0)))
+    {
+        fprintf(stderr, "--find-dupes cannot be combined with other modes\n");
+        return 1;
+    }
+    if (((files_from != NULL) || stats) && (find_dupes || diff))
+    {
+        fprintf(stderr, "--files-from and --stats cannot be combined with --find-dupes or --diff\n");
+        return 1;
+    }
+    if ((digest_path != NULL) && !tee)
+    {
+        fprintf(stderr, "--digest-file requires --tee\n");
+        return 1;
+    }
+    if (adaptive && (max_rate == 0))
+    {
+        fprintf(stderr, "--adaptive requires --max-rate\n");
+        return 1;
+    }
+    if ((max_mismatches != 0) && !diff)
+    {
+        fprintf(stderr, "--max-mismatches requires --diff\n");
+        return 1;
+    }
+    if (((cdc.min != 0) || (cdc.max != 0)) && (cdc.avg == 0))
     {
-        // TODO: add support for method-specific help, a la "-h -sha256"
-        usage(stdout);
-        return 0;
+        fprintf(stderr, "--cdc-min and --cdc-max require --cdc\n");
+        return 1;
     }
-    for (ptr = list; ptr != NULL; ptr = ptr->next)
+    if (cdc.avg != 0)
     {
-        if (strcmp(argv[1], ptr->api->args) == 0)
+        // Default to the limits suggested by the FastCDC paper
+        if (cdc.min == 0)
+            cdc.min = cdc.avg / 4;
+        if (cdc.max == 0)
+            cdc.max = cdc.avg * 8;
+        if ((cdc.min < MIN_CHUNK_SIZE) || (cdc.min > cdc.avg) || (cdc.avg >= cdc.max))
         {
-            current_api = ptr->api;
-            //printf("Using method \"%s\"\n", ptr->api->name);
-            break;
+            fprintf(stderr, "Chunk sizes must satisfy %i <= min <= avg < max\n", MIN_CHUNK_SIZE);
+            return 1;
         }
     }
+
+    // Background operation applies to every mode, and to every thread
+    // started from here on
+    throttle_init(max_rate, adaptive);
+    if (idle && set_idle())
+        fprintf(stderr, "Unable to lower priority\n");
+
+    // Daemon mode takes its methods and files from its clients
+    if (serve_path != NULL)
+    {
+        if ((argi < argc) || (key_len >= 0) || (cdc.avg != 0) || (block_size != 0) ||
+            diff || tee || (delim >= 0) || find_dupes || tar || (files_from != NULL) || stats)
+        {
+            fprintf(stderr, "--serve cannot be combined with a method, key, file or mode\n");
+            return 1;
+        }
+        return serve_run(serve_path, threads);
+    }
+
+    if (argi >= argc)
+    {
+        fprintf(stderr, "No method specified\n");
+        usage(stderr);
+        return 1;
+    }
+    current_api = find_method(argv[argi]);
     if (current_api == NULL)
     {
-        fprintf(stderr, "Unsupported argument: %s\n", argv[1]);
+        fprintf(stderr, "Unsupported argument: %s\n", argv[argi]);
         usage(stderr);
         return 1;
     }
+    ++argi;
+
+    // Keyed methods
+    if (key_len >= 0)
+    {
+        if (current_api->set_key == NULL)
+        {
+            fprintf(stderr, "Method %s does not take a key\n", current_api->args);
+            return 1;
+        }
+        if (current_api->set_key(key, key_len))
+            return 1;
+    }
+
+    // Duplicate finding takes any number of directories
+    if (find_dupes)
+    {
+        if (argi >= argc)
+        {
+            fprintf(stderr, "No directory specified\n");
+            return 1;
+        }
+        return dupes_run(current_api, &argv[argi], argc - argi, threads);
+    }
+
+    // Diff mode takes two input files
+    if (diff)
+    {
+        if (argi + 2 != argc)
+        {
+            fprintf(stderr, "Diff mode needs exactly two input files\n");
+            return 2;
+        }
+        fd_a = open(argv[argi], O_RDONLY);
+        if (fd_a < 0)
+        {
+            fprintf(stderr, "Unable to open file '%s'\n", argv[argi]);
+            return 2;
+        }
+        fd_b = open(argv[argi + 1], O_RDONLY);
+        if (fd_b < 0)
+        {
+            fprintf(stderr, "Unable to open file '%s'\n", argv[argi + 1]);
+            close(fd_a);
+            return 2;
+        }
+        PROBE2(file_open, current_api->type, argv[argi]);
+        PROBE2(file_open, current_api->type, argv[argi + 1]);
+        retval = diff_run(current_api, fd_a, fd_b,
+                          block_size ? block_size : DEFAULT_DIFF_BLOCK,
+                          max_mismatches, threads);
+        close(fd_a);
+        close(fd_b);
+        return retval;
+    }
+
+    // Lists of files are checksummed one after another
+    if ((argc - argi > 1) || (files_from != NULL) || stats)
+    {
+        if (tee || tar || (delim >= 0) || (cdc.avg != 0) || (block_size != 0))
+        {
+            fprintf(stderr, "This mode takes a single input file\n");
+            return 1;
+        }
+        return files_run(current_api, &argv[argi], argc - argi, files_from, threads,
+                         read_buffer_size(current_api, threads), readahead, stats);
+    }
 
     // Open input file
-    if (argc < 3)
+    if (argi >= argc)
     {
         fprintf(stderr, "No input file specified\n");
         return 1;
     }
-    if (strcmp(argv[2], "-") == 0)
+    if (strcmp(argv[argi], "-") == 0)
     {
         // Use stdin instead of a file
         input = stdin;
@@ -105,18 +461,55 @@ int main(int argc, char** argv)
     else
     {
         // Read data from a file
-        input = fopen(argv[2], "rb");
+        input = fopen(argv[argi], "rb");
         if (input == NULL)
         {
-            fprintf(stderr, "Unable to open file '%s'\n", argv[2]);
+            fprintf(stderr, "Unable to open file '%s'\n", argv[argi]);
             return 1;
         }
     }
+    PROBE2(file_open, current_api->type, argv[argi]);
 
 
+    // Content-defined chunking, block lists, records and archives have
+    // processing loops of their own
+    if (tar)
+    {
+        return tar_run(current_api, input);
+    }
+    if (delim >= 0)
+    {
+        return records_run(current_api, input, delim);
+    }
+    if (cdc.avg != 0)
+    {
+        return cdc_run(current_api, input, &cdc, threads);
+    }
+    if (block_size != 0)
+    {
+        return blocks_run(current_api, fileno(input), block_size, threads);
+    }
+
+    // In pass-through mode, standard output carries the data
+    if (tee)
+    {
+        digest_out = stderr;
+        if (digest_path != NULL)
+        {
+            digest_out = fopen(digest_path, "w");
+            if (digest_out == NULL)
+            {
+                fprintf(stderr, "Unable to open file '%s'\n", digest_path);
+                return 1;
+            }
+        }
+    }
+
     // Initialize context information
     ctx.which = current_api->type;
     ctx.context = NULL;
+    ctx.threads = threads;
+    ctx.preallocated = 0;
     if (current_api->sum_init(&ctx))
     {
         fprintf(stderr, "Unable to initialize algorithm\n");
@@ -124,80 +517,170 @@ int main(int argc, char** argv)
     }
 
     // Perform checksum
-    buf_size = current_api->chunk_size;
-    if (buf_size == 0)
-        buf_size = 256 * 1024; // default to something relatively sensible
+    buf_size = read_buffer_size(current_api, threads);
     buf = malloc(buf_size);
     if (buf == NULL)
     {
         fprintf(stderr, "Unable to allocate memory\n");
         return 1;
     }
-    while(1)
+    if (tee)
     {
-        ret = fread(buf, 1, buf_size, input);
-        if (ret == buf_size)
+        // Pass-through mode has its own copying loop
+        if (tee_run(current_api, &ctx, fileno(input), STDOUT_FILENO, buf, buf_size))
         {
-            // Read successful, process this block
-            if (current_api->sum_process(&ctx, buf, buf_size))
+            free(buf);
+            return 1;
+        }
+    }
+    else if ((sparse = sparse_read(current_api, &ctx, fileno(input), buf, buf_size)) > 0)
+    {
+        // Regular files are read by extent, without reading their holes
+        free(buf);
+        return 1;
+    }
+    else if (sparse < 0)
+    {
+        while(1)
+        {
+            start = throttle_start();
+            ret = fread(buf, 1, buf_size, input);
+            throttle_read(ret, start);
+            PROBE2(read_done, current_api->type, ret);
+            if (ret == buf_size)
             {
-                fprintf(stderr, "Error processing data\n");
+                // Read successful, process this block
+                if (method_process(current_api, &ctx, buf, buf_size))
+                {
+                    fprintf(stderr, "Error processing data\n");
+                    free(buf);
+                    return 1;
+                }
+                continue;
+            }
+
+            // Read less than expected, find out why
+            if (!feof(input))
+            {
+                fprintf(stderr, "Error reading from %s\n", (input == stdin) ? "stdin" : "input file");
                 free(buf);
                 return 1;
             }
-            continue;
-        }
 
-        // Read less than expected, find out why
-        if (!feof(input))
-        {
-            fprintf(stderr, "Error reading from %s\n", (input == stdin) ? "stdin" : "input file");
-            free(buf);
-            return 1;
-        }
-
-        // Reached the end of the input, so process the final partial block
-        if (current_api->sum_process(&ctx, buf, ret))
-        {
-            fprintf(stderr, "Error processing data\n");
-            free(buf);
-            return 1;
-        }
+            // Reached the end of the input, so process the final partial block
+            if (method_process(current_api, &ctx, buf, ret))
+            {
+                fprintf(stderr, "Error processing data\n");
+                free(buf);
+                return 1;
+            }
 
-        // No more input to process
-        break;
-    };
+            // No more input to process
+            break;
+        };
+    }
     free(buf);
 
     // Output result
-    if (current_api->sum_finish(&ctx))
+    if (method_finish(current_api, &ctx, digest))
     {
         fprintf(stderr, "Error finalizing checksum\n");
         return 1;
     }
+    print_digest(digest_out, digest, current_api->output_size);
+    if ((digest_out != stdout) && (digest_out != stderr) && fclose(digest_out))
+    {
+        fprintf(stderr, "Unable to write file '%s'\n", digest_path);
+        return 1;
+    }
 
     // Clean up and exit
     return 0;
 }
 
+// Size of the read buffer for checksumming a whole input
+static size_t read_buffer_size(struct method_api* api, unsigned threads)
+{
+    if (api->chunk_size != 0)
+        return api->chunk_size;
+
+    // default to something relatively sensible, giving each thread
+    // a decent share of every read
+    if (threads > 1)
+        return (size_t)threads * THREAD_BUFFER_SIZE;
+    return DEFAULT_BUFFER_SIZE;
+}
+
 // Display usage information for the program and all known methods
 // Argument 'stream' should be either 'stdout' or 'stderr'.
 static void usage(FILE* stream)
 {
-    struct method_list* ptr;
+    const struct method_list* ptr;
 
     // Program usage info
     // NOTE: flag begins on column 2, description on column 15
-    fprintf(stream, "Usage: checksum [options] [method] file\n");
+    fprintf(stream, "Usage: checksum [options] [method] file...\n");
+    fprintf(stream, "       checksum --diff [options] [method] file1 file2\n");
+    fprintf(stream, "       checksum --find-dupes [options] [method] dir...\n");
+    fprintf(stream, "       checksum --serve SOCKET [options]\n");
     fprintf(stream, "Options:\n");
     fprintf(stream, "  -h, --help   Display this information\n");
+    fprintf(stream, "  -t, --threads N\n");
+    fprintf(stream, "               Use up to N threads, for methods that support it\n");
+    fprintf(stream, "  --cdc AVG    Split the input into content-defined chunks of AVG bytes\n");
+    fprintf(stream, "               on average and display a checksum for each chunk\n");
+    fprintf(stream, "  --cdc-min N, --cdc-max N\n");
+    fprintf(stream, "               Chunk size limits (default AVG/4 and AVG*8)\n");
+    fprintf(stream, "  --block-size N\n");
+    fprintf(stream, "               Display a checksum for each N-byte block of the input\n");
+    fprintf(stream, "  --diff       Compare two files (given after the method) block by block\n");
+    fprintf(stream, "               and display the ranges that differ.  Exits with 0 if the\n");
+    fprintf(stream, "               files are the same, 1 if they differ and 2 on error\n");
+    fprintf(stream, "  --max-mismatches K\n");
+    fprintf(stream, "               In diff mode, stop after K differing blocks\n");
+    fprintf(stream, "  --files-from LIST\n");
+    fprintf(stream, "               Also checksum the files listed in LIST, one path per line.\n");
+    fprintf(stream, "               With more than one file, each checksum is followed by\n");
+    fprintf(stream, "               its file's path\n");
+    fprintf(stream, "  --readahead N\n");
+    fprintf(stream, "               With more than one file, open up to N files (default %i)\n", DEFAULT_READAHEAD);
+    fprintf(stream, "               ahead of the one being checksummed and start reading\n");
+    fprintf(stream, "               them into the cache; 0 turns this off\n");
+    fprintf(stream, "  --stats      Display the amount of data checksummed, the rate and\n");
+    fprintf(stream, "               the readahead depth on standard error at the end\n");
+    fprintf(stream, "  --find-dupes Find files with the same contents under the directories\n");
+    fprintf(stream, "               given after the method and display them in groups.  Only\n");
+    fprintf(stream, "               files that match in size and in their first and last few\n");
+    fprintf(stream, "               KiB are read in full\n");
+    fprintf(stream, "  --per-line   Display a checksum for each line of the input\n");
+    fprintf(stream, "  --per-record DELIM\n");
+    fprintf(stream, "               Display a checksum for each record of the input, where\n");
+    fprintf(stream, "               records end with the character DELIM ('\\0' for NUL)\n");
+    fprintf(stream, "  --tar        Read the input as a tar archive and display a checksum for\n");
+    fprintf(stream, "               each file in it, without extracting anything\n");
+    fprintf(stream, "  --tee        Copy the input to standard output unchanged and display\n");
+    fprintf(stream, "               the checksum on standard error\n");
+    fprintf(stream, "  --digest-file FILE\n");
+    fprintf(stream, "               With --tee, write the checksum to FILE instead\n");
+    fprintf(stream, "  --key HEX    Key for keyed methods, as hexadecimal bytes\n");
+    fprintf(stream, "  --key-file FILE\n");
+    fprintf(stream, "               Key for keyed methods, read from FILE as-is\n");
+    fprintf(stream, "  --max-rate N\n");
+    fprintf(stream, "               Read at most N MB (2^20 bytes) per second, over all threads\n");
+    fprintf(stream, "  --adaptive   With --max-rate, slow down further while reads are taking\n");
+    fprintf(stream, "               longer than usual (storage busy with other work)\n");
+    fprintf(stream, "  --idle       Run at idle I/O priority and the lowest CPU priority\n");
+    fprintf(stream, "  --serve SOCKET\n");
+    fprintf(stream, "               Run as a daemon, checksumming files for clients that\n");
+    fprintf(stream, "               connect to the Unix socket SOCKET (see serve.c for the\n");
+    fprintf(stream, "               protocol).  Uses N worker threads from --threads\n");
     fprintf(stream, "\n");
 
     // Method-specific info
     fprintf(stream, "Methods:\n");
-    for (ptr = list; ptr != NULL; ptr = ptr->next)
+    for (ptr = method_list(); ptr != NULL; ptr = ptr->next)
     {
-        fprintf(stream, "  %-10.10s   %s\n", ptr->api->args, ptr->api->name);
+        fprintf(stream, "  %-11.11s  %s\n", ptr->api->args, ptr->api->name);
     }
 
     // Other information
@@ -206,18 +689,8 @@ static void usage(FILE* stream)
 
 static void cleanup(void)
 {
-    struct method_list* ptr;
-
-    // Recursively free memory
-    while (list != NULL)
-    {
-        ptr = list;
-        list = list->next;
-        free(ptr);
-    }
-
-    // Clear out pointers
-    list = list_tail = NULL;
+    // Free memory and clear out pointers
+    unregister_methods();
     current_api = NULL;
 
     // Close files
@@ -229,56 +702,89 @@ static void cleanup(void)
 }
 
 
-// Register a specific checksum method's API
-static int register_method(struct method_api* api)
+// Parse a size argument (see parse_size()) that must fit in memory
+static int parse_size_arg(const char* str, size_t* value)
 {
-    struct method_list* entry;
+    uint64_t result;
 
-    if (api == NULL)
-    {
+    if (parse_size(str, &result) || (result > SIZE_MAX / 16))
         return -1;
-    }
 
-    // Allocate a new list entry
-    entry = malloc(sizeof(*entry));
-    if (entry == NULL)
-    {
+    *value = result;
+    return 0;
+}
+
+// Parse a rate in MB per second, which may have a fractional part
+static int parse_rate(const char* str, uint64_t* value)
+{
+    double result;
+    char* end;
+
+    if ((*str < '0') || (*str > '9'))
+        return -1;
+    result = strtod(str, &end);
+    if ((*end != '\0') || (result * (1 << 20) < 1) || (result > 1e9))
         return -1;
-    }
-    entry->api = api;
-    entry->next = NULL;
 
-    // Add entry to list
-    if (list == NULL)
-    {
-        list = entry;
-    }
-    if (list_tail != NULL)
+    *value = result * (1 << 20);
+    return 0;
+}
+
+// Parse a key given as hexadecimal bytes.  Returns its length in bytes,
+// or -1 on error.
+static long parse_key(const char* str, uint8_t* key)
+{
+    size_t len = strlen(str);
+    size_t i;
+    unsigned byte;
+
+    if ((len % 2) || (len / 2 > MAX_KEY_SIZE))
+        return -1;
+    for (i = 0; i < len / 2; ++i)
     {
-        list_tail->next = entry;
+        if (!isxdigit((unsigned char)str[2 * i]) || !isxdigit((unsigned char)str[2 * i + 1]) ||
+            (sscanf(&str[2 * i], "%2x", &byte) != 1))
+            return -1;
+        key[i] = byte;
     }
-    list_tail = entry;
 
-    return 0;
+    return len / 2;
 }
 
-// Helper macro to avoid duplicate code
-#define register_it(x) \
-do {\
-    int ret;\
-    ret = register_method(x);\
-    if (ret) return ret;\
-} while(0)
-
-// Register all checksum method APIs
-static int register_methods(void)
+// Read a key from a file.  Returns its length in bytes, or -1 on error.
+static long read_key(const char* path, uint8_t* key)
 {
-    register_it(&simple_8);
-    register_it(&simple_16);
-    register_it(&simple_32);
-    register_it(&simple_64);
-    register_it(&sha256);
+    FILE* file;
+    size_t len;
 
-    return 0;
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+    len = fread(key, 1, MAX_KEY_SIZE, file);
+
+    // Too long, or unreadable
+    if ((fgetc(file) != EOF) || ferror(file))
+        len = (size_t)-1;
+    fclose(file);
+
+    return (long)len;
 }
 
+// Parse a record delimiter: a single character, or one of the escapes
+// \0, \n, \t and \\.  Returns the character, or -1 on error.
+static int parse_delim(const char* str)
+{
+    if ((str[0] != '\0') && (str[1] == '\0'))
+        return (unsigned char)str[0];
+    if ((str[0] != '\\') || (str[1] == '\0') || (str[2] != '\0'))
+        return -1;
+
+    switch (str[1])
+    {
+        case '0':  return '\0';
+        case 'n':  return '\n';
+        case 't':  return '\t';
+        case '\\': return '\\';
+        default:   return -1;
+    }
+}
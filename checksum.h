@@ -0,0 +1,97 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Flexible checksum utility.
+ *
+ * Structures and functions shared by the program's processing modes.
+ */
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "method.h"
+#include "probes.h"
+
+// Structure for making a list of APIs
+struct method_list
+{
+    struct method_api*  api;
+    struct method_list* next;
+};
+
+// Chunk size limits for content-defined chunking, in bytes
+struct cdc_params
+{
+    size_t min;
+    size_t avg;
+    size_t max;
+};
+
+
+// List of known methods
+int                       register_methods  (void);
+void                      unregister_methods(void);
+const struct method_list* method_list       (void);
+struct method_api*        find_method       (const char* args);
+size_t                    max_context_size  (void);
+
+// Utility functions
+void print_digest   (FILE* stream, const uint8_t* digest, size_t size);
+size_t format_digest(char* out, const uint8_t* digest, size_t size);
+int  method_process (struct method_api* api, struct context* ctx,
+                     void* data, size_t len);
+int  method_finish  (struct method_api* api, struct context* ctx,
+                     uint8_t* digest);
+int  method_zeros   (struct method_api* api, struct context* ctx, uint64_t len);
+int  method_batch   (struct method_api* api, size_t count,
+                     const uint8_t* const* msgs, const size_t* lens,
+                     uint8_t* digests);
+int  hash_buffer    (struct method_api* api, const void* data, size_t len,
+                     uint8_t* digest);
+int  parse_uint     (const char* str, unsigned* value);
+int  parse_size     (const char* str, uint64_t* value);
+
+// Background operation
+void     throttle_init  (uint64_t rate, int adaptive);
+uint64_t throttle_start (void);
+void     throttle_read  (size_t bytes, uint64_t start);
+int      set_idle       (void);
+
+// Processing modes
+int  cdc_run        (struct method_api* api, FILE* input,
+                     const struct cdc_params* params, unsigned threads);
+int  blocks_run     (struct method_api* api, int fd, uint64_t block_size,
+                     unsigned threads);
+int  diff_run       (struct method_api* api, int fd_a, int fd_b,
+                     uint64_t block_size, uint64_t max_mismatches,
+                     unsigned threads);
+int  dupes_run      (struct method_api* api, char** dirs, int ndirs,
+                     unsigned threads);
+int  files_run      (struct method_api* api, char** args, size_t nargs,
+                     const char* list, unsigned threads, size_t buf_size,
+                     unsigned depth, int stats);
+int  records_run    (struct method_api* api, FILE* input, int delim);
+int  serve_run      (const char* path, unsigned threads);
+int  sparse_read    (struct method_api* api, struct context* ctx, int fd,
+                     uint8_t* buf, size_t buf_size);
+int  tar_run        (struct method_api* api, FILE* input);
+int  tee_run        (struct method_api* api, struct context* ctx, int in,
+                     int out, uint8_t* buf, size_t buf_size);
+
+#endif
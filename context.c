@@ -0,0 +1,57 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Method context storage.
+ *
+ * Methods get the storage for their context structures from here.  A
+ * caller that checksums many inputs can hand the same storage to every
+ * checksum (see 'preallocated' in struct context), so that no memory is
+ * allocated or freed per checksum.
+ */
+
+#include <stdlib.h>
+#include "method.h"
+
+
+// Get storage for a method's context structure: the caller's, if it
+// supplied some, or else a fresh 64-byte aligned block
+void* context_alloc(struct context* ctx, size_t size)
+{
+    void* context;
+
+    if (ctx->preallocated)
+        return ctx->context;
+
+    // Ditch any old buffer, if present
+    free(ctx->context);
+    ctx->context = NULL;
+
+    if (posix_memalign(&context, CONTEXT_ALIGN, size))
+        return NULL;
+    ctx->context = context;
+
+    return context;
+}
+
+// Release a method's context storage, unless it belongs to the caller
+void context_free(struct context* ctx)
+{
+    if (ctx->preallocated)
+        return;
+
+    free(ctx->context);
+    ctx->context = NULL;
+}
@@ -0,0 +1,727 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Duplicate file finder
+ *
+ * Finds regular files with identical contents under a set of directories
+ * and prints them in groups, one file per line:
+ *   <checksum> <path>
+ * with a blank line after each group.  Groups come largest files first.
+ *
+ * Files are narrowed down in stages, so that most of them are never read
+ * in full:
+ *  1. Files are grouped by size.  A file with a size of its own can't
+ *     have a duplicate, and isn't read at all.
+ *  2. Files that share a size are checksummed over their first and last
+ *     EDGE_SIZE bytes only.  For files no bigger than that, this is the
+ *     whole file.
+ *  3. Files that still share a size and partial checksum are checksummed
+ *     in full.
+ *  4. For methods that aren't cryptographic hashes, whose checksums can
+ *     easily collide, files that share a full checksum are compared byte
+ *     for byte.  Only files found to be identical are printed as a group;
+ *     a set of files with one checksum may make up several groups, or
+ *     none.  With a cryptographic hash, equal checksums are taken to mean
+ *     equal contents, and nothing is read again.
+ *
+ * Notes:
+ *  - Symbolic links are not followed, and empty files are ignored.
+ *  - A file reached through several hard links is only considered once,
+ *    since removing one of its names saves no space.
+ *  - Stages 2 to 4 are spread over worker threads, each with its own
+ *    read buffer and method context.
+ *  - Files that can't be read are reported and left out; the exit status
+ *    is then non-zero, but the other groups are still printed.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.h"
+
+// Bytes read from each end of a file in the partial stage
+#define EDGE_SIZE       (4 * 1024)
+
+// Read buffer size for the full stage
+#define IO_SIZE         (1024 * 1024)
+
+// What a worker does to each file
+enum dupe_stage
+{
+    STAGE_EDGES,
+    STAGE_FULL,
+    STAGE_COMPARE,
+};
+
+// A candidate file
+struct dupe_file
+{
+    char*    path;
+    uint64_t size;
+    dev_t    dev;
+    ino_t    ino;
+    int      status;                    // non-zero if it couldn't be read
+    int      full;                      // digest covers the whole file
+    uint8_t  digest[MAX_OUTPUT_SIZE];
+
+    // first file of the group of identical files this one is in, if any
+    struct dupe_file* same;
+};
+
+// Files that share a size and full checksum
+struct dupe_group
+{
+    struct dupe_file** files;
+    size_t             count;
+};
+
+// All the files found
+struct dupe_list
+{
+    struct dupe_file* files;
+    size_t            count;
+    size_t            alloc;
+};
+
+// Work shared by the workers of one stage
+struct dupe_pool
+{
+    pthread_mutex_t    lock;
+    struct method_api* api;
+    enum dupe_stage    stage;
+    struct dupe_file** work;            // files to checksum, or
+    struct dupe_group* groups;          // groups to compare
+    size_t             count;
+    size_t             next;
+};
+
+// Local function prototypes
+static int      scan_dir        (struct dupe_list* list, const char* path);
+static int      add_file        (struct dupe_list* list, const char* path,
+                                 const struct stat* st);
+static int      run_stage       (struct method_api* api, enum dupe_stage stage,
+                                 struct dupe_file** work,
+                                 struct dupe_group* groups, size_t count,
+                                 unsigned threads);
+static void*    dupe_worker     (void* arg);
+static int      hash_file       (struct method_api* api, enum dupe_stage stage,
+                                 struct dupe_file* file, void* storage,
+                                 uint8_t* buf);
+static int      hash_range      (struct method_api* api, struct context* ctx,
+                                 int fd, uint64_t offset, uint64_t len,
+                                 uint8_t* buf, size_t buf_size);
+static size_t   collisions      (struct dupe_file** work, size_t count,
+                                 size_t digest_size);
+static void     confirm_group   (struct method_api* api,
+                                 struct dupe_group* group, uint8_t* buf);
+static int      same_contents   (struct method_api* api, struct dupe_file* a,
+                                 struct dupe_file* b, uint8_t* buf);
+static int      read_fully      (struct method_api* api, int fd, uint8_t* buf,
+                                 size_t len, uint64_t offset);
+static int      compare_inode   (const void* a, const void* b);
+static int      compare_digest  (const void* a, const void* b);
+static int      same_digest     (const struct dupe_file* a,
+                                 const struct dupe_file* b, size_t digest_size);
+
+// Digest size for compare_digest(), which qsort() can't pass in
+static size_t compare_size;
+
+
+// Find and display groups of identical files under the given directories
+int dupes_run(struct method_api* api, char** dirs, int ndirs, unsigned threads)
+{
+    struct dupe_list list = { NULL, 0, 0 };
+    struct dupe_file** work = NULL;
+    struct dupe_group* groups = NULL;
+    char line[2 * MAX_OUTPUT_SIZE + 4];
+    size_t i, j, k, first, count, ngroups, len;
+    int retval = 0;
+
+    for (i = 0; i < (size_t)ndirs; ++i)
+    {
+        if (scan_dir(&list, dirs[i]))
+            retval = 1;
+    }
+
+    // Stage 1: only files that share their size with another file (and
+    // aren't just another name for it) are worth reading
+    qsort(list.files, list.count, sizeof(*list.files), &compare_inode);
+    if (list.count > 0)
+        work = malloc(list.count * sizeof(*work));
+    if ((work == NULL) && (list.count > 0))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        retval = 1;
+    }
+    count = 0;
+    for (i = 0; (work != NULL) && (i < list.count); i = j)
+    {
+        first = count;
+        for (j = i; (j < list.count) && (list.files[j].size == list.files[i].size); ++j)
+        {
+            if ((count > first) && (work[count - 1]->dev == list.files[j].dev) &&
+                (work[count - 1]->ino == list.files[j].ino))
+                continue;
+            work[count++] = &list.files[j];
+        }
+        if (count - first < 2)
+            count = first;
+    }
+
+    // Stage 2: the ends of each file
+    if (run_stage(api, STAGE_EDGES, work, NULL, count, threads))
+        retval = 1;
+    count = collisions(work, count, api->output_size);
+
+    // Stage 3: the whole of each file that still collides
+    if (run_stage(api, STAGE_FULL, work, NULL, count, threads))
+        retval = 1;
+    count = collisions(work, count, api->output_size);
+
+    // What's left is sets of files with the same checksum, in order
+    if (count > 0)
+        groups = malloc(count * sizeof(*groups));
+    if ((groups == NULL) && (count > 0))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        retval = 1;
+        count = 0;
+    }
+    ngroups = 0;
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; (j < count) && same_digest(work[i], work[j], api->output_size); ++j)
+            ;
+        groups[ngroups].files = &work[i];
+        groups[ngroups].count = j - i;
+        ++ngroups;
+        for (k = i; k < j; ++k)
+            work[k]->same = work[i];
+    }
+
+    // Stage 4: unless the method is a cryptographic hash, make sure the
+    // files in each set really are identical
+    if (!api->crypto_hash && run_stage(api, STAGE_COMPARE, NULL, groups, ngroups, threads))
+        retval = 1;
+
+    for (i = 0; i < count; ++i)
+    {
+        if (work[i]->same == NULL)
+            continue;
+        len = format_digest(line, work[i]->digest, api->output_size) - 1;
+        printf("%.*s %s\n", (int)len, line, work[i]->path);
+        if ((i + 1 == count) || (work[i + 1]->same != work[i]->same))
+            printf("\n");
+    }
+
+    for (i = 0; i < list.count; ++i)
+        free(list.files[i].path);
+    free(list.files);
+    free(work);
+    free(groups);
+
+    return retval;
+}
+
+
+// Add all of the regular files under a directory to the list
+static int scan_dir(struct dupe_list* list, const char* path)
+{
+    DIR* dir;
+    struct dirent* entry;
+    struct stat st;
+    char* child;
+    size_t len;
+    int retval = 0;
+
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Unable to open directory '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    len = strlen(path);
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+            continue;
+
+        child = malloc(len + strlen(entry->d_name) + 2);
+        if (child == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            retval = 1;
+            break;
+        }
+        sprintf(child, "%s%s%s", path,
+                ((len > 0) && (path[len - 1] == '/')) ? "" : "/", entry->d_name);
+
+        if (lstat(child, &st) != 0)
+        {
+            fprintf(stderr, "Unable to examine '%s': %s\n", child, strerror(errno));
+            retval = 1;
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            if (scan_dir(list, child))
+                retval = 1;
+        }
+        else if (S_ISREG(st.st_mode) && (st.st_size > 0))
+        {
+            if (add_file(list, child, &st))
+            {
+                retval = 1;
+                break;
+            }
+            continue;
+        }
+        free(child);
+    }
+
+    closedir(dir);
+    return retval;
+}
+
+// Add a file to the list, which takes ownership of 'path'
+static int add_file(struct dupe_list* list, const char* path,
+                    const struct stat* st)
+{
+    struct dupe_file* files;
+    struct dupe_file* file;
+
+    if (list->count == list->alloc)
+    {
+        list->alloc = list->alloc ? 2 * list->alloc : 1024;
+        files = realloc(list->files, list->alloc * sizeof(*files));
+        if (files == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            free((char*)path);
+            return 1;
+        }
+        list->files = files;
+    }
+
+    file = &list->files[list->count++];
+    memset(file, 0, sizeof(*file));
+    file->path = (char*)path;
+    file->size = st->st_size;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+
+    return 0;
+}
+
+// Checksum a set of files (or compare groups of them), in parallel.  Files
+// that can't be read have their status set.
+static int run_stage(struct method_api* api, enum dupe_stage stage,
+                     struct dupe_file** work,
+                     struct dupe_group* groups, size_t count,
+                     unsigned threads)
+{
+    struct dupe_pool pool;
+    pthread_t* workers;
+    unsigned nworkers;
+    size_t i, j;
+    int retval = 0;
+
+    if (count == 0)
+        return 0;
+    if (threads == 0)
+        threads = 1;
+    if (threads > count)
+        threads = count;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.api = api;
+    pool.stage = stage;
+    pool.work = work;
+    pool.groups = groups;
+    pool.count = count;
+    pool.next = 0;
+
+    workers = calloc(threads, sizeof(*workers));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        pthread_mutex_destroy(&pool.lock);
+        return 1;
+    }
+    for (nworkers = 0; nworkers < threads; ++nworkers)
+    {
+        if (pthread_create(&workers[nworkers], NULL, &dupe_worker, &pool) != 0)
+            break;
+    }
+    if (nworkers == 0)
+    {
+        // Do the work here instead
+        fprintf(stderr, "Unable to start worker threads\n");
+        dupe_worker(&pool);
+    }
+    while (nworkers > 0)
+        pthread_join(workers[--nworkers], NULL);
+
+    for (i = 0; i < count; ++i)
+    {
+        if (stage != STAGE_COMPARE)
+        {
+            if (work[i]->status)
+                retval = 1;
+            continue;
+        }
+        for (j = 0; j < groups[i].count; ++j)
+        {
+            if (groups[i].files[j]->status)
+                retval = 1;
+        }
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    return retval;
+}
+
+// Worker thread: claim files and checksum them, or groups and compare them
+static void* dupe_worker(void* arg)
+{
+    struct dupe_pool* pool = arg;
+    struct dupe_file* file;
+    void* storage = NULL;
+    uint8_t* buf;
+    size_t next, i;
+
+    buf = malloc((pool->stage == STAGE_EDGES) ? 2 * EDGE_SIZE : IO_SIZE);
+    if (posix_memalign(&storage, CONTEXT_ALIGN, pool->api->context_size))
+        storage = NULL;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        next = pool->next;
+        if (next < pool->count)
+            ++pool->next;
+        pthread_mutex_unlock(&pool->lock);
+        if (next >= pool->count)
+            break;
+
+        if (pool->stage == STAGE_COMPARE)
+        {
+            if (buf != NULL)
+            {
+                confirm_group(pool->api, &pool->groups[next], buf);
+                continue;
+            }
+            fprintf(stderr, "Unable to allocate memory\n");
+            for (i = 0; i < pool->groups[next].count; ++i)
+            {
+                pool->groups[next].files[i]->status = 1;
+                pool->groups[next].files[i]->same = NULL;
+            }
+            continue;
+        }
+
+        file = pool->work[next];
+        if ((buf == NULL) || (storage == NULL))
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            file->status = 1;
+        }
+        else if (hash_file(pool->api, pool->stage, file, storage, buf))
+        {
+            fprintf(stderr, "Unable to read '%s'\n", file->path);
+            file->status = 1;
+        }
+    }
+
+    free(storage);
+    free(buf);
+    return NULL;
+}
+
+// Checksum one file for a stage, using the worker's context storage
+static int hash_file(struct method_api* api, enum dupe_stage stage,
+                     struct dupe_file* file, void* storage, uint8_t* buf)
+{
+    struct context ctx;
+    struct stat st;
+    int fd;
+    int retval;
+
+    // Small files were already read in full by the partial stage
+    if (file->full)
+        return 0;
+
+    fd = open(file->path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    PROBE2(file_open, api->type, file->path);
+    if ((fstat(fd, &st) != 0) || ((uint64_t)st.st_size != file->size))
+    {
+        // Changed since it was found
+        close(fd);
+        return 1;
+    }
+
+    ctx.which = api->type;
+    ctx.context = storage;
+    ctx.threads = 1;
+    ctx.preallocated = 1;
+    if (api->sum_init(&ctx))
+    {
+        close(fd);
+        return 1;
+    }
+
+    if (stage == STAGE_FULL)
+    {
+        retval = sparse_read(api, &ctx, fd, buf, IO_SIZE);
+        if (retval < 0)
+            retval = hash_range(api, &ctx, fd, 0, file->size, buf, IO_SIZE);
+    }
+    else if (file->size <= 2 * EDGE_SIZE)
+    {
+        retval = hash_range(api, &ctx, fd, 0, file->size, buf, 2 * EDGE_SIZE);
+    }
+    else
+    {
+        retval = hash_range(api, &ctx, fd, 0, EDGE_SIZE, buf, EDGE_SIZE) ||
+                 hash_range(api, &ctx, fd, file->size - EDGE_SIZE, EDGE_SIZE,
+                            buf, EDGE_SIZE);
+    }
+    file->full = (stage == STAGE_FULL) || (file->size <= 2 * EDGE_SIZE);
+
+    // Always finish, so that the context gets cleaned up
+    if (method_finish(api, &ctx, file->digest))
+        retval = 1;
+
+    close(fd);
+    return retval;
+}
+
+// Feed 'len' bytes of a file, starting at 'offset', to the method
+static int hash_range(struct method_api* api, struct context* ctx,
+                      int fd, uint64_t offset, uint64_t len,
+                      uint8_t* buf, size_t buf_size)
+{
+    uint64_t start;
+    ssize_t got;
+
+    while (len > 0)
+    {
+        start = throttle_start();
+        got = pread(fd, buf, (len < buf_size) ? len : buf_size, offset);
+        if ((got < 0) && (errno == EINTR))
+            continue;
+        if (got <= 0)
+            return 1;
+        throttle_read(got, start);
+        PROBE2(read_done, api->type, got);
+
+        if (method_process(api, ctx, buf, got))
+            return 1;
+        offset += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+// Sort files by size and checksum and keep only those that share both
+// with another file.  Returns the new count.
+static size_t collisions(struct dupe_file** work, size_t count,
+                         size_t digest_size)
+{
+    size_t i, j, kept = 0;
+
+    compare_size = digest_size;
+    qsort(work, count, sizeof(*work), &compare_digest);
+
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; (j < count) && same_digest(work[i], work[j], digest_size); ++j)
+            ;
+        if ((j - i < 2) || work[i]->status)
+            continue;
+        for (; i < j; ++i)
+            work[kept++] = work[i];
+    }
+
+    return kept;
+}
+
+// Work out which files in a group with one checksum really are identical.
+// Identical files are moved next to each other, keeping their order, and
+// their 'same' set to the first of them; other files get NULL.
+static void confirm_group(struct method_api* api,
+                          struct dupe_group* group, uint8_t* buf)
+{
+    struct dupe_file** files = group->files;
+    struct dupe_file* file;
+    size_t first, matched, i;
+
+    for (i = 0; i < group->count; ++i)
+        files[i]->same = NULL;
+
+    for (first = 0; first < group->count; first = matched)
+    {
+        // Move the files identical to the first one up behind it
+        matched = first + 1;
+        for (i = first + 1; (i < group->count) && !files[first]->status; ++i)
+        {
+            if (same_contents(api, files[first], files[i], buf) <= 0)
+                continue;
+            file = files[i];
+            memmove(&files[matched + 1], &files[matched],
+                    (i - matched) * sizeof(*files));
+            files[matched++] = file;
+        }
+        if (files[first]->status)
+        {
+            // Whatever matched it so far gets another chance
+            matched = first + 1;
+            continue;
+        }
+        if (matched - first < 2)
+            continue;
+
+        for (i = first; i < matched; ++i)
+            files[i]->same = files[first];
+    }
+}
+
+// Compare two files of the same size.  Returns 1 if they are identical,
+// 0 if not and -1 if either can't be read, which is reported and marks
+// that file's status.
+static int same_contents(struct method_api* api, struct dupe_file* a,
+                         struct dupe_file* b, uint8_t* buf)
+{
+    struct dupe_file* failed = NULL;
+    uint64_t offset;
+    size_t piece;
+    int fd_a, fd_b;
+    int retval = 1;
+
+    if (b->status)
+        return -1;
+
+    fd_a = open(a->path, O_RDONLY);
+    fd_b = open(b->path, O_RDONLY);
+    if (fd_a < 0)
+        failed = a;
+    else if (fd_b < 0)
+        failed = b;
+
+    for (offset = 0; (failed == NULL) && (offset < a->size); offset += piece)
+    {
+        piece = (a->size - offset < IO_SIZE / 2) ? a->size - offset : IO_SIZE / 2;
+        if (read_fully(api, fd_a, buf, piece, offset))
+            failed = a;
+        else if (read_fully(api, fd_b, buf + IO_SIZE / 2, piece, offset))
+            failed = b;
+        else if (memcmp(buf, buf + IO_SIZE / 2, piece) != 0)
+        {
+            retval = 0;
+            break;
+        }
+    }
+
+    if (failed != NULL)
+    {
+        fprintf(stderr, "Unable to read '%s'\n", failed->path);
+        failed->status = 1;
+        retval = -1;
+    }
+    if (fd_a >= 0)
+        close(fd_a);
+    if (fd_b >= 0)
+        close(fd_b);
+    return retval;
+}
+
+// Read exactly 'len' bytes of a file, starting at 'offset'
+static int read_fully(struct method_api* api, int fd, uint8_t* buf,
+                      size_t len, uint64_t offset)
+{
+    uint64_t start;
+    ssize_t got;
+
+    while (len > 0)
+    {
+        start = throttle_start();
+        got = pread(fd, buf, len, offset);
+        if ((got < 0) && (errno == EINTR))
+            continue;
+        if (got <= 0)
+            return 1;
+        throttle_read(got, start);
+        PROBE2(read_done, api->type, got);
+
+        buf += got;
+        offset += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+// Order files by size (largest first), then by inode, then by path
+static int compare_inode(const void* a, const void* b)
+{
+    const struct dupe_file* fa = a;
+    const struct dupe_file* fb = b;
+
+    if (fa->size != fb->size)
+        return (fa->size > fb->size) ? -1 : 1;
+    if (fa->dev != fb->dev)
+        return (fa->dev < fb->dev) ? -1 : 1;
+    if (fa->ino != fb->ino)
+        return (fa->ino < fb->ino) ? -1 : 1;
+    return strcmp(fa->path, fb->path);
+}
+
+// Order files by status, size (largest first), checksum and then path
+static int compare_digest(const void* a, const void* b)
+{
+    const struct dupe_file* fa = *(struct dupe_file* const*)a;
+    const struct dupe_file* fb = *(struct dupe_file* const*)b;
+    int cmp;
+
+    if (fa->status != fb->status)
+        return (fa->status < fb->status) ? -1 : 1;
+    if (fa->size != fb->size)
+        return (fa->size > fb->size) ? -1 : 1;
+    if (fa->full != fb->full)
+        return (fa->full < fb->full) ? -1 : 1;
+    cmp = memcmp(fa->digest, fb->digest, compare_size);
+    if (cmp != 0)
+        return cmp;
+    return strcmp(fa->path, fb->path);
+}
+
+// Non-zero if two files are in the same group
+static int same_digest(const struct dupe_file* a, const struct dupe_file* b,
+                       size_t digest_size)
+{
+    return (a->status == b->status) && (a->size == b->size) &&
+           (a->full == b->full) && (memcmp(a->digest, b->digest, digest_size) == 0);
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Multiple input files
+ *
+ * Checksums a list of files one after another, displaying one line per
+ * file:
+ *   <checksum> <path>
+ * The list comes from the command line and/or a file with one path per
+ * line ("-" meaning standard input, either way).
+ *
+ * Opening a file and reading its first blocks stalls on the storage when
+ * the file isn't cached, and hashing one file at a time would serialize
+ * all those stalls.  Instead, a prefetch thread keeps up to 'depth' files
+ * ahead of the one being hashed open, with posix_fadvise(WILLNEED) issued
+ * for their first PREFETCH_SIZE bytes, so that their data is on its way
+ * into the page cache before it is needed.
+ *
+ * Notes:
+ *  - Files are hashed in list order, and the lines come out in that order.
+ *  - Prefetched files stay open until they are hashed, so the depth also
+ *    limits the number of open files (and of prefetched bytes in memory).
+ *  - A file that can't be opened or read is reported and skipped; the exit
+ *    status is then non-zero.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "checksum.h"
+
+// Bytes of each file prefetched ahead of time
+#define PREFETCH_SIZE   (8 * 1024 * 1024)
+
+// A file opened ahead of time
+struct prefetch_slot
+{
+    int fd;
+    int error;                  // errno from opening the file
+};
+
+// State shared with the prefetch thread
+struct prefetch
+{
+    pthread_mutex_t       lock;
+    pthread_cond_t        opened;       // a file was opened
+    pthread_cond_t        consumed;     // a file was hashed
+    int                   stop;
+
+    char**                paths;
+    size_t                count;
+    unsigned              depth;
+    size_t                next_open;    // next file for the prefetch thread
+    size_t                next_hash;    // file being hashed
+    struct prefetch_slot* slots;        // depth + 1 of them
+};
+
+// Local function prototypes
+static int      read_list       (const char* path, char*** paths, size_t* count);
+static void*    prefetch_worker (void* arg);
+static void     open_file       (const char* path, int prefetch,
+                                 struct prefetch_slot* slot);
+static void     close_file      (int fd);
+static int      hash_fd         (struct method_api* api, unsigned threads,
+                                 int fd, uint8_t* buf, size_t buf_size,
+                                 uint8_t* digest, uint64_t* bytes);
+static double   now_seconds     (void);
+
+
+// Checksum each of a list of files: those in 'args', then those listed in
+// the file 'list' (if not NULL).  With 'stats' set, a summary goes to
+// standard error at the end.
+int files_run(struct method_api* api, char** args, size_t nargs,
+              const char* list, unsigned threads, size_t buf_size,
+              unsigned depth, int stats)
+{
+    struct prefetch pf;
+    struct prefetch_slot slot;
+    pthread_t worker;
+    int have_worker = 0;
+    char** paths = NULL;
+    char** all;
+    size_t count = 0;
+    size_t i, failed = 0;
+    uint8_t* buf;
+    uint8_t digest[MAX_OUTPUT_SIZE];
+    char line[2 * MAX_OUTPUT_SIZE + 4];
+    uint64_t bytes, total = 0;
+    double started, elapsed;
+    int retval = 0;
+
+    started = now_seconds();
+    if ((list != NULL) && read_list(list, &paths, &count))
+        return 1;
+
+    // Command-line files come first
+    if (nargs > 0)
+    {
+        all = realloc(paths, (nargs + count) * sizeof(*paths));
+        if (all == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            for (i = 0; i < count; ++i)
+                free(paths[i]);
+            free(paths);
+            return 1;
+        }
+        memmove(&all[nargs], all, count * sizeof(*all));
+        paths = all;
+        count += nargs;
+        for (i = 0; i < nargs; ++i)
+            paths[i] = strdup(args[i]);
+        for (i = 0; (i < nargs) && (paths[i] != NULL); ++i)
+            ;
+        if (i < nargs)
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            for (i = 0; i < count; ++i)
+                free(paths[i]);
+            free(paths);
+            return 1;
+        }
+    }
+
+    memset(&pf, 0, sizeof(pf));
+    pf.paths = paths;
+    pf.count = count;
+    pf.depth = depth;
+    pthread_mutex_init(&pf.lock, NULL);
+    pthread_cond_init(&pf.opened, NULL);
+    pthread_cond_init(&pf.consumed, NULL);
+    buf = malloc(buf_size);
+    if (depth > 0)
+        pf.slots = calloc(depth + 1, sizeof(*pf.slots));
+    if ((buf == NULL) || ((depth > 0) && (pf.slots == NULL)))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        retval = 1;
+        count = 0;
+    }
+    else if (depth > 0)
+    {
+        if (pthread_create(&worker, NULL, &prefetch_worker, &pf) == 0)
+            have_worker = 1;
+        else
+            pf.depth = 0;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        // Take the next file, opened by the prefetch thread or here
+        if (have_worker)
+        {
+            pthread_mutex_lock(&pf.lock);
+            while (pf.next_open <= i)
+                pthread_cond_wait(&pf.opened, &pf.lock);
+            slot = pf.slots[i % (depth + 1)];
+            pthread_mutex_unlock(&pf.lock);
+        }
+        else
+        {
+            open_file(paths[i], 0, &slot);
+        }
+
+        if (slot.fd < 0)
+        {
+            fprintf(stderr, "Unable to open file '%s': %s\n", paths[i], strerror(slot.error));
+            ++failed;
+        }
+        else
+        {
+            PROBE2(file_open, api->type, paths[i]);
+            if (hash_fd(api, threads, slot.fd, buf, buf_size, digest, &bytes))
+            {
+                fprintf(stderr, "Unable to checksum file '%s'\n", paths[i]);
+                ++failed;
+            }
+            else
+            {
+                printf("%.*s %s\n", (int)format_digest(line, digest, api->output_size) - 1,
+                       line, paths[i]);
+                total += bytes;
+            }
+            close_file(slot.fd);
+        }
+
+        // Let the prefetch thread move on
+        if (have_worker)
+        {
+            pthread_mutex_lock(&pf.lock);
+            pf.next_hash = i + 1;
+            pthread_cond_signal(&pf.consumed);
+            pthread_mutex_unlock(&pf.lock);
+        }
+    }
+
+    if (have_worker)
+    {
+        pthread_mutex_lock(&pf.lock);
+        pf.stop = 1;
+        pthread_cond_signal(&pf.consumed);
+        pthread_mutex_unlock(&pf.lock);
+        pthread_join(worker, NULL);
+    }
+
+    if (stats)
+    {
+        fflush(stdout);
+        elapsed = now_seconds() - started;
+        fprintf(stderr, "Files: %zu checksummed, %zu failed\n", count - failed, failed);
+        fprintf(stderr, "Bytes: %"PRIu64" in %.3f s (%.1f MB/s)\n", total, elapsed,
+                (elapsed > 0) ? total / elapsed / (1024 * 1024) : 0.0);
+        fprintf(stderr, "Readahead: %u files\n", pf.depth);
+    }
+    if (failed > 0)
+        retval = 1;
+
+    pthread_cond_destroy(&pf.consumed);
+    pthread_cond_destroy(&pf.opened);
+    pthread_mutex_destroy(&pf.lock);
+    free(pf.slots);
+    free(buf);
+    for (i = 0; i < pf.count; ++i)
+        free(paths[i]);
+    free(paths);
+
+    return retval;
+}
+
+
+// Read a list of paths, one per line
+static int read_list(const char* path, char*** paths, size_t* count)
+{
+    FILE* file;
+    char* line = NULL;
+    size_t line_size = 0;
+    size_t alloc = 0;
+    ssize_t len;
+    char** grown;
+    int retval = 0;
+
+    file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", path);
+        return 1;
+    }
+
+    while ((len = getline(&line, &line_size, file)) >= 0)
+    {
+        if ((len > 0) && (line[len - 1] == '\n'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        if (*count == alloc)
+        {
+            alloc = alloc ? 2 * alloc : 1024;
+            grown = realloc(*paths, alloc * sizeof(**paths));
+            if (grown == NULL)
+            {
+                retval = 1;
+                break;
+            }
+            *paths = grown;
+        }
+        (*paths)[*count] = strdup(line);
+        if ((*paths)[*count] == NULL)
+        {
+            retval = 1;
+            break;
+        }
+        ++*count;
+    }
+    if (retval)
+        fprintf(stderr, "Unable to allocate memory\n");
+    else if (ferror(file))
+    {
+        fprintf(stderr, "Error reading from '%s'\n", path);
+        retval = 1;
+    }
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    return retval;
+}
+
+// Prefetch thread: open files ahead of the one being hashed
+static void* prefetch_worker(void* arg)
+{
+    struct prefetch* pf = arg;
+    struct prefetch_slot slot;
+    size_t i;
+    int stop;
+
+    for (i = 0; i < pf->count; ++i)
+    {
+        // Wait for a free slot
+        pthread_mutex_lock(&pf->lock);
+        while (!pf->stop && (i > pf->next_hash + pf->depth))
+            pthread_cond_wait(&pf->consumed, &pf->lock);
+        stop = pf->stop;
+        pthread_mutex_unlock(&pf->lock);
+        if (stop)
+            break;
+
+        open_file(pf->paths[i], 1, &slot);
+
+        pthread_mutex_lock(&pf->lock);
+        pf->slots[i % (pf->depth + 1)] = slot;
+        pf->next_open = i + 1;
+        pthread_cond_signal(&pf->opened);
+        pthread_mutex_unlock(&pf->lock);
+    }
+
+    return NULL;
+}
+
+// Open a file, and with 'prefetch' set start reading it into the cache
+static void open_file(const char* path, int prefetch,
+                      struct prefetch_slot* slot)
+{
+    struct stat st;
+
+    if (strcmp(path, "-") == 0)
+    {
+        slot->fd = STDIN_FILENO;
+        return;
+    }
+
+    slot->fd = open(path, O_RDONLY | O_CLOEXEC);
+    slot->error = errno;
+    if ((slot->fd < 0) || (fstat(slot->fd, &st) != 0) || !S_ISREG(st.st_mode))
+        return;
+
+    posix_fadvise(slot->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (prefetch)
+    {
+        posix_fadvise(slot->fd, 0, (st.st_size < PREFETCH_SIZE) ? st.st_size : PREFETCH_SIZE,
+                      POSIX_FADV_WILLNEED);
+    }
+}
+
+// Close a file from open_file()
+static void close_file(int fd)
+{
+    if (fd != STDIN_FILENO)
+        close(fd);
+}
+
+// Checksum the whole of an open file, counting the bytes hashed
+static int hash_fd(struct method_api* api, unsigned threads,
+                   int fd, uint8_t* buf, size_t buf_size,
+                   uint8_t* digest, uint64_t* bytes)
+{
+    struct context ctx;
+    struct stat st;
+    uint64_t start;
+    ssize_t got;
+    int retval;
+
+    ctx.which = api->type;
+    ctx.context = NULL;
+    ctx.threads = threads;
+    ctx.preallocated = 0;
+    if (api->sum_init(&ctx))
+        return 1;
+
+    *bytes = 0;
+    retval = sparse_read(api, &ctx, fd, buf, buf_size);
+    if ((retval == 0) && (fstat(fd, &st) == 0))
+        *bytes = st.st_size;
+    while (retval < 0)
+    {
+        start = throttle_start();
+        got = read(fd, buf, buf_size);
+        if ((got < 0) && (errno == EINTR))
+            continue;
+        if (got <= 0)
+        {
+            retval = (got < 0);
+            break;
+        }
+        throttle_read(got, start);
+        PROBE2(read_done, api->type, got);
+
+        if (method_process(api, &ctx, buf, got))
+            retval = 1;
+        *bytes += got;
+    }
+
+    // Always finish, so that the context gets cleaned up
+    if (method_finish(api, &ctx, digest))
+        retval = 1;
+
+    return retval;
+}
+
+// Time on the monotonic clock, in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
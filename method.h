@@ -25,6 +25,17 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+// Compiler and architecture support for runtime-selected x86 SIMD kernels
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#endif
+
+// Largest checksum generated by any method, in bytes
+#define MAX_OUTPUT_SIZE 64
+
+// Alignment of context structure storage, in bytes
+#define CONTEXT_ALIGN   64
+
 // Identify a supported checksum algorithm
 enum sum_type
 {
@@ -32,11 +43,23 @@ enum sum_type
     SIMPLE16,
     SIMPLE32,
     SIMPLE64,
+    ADLER32,
+    FLETCHER16,
+    FLETCHER32,
+    FLETCHER64,
     CRC16,
     CRC32,
     MD5,
     SHA1,
-    SHA256
+    SHA256,
+    SHA384,
+    SHA512,
+    SHA512_256,
+    XXH64,
+    XXH3_64,
+    XXH3_128,
+    BLAKE3,
+    HMAC_SHA256
 };
 
 // Context information for a checksum operation
@@ -47,6 +70,14 @@ struct context
 
     // algorithm-specific context information
     void* context;
+
+    // number of threads the algorithm may use (0 or 1: single-threaded)
+    unsigned threads;
+
+    // non-zero if 'context' points to storage supplied by the caller (at
+    // least the method's 'context_size' bytes, CONTEXT_ALIGN-aligned),
+    // which the method uses instead of allocating and freeing its own
+    int preallocated;
 };
 
 // Basic API needed for each checksum method
@@ -61,12 +92,19 @@ struct method_api
     // enumeration value for this type of checksum
     enum sum_type  type;
 
-    // size of the generated checksum, in bytes
+    // size of the generated checksum, in bytes (at most MAX_OUTPUT_SIZE)
     size_t         output_size;
 
     // if non-zero, checksumming must be done in this size chunks
     size_t         chunk_size;
 
+    // size of the method's context structure, in bytes
+    size_t         context_size;
+
+    // non-zero if it is infeasible to find two inputs with the same
+    // checksum, so that equal checksums can be taken to mean equal data
+    int            crypto_hash;
+
     // function to print help text
     void (*help)(void);
 
@@ -76,8 +114,31 @@ struct method_api
     // called for each "chunk" of data, in order
     int (*sum_process)(struct context* ctx, void* data, size_t len);
 
-    // called after completing a checksum
-    int (*sum_finish)(struct context* ctx);
+    // called after completing a checksum; writes 'output_size' bytes of
+    // checksum to 'digest', in the order they are displayed
+    int (*sum_finish)(struct context* ctx, uint8_t* digest);
+
+    // optional: make later checksums use implementation variant 'index'
+    // and set 'name' to describe it (used for testing every variant).
+    // Returns 0 on success, 1 if this processor cannot run the variant,
+    // or -1 if there is no such variant.
+    int (*set_kernel)(unsigned index, const char** name);
+
+    // keyed methods only: use 'key' for later checksums.  Returns
+    // non-zero on error.
+    int (*set_key)(const uint8_t* key, size_t len);
+
+    // optional: checksum 'count' separate messages in one call, writing
+    // 'output_size' bytes per message to 'digests'.  Methods that can
+    // work on several messages at once (e.g. one per SIMD lane) provide
+    // this for callers with many short messages.  Returns non-zero on
+    // error.
+    int (*sum_batch)(size_t count, const uint8_t* const* msgs,
+                     const size_t* lens, uint8_t* digests);
+
+    // optional: the same as sum_process() on 'len' zero bytes, but
+    // without reading them (used for the holes in sparse files)
+    int (*sum_zeros)(struct context* ctx, uint64_t len);
 };
 
 
@@ -94,6 +155,10 @@ uint64_t TO_BE64    (uint64_t in);
 uint64_t TO_LE64    (uint64_t in);
 uint64_t FROM_BE64  (uint64_t in);
 uint64_t FROM_LE64  (uint64_t in);
+size_t   md_pad     (uint8_t* buf, size_t used, size_t block_size,
+                     size_t length_size, uint64_t total);
+void*    context_alloc(struct context* ctx, size_t size);
+void     context_free (struct context* ctx);
 
 
 // Method-specific API structures
@@ -101,6 +166,33 @@ extern struct method_api simple_8;
 extern struct method_api simple_16;
 extern struct method_api simple_32;
 extern struct method_api simple_64;
+extern struct method_api adler32;
+extern struct method_api fletcher16;
+extern struct method_api fletcher32;
+extern struct method_api fletcher64;
 extern struct method_api sha256;
+extern struct method_api sha384;
+extern struct method_api sha512;
+extern struct method_api sha512_256;
+extern struct method_api xxh64;
+extern struct method_api xxh3_64;
+extern struct method_api xxh3_128;
+extern struct method_api blake3;
+extern struct method_api hmac_sha256;
+
+// HMAC-SHA256 key, with the inner and outer padding blocks already hashed
+struct hmac_sha256_key
+{
+    uint32_t inner[8];
+    uint32_t outer[8];
+};
+
+// Prepare a key, then authenticate 'count' messages with it, writing
+// 32 bytes per message to 'macs'
+void hmac_sha256_key_init (struct hmac_sha256_key* key, const uint8_t* data,
+                           size_t len);
+void hmac_sha256_batch    (const struct hmac_sha256_key* key, size_t count,
+                           const uint8_t* const* msgs, const size_t* lens,
+                           uint8_t* macs);
 
 #endif
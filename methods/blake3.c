@@ -0,0 +1,1012 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * BLAKE3 hash
+ *
+ * Notes:
+ *  - In this context, the term "word" refers to a 32-bit value.
+ *  - Only the default (unkeyed) hash mode with a 256-bit output is
+ *    supported.
+ *  - The input is split into 1 KiB chunks which form the leaves of a
+ *    binary tree.  Whole subtrees are handed to hash_many(), which hashes
+ *    4, 8 or 16 chunks side by side using SSE4.1, AVX2 or AVX-512 when
+ *    the processor supports it.
+ *  - When the context's thread count is above one, large subtrees are
+ *    split between threads.  The result does not depend on the number of
+ *    threads used.
+ *  - Names and structure follow the BLAKE3 reference implementation.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "method.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Algorithm parameters
+#define BLOCK_LEN       64   // size of a compression function input (bytes)
+#define CHUNK_LEN       1024 // size of a leaf node of the tree (bytes)
+#define OUT_LEN         32   // size of output hash (bytes)
+#define MAX_DEPTH       54   // maximum height of the tree (2^64 bytes)
+#define MAX_SIMD_DEGREE 16   // most chunks hashed at once by hash_many()
+
+// Domain separation flags
+#define CHUNK_START     (1 << 0)
+#define CHUNK_END       (1 << 1)
+#define PARENT          (1 << 2)
+#define ROOT            (1 << 3)
+
+// Subtrees smaller than this are not worth handing to another thread
+#define MIN_THREAD_LEN  (64 * CHUNK_LEN)
+
+
+// State for the chunk currently being hashed
+struct chunk_state
+{
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t  buf[BLOCK_LEN];
+    uint8_t  buf_len;
+    uint8_t  blocks_compressed;
+};
+
+// Module-specific context structure
+struct blake3_context
+{
+    // chunk currently being filled
+    struct chunk_state chunk;
+
+    // chaining values of completed subtrees, waiting to be merged
+    uint32_t cv_stack[MAX_DEPTH + 1][8];
+    unsigned cv_stack_len;
+
+    // number of threads to use for large inputs
+    unsigned threads;
+};
+
+// Inputs to a compression that may produce either a chaining value or
+// the root hash, depending on where it ends up in the tree
+struct output
+{
+    uint32_t input_cv[8];
+    uint8_t  block[BLOCK_LEN];
+    uint8_t  block_len;
+    uint64_t counter;
+    uint8_t  flags;
+};
+
+// Hash 'num_inputs' inputs of 'blocks' whole blocks each, spaced 'stride'
+// bytes apart, writing one chaining value per input to 'out'.  If
+// 'increment_counter' is set, input i uses counter 'counter + i'.
+typedef void (*hash_many_fn)(const uint8_t* input, size_t stride,
+                             size_t num_inputs, size_t blocks,
+                             const uint32_t key[8], uint64_t counter,
+                             int increment_counter, uint8_t flags,
+                             uint8_t flags_start, uint8_t flags_end,
+                             uint32_t* out);
+
+
+static void blake3_help     (void);
+static int  blake3_init     (struct context* ctx);
+static int  blake3_set_kernel(unsigned index, const char** name);
+static int  blake3_process  (struct context* ctx, void* data, size_t len);
+static int  blake3_finish   (struct context* ctx, uint8_t* digest);
+
+
+struct method_api blake3 =
+{
+    .name         = "BLAKE3 hash",
+    .args         = "-blake3",
+    .type         = BLAKE3,
+    .output_size  = OUT_LEN,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct blake3_context),
+    .crypto_hash  = 1,
+    .help         = &blake3_help,
+    .sum_init     = &blake3_init,
+    .sum_process  = &blake3_process,
+    .sum_finish   = &blake3_finish,
+    .set_kernel   = &blake3_set_kernel
+};
+
+// Constants
+static const uint32_t IV[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// Message word order for each round
+static const uint8_t MSG_SCHEDULE[7][16] =
+{
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    { 2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8},
+    { 3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1},
+    {10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6},
+    {12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4},
+    { 9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7},
+    {11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13}
+};
+
+// Widest hash_many() this processor supports, chosen at initialization
+static hash_many_fn hash_many = NULL;
+static size_t       simd_degree = 1;
+
+
+// === compression function ===
+
+static inline uint32_t load32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t rotr32(uint32_t x, unsigned n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+// The quarter-round and round are written in terms of ADD, XOR and ROTxx
+// so that the same macros serve the portable and vectorized versions.
+#define G(a, b, c, d, x, y) \
+do {\
+    v[a] = ADD(ADD(v[a], v[b]), (x));\
+    v[d] = ROT16(XOR(v[d], v[a]));\
+    v[c] = ADD(v[c], v[d]);\
+    v[b] = ROT12(XOR(v[b], v[c]));\
+    v[a] = ADD(ADD(v[a], v[b]), (y));\
+    v[d] = ROT8(XOR(v[d], v[a]));\
+    v[c] = ADD(v[c], v[d]);\
+    v[b] = ROT7(XOR(v[b], v[c]));\
+} while (0)
+
+#define ROUND(r) \
+do {\
+    const uint8_t* s = MSG_SCHEDULE[r];\
+    G(0, 4,  8, 12, m[s[0]],  m[s[1]]);\
+    G(1, 5,  9, 13, m[s[2]],  m[s[3]]);\
+    G(2, 6, 10, 14, m[s[4]],  m[s[5]]);\
+    G(3, 7, 11, 15, m[s[6]],  m[s[7]]);\
+    G(0, 5, 10, 15, m[s[8]],  m[s[9]]);\
+    G(1, 6, 11, 12, m[s[10]], m[s[11]]);\
+    G(2, 7,  8, 13, m[s[12]], m[s[13]]);\
+    G(3, 4,  9, 14, m[s[14]], m[s[15]]);\
+} while (0)
+
+#define ADD(x, y)   ((x) + (y))
+#define XOR(x, y)   ((x) ^ (y))
+#define ROT16(x)    rotr32((x), 16)
+#define ROT12(x)    rotr32((x), 12)
+#define ROT8(x)     rotr32((x), 8)
+#define ROT7(x)     rotr32((x), 7)
+
+// Run the compression function, leaving the full 16-word state in 'v'
+static void compress_pre(uint32_t v[16], const uint32_t cv[8],
+                         const uint8_t block[BLOCK_LEN], uint8_t block_len,
+                         uint64_t counter, uint8_t flags)
+{
+    uint32_t m[16];
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        m[i] = load32(&block[4 * i]);
+
+    for (i = 0; i < 8; ++i)
+        v[i] = cv[i];
+    for (i = 0; i < 4; ++i)
+        v[8 + i] = IV[i];
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+
+    for (i = 0; i < 7; ++i)
+        ROUND(i);
+}
+
+#undef ADD
+#undef XOR
+#undef ROT16
+#undef ROT12
+#undef ROT8
+#undef ROT7
+
+// Compress a block, updating the chaining value in place
+static void compress_in_place(uint32_t cv[8], const uint8_t block[BLOCK_LEN],
+                              uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+    uint32_t v[16];
+    int i;
+
+    compress_pre(v, cv, block, block_len, counter, flags);
+    for (i = 0; i < 8; ++i)
+        cv[i] = v[i] ^ v[i + 8];
+}
+
+// One input at a time; also handles the leftovers of the SIMD versions
+static void hash_many_portable(const uint8_t* input, size_t stride,
+                               size_t num_inputs, size_t blocks,
+                               const uint32_t key[8], uint64_t counter,
+                               int increment_counter, uint8_t flags,
+                               uint8_t flags_start, uint8_t flags_end,
+                               uint32_t* out)
+{
+    uint8_t block_flags;
+    size_t b;
+
+    for (; num_inputs > 0; --num_inputs)
+    {
+        memcpy(out, key, 8 * sizeof(uint32_t));
+        block_flags = flags | flags_start;
+        for (b = 0; b < blocks; ++b)
+        {
+            if (b + 1 == blocks)
+                block_flags |= flags_end;
+            compress_in_place(out, &input[b * BLOCK_LEN], BLOCK_LEN, counter, block_flags);
+            block_flags = flags;
+        }
+
+        input += stride;
+        out += 8;
+        if (increment_counter)
+            ++counter;
+    }
+}
+
+
+// === vectorized versions of hash_many() ===
+//
+// Each lane of a vector register holds the state for a different input,
+// so every vector instruction advances N inputs at once.  Message words
+// are transposed on the way in and the chaining values on the way out.
+
+#ifdef HAVE_X86_SIMD
+
+// Per-lane counter values for N inputs
+static inline void lane_counters(uint32_t* lo, uint32_t* hi, size_t lanes,
+                                 uint64_t counter, int increment_counter)
+{
+    uint64_t c;
+    size_t i;
+
+    for (i = 0; i < lanes; ++i)
+    {
+        c = counter + (increment_counter ? i : 0);
+        lo[i] = (uint32_t)c;
+        hi[i] = (uint32_t)(c >> 32);
+    }
+}
+
+// Write out lane-major chaining values as one contiguous CV per input
+static inline void store_cvs(uint32_t* out, const uint32_t* h, size_t lanes)
+{
+    size_t i, w;
+
+    for (i = 0; i < lanes; ++i)
+        for (w = 0; w < 8; ++w)
+            out[8 * i + w] = h[w * lanes + i];
+}
+
+#define ADD(x, y)   _mm_add_epi32((x), (y))
+#define XOR(x, y)   _mm_xor_si128((x), (y))
+#define ROT16(x)    _mm_shuffle_epi8((x), rot16)
+#define ROT12(x)    _mm_or_si128(_mm_srli_epi32((x), 12), _mm_slli_epi32((x), 20))
+#define ROT8(x)     _mm_shuffle_epi8((x), rot8)
+#define ROT7(x)     _mm_or_si128(_mm_srli_epi32((x), 7), _mm_slli_epi32((x), 25))
+
+__attribute__((target("sse4.1")))
+static void hash4_sse41(const uint8_t* input, size_t stride, size_t blocks,
+                        const uint32_t key[8], uint64_t counter,
+                        int increment_counter, uint8_t flags,
+                        uint8_t flags_start, uint8_t flags_end, uint32_t* out)
+{
+    const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m128i rot8  = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    uint32_t ctr_lo[4], ctr_hi[4];
+    uint32_t cvs[8 * 4] __attribute__((aligned(16)));
+    __m128i h[8], v[16], m[16];
+    __m128i a, b, c, d, t0, t1, t2, t3;
+    uint8_t block_flags;
+    size_t blk;
+    int i, g;
+
+    lane_counters(ctr_lo, ctr_hi, 4, counter, increment_counter);
+    for (i = 0; i < 8; ++i)
+        h[i] = _mm_set1_epi32(key[i]);
+
+    block_flags = flags | flags_start;
+    for (blk = 0; blk < blocks; ++blk)
+    {
+        if (blk + 1 == blocks)
+            block_flags |= flags_end;
+
+        // Load and transpose the message, four words from each input at a time
+        for (g = 0; g < 4; ++g)
+        {
+            a  = _mm_loadu_si128((const __m128i*)&input[0 * stride + blk * BLOCK_LEN + 16 * g]);
+            b  = _mm_loadu_si128((const __m128i*)&input[1 * stride + blk * BLOCK_LEN + 16 * g]);
+            c  = _mm_loadu_si128((const __m128i*)&input[2 * stride + blk * BLOCK_LEN + 16 * g]);
+            d  = _mm_loadu_si128((const __m128i*)&input[3 * stride + blk * BLOCK_LEN + 16 * g]);
+            t0 = _mm_unpacklo_epi32(a, b);
+            t1 = _mm_unpacklo_epi32(c, d);
+            t2 = _mm_unpackhi_epi32(a, b);
+            t3 = _mm_unpackhi_epi32(c, d);
+            m[4 * g + 0] = _mm_unpacklo_epi64(t0, t1);
+            m[4 * g + 1] = _mm_unpackhi_epi64(t0, t1);
+            m[4 * g + 2] = _mm_unpacklo_epi64(t2, t3);
+            m[4 * g + 3] = _mm_unpackhi_epi64(t2, t3);
+        }
+
+        for (i = 0; i < 8; ++i)
+            v[i] = h[i];
+        for (i = 0; i < 4; ++i)
+            v[8 + i] = _mm_set1_epi32(IV[i]);
+        v[12] = _mm_loadu_si128((const __m128i*)ctr_lo);
+        v[13] = _mm_loadu_si128((const __m128i*)ctr_hi);
+        v[14] = _mm_set1_epi32(BLOCK_LEN);
+        v[15] = _mm_set1_epi32(block_flags);
+
+        for (i = 0; i < 7; ++i)
+            ROUND(i);
+
+        for (i = 0; i < 8; ++i)
+            h[i] = XOR(v[i], v[i + 8]);
+        block_flags = flags;
+    }
+
+    for (i = 0; i < 8; ++i)
+        _mm_store_si128((__m128i*)&cvs[4 * i], h[i]);
+    store_cvs(out, cvs, 4);
+}
+
+#undef ADD
+#undef XOR
+#undef ROT16
+#undef ROT12
+#undef ROT8
+#undef ROT7
+
+#define ADD(x, y)   _mm256_add_epi32((x), (y))
+#define XOR(x, y)   _mm256_xor_si256((x), (y))
+#define ROT16(x)    _mm256_shuffle_epi8((x), rot16)
+#define ROT12(x)    _mm256_or_si256(_mm256_srli_epi32((x), 12), _mm256_slli_epi32((x), 20))
+#define ROT8(x)     _mm256_shuffle_epi8((x), rot8)
+#define ROT7(x)     _mm256_or_si256(_mm256_srli_epi32((x), 7), _mm256_slli_epi32((x), 25))
+
+__attribute__((target("avx2")))
+static void hash8_avx2(const uint8_t* input, size_t stride, size_t blocks,
+                       const uint32_t key[8], uint64_t counter,
+                       int increment_counter, uint8_t flags,
+                       uint8_t flags_start, uint8_t flags_end, uint32_t* out)
+{
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    const int s = stride / sizeof(uint32_t);
+    const __m256i index = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+    uint32_t ctr_lo[8], ctr_hi[8];
+    uint32_t cvs[8 * 8] __attribute__((aligned(32)));
+    __m256i h[8], v[16], m[16];
+    uint8_t block_flags;
+    size_t blk;
+    int i;
+
+    lane_counters(ctr_lo, ctr_hi, 8, counter, increment_counter);
+    for (i = 0; i < 8; ++i)
+        h[i] = _mm256_set1_epi32(key[i]);
+
+    block_flags = flags | flags_start;
+    for (blk = 0; blk < blocks; ++blk)
+    {
+        if (blk + 1 == blocks)
+            block_flags |= flags_end;
+
+        // Gather word i of the block from each input
+        for (i = 0; i < 16; ++i)
+            m[i] = _mm256_i32gather_epi32((const int*)&input[blk * BLOCK_LEN + 4 * i], index, 4);
+
+        for (i = 0; i < 8; ++i)
+            v[i] = h[i];
+        for (i = 0; i < 4; ++i)
+            v[8 + i] = _mm256_set1_epi32(IV[i]);
+        v[12] = _mm256_loadu_si256((const __m256i*)ctr_lo);
+        v[13] = _mm256_loadu_si256((const __m256i*)ctr_hi);
+        v[14] = _mm256_set1_epi32(BLOCK_LEN);
+        v[15] = _mm256_set1_epi32(block_flags);
+
+        for (i = 0; i < 7; ++i)
+            ROUND(i);
+
+        for (i = 0; i < 8; ++i)
+            h[i] = XOR(v[i], v[i + 8]);
+        block_flags = flags;
+    }
+
+    for (i = 0; i < 8; ++i)
+        _mm256_store_si256((__m256i*)&cvs[8 * i], h[i]);
+    store_cvs(out, cvs, 8);
+}
+
+#undef ADD
+#undef XOR
+#undef ROT16
+#undef ROT12
+#undef ROT8
+#undef ROT7
+
+#define ADD(x, y)   _mm512_add_epi32((x), (y))
+#define XOR(x, y)   _mm512_xor_si512((x), (y))
+#define ROT16(x)    _mm512_ror_epi32((x), 16)
+#define ROT12(x)    _mm512_ror_epi32((x), 12)
+#define ROT8(x)     _mm512_ror_epi32((x), 8)
+#define ROT7(x)     _mm512_ror_epi32((x), 7)
+
+__attribute__((target("avx512f")))
+static void hash16_avx512(const uint8_t* input, size_t stride, size_t blocks,
+                          const uint32_t key[8], uint64_t counter,
+                          int increment_counter, uint8_t flags,
+                          uint8_t flags_start, uint8_t flags_end, uint32_t* out)
+{
+    const int s = stride / sizeof(uint32_t);
+    const __m512i index = _mm512_setr_epi32(
+        0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s,
+        8 * s, 9 * s, 10 * s, 11 * s, 12 * s, 13 * s, 14 * s, 15 * s);
+    uint32_t ctr_lo[16], ctr_hi[16];
+    uint32_t cvs[8 * 16] __attribute__((aligned(64)));
+    __m512i h[8], v[16], m[16];
+    uint8_t block_flags;
+    size_t blk;
+    int i;
+
+    lane_counters(ctr_lo, ctr_hi, 16, counter, increment_counter);
+    for (i = 0; i < 8; ++i)
+        h[i] = _mm512_set1_epi32(key[i]);
+
+    block_flags = flags | flags_start;
+    for (blk = 0; blk < blocks; ++blk)
+    {
+        if (blk + 1 == blocks)
+            block_flags |= flags_end;
+
+        // Gather word i of the block from each input
+        for (i = 0; i < 16; ++i)
+            m[i] = _mm512_i32gather_epi32(index, (const int*)&input[blk * BLOCK_LEN + 4 * i], 4);
+
+        for (i = 0; i < 8; ++i)
+            v[i] = h[i];
+        for (i = 0; i < 4; ++i)
+            v[8 + i] = _mm512_set1_epi32(IV[i]);
+        v[12] = _mm512_loadu_si512(ctr_lo);
+        v[13] = _mm512_loadu_si512(ctr_hi);
+        v[14] = _mm512_set1_epi32(BLOCK_LEN);
+        v[15] = _mm512_set1_epi32(block_flags);
+
+        for (i = 0; i < 7; ++i)
+            ROUND(i);
+
+        for (i = 0; i < 8; ++i)
+            h[i] = XOR(v[i], v[i + 8]);
+        block_flags = flags;
+    }
+
+    for (i = 0; i < 8; ++i)
+        _mm512_store_si512(&cvs[16 * i], h[i]);
+    store_cvs(out, cvs, 16);
+}
+
+#undef ADD
+#undef XOR
+#undef ROT16
+#undef ROT12
+#undef ROT8
+#undef ROT7
+
+// Wrap an N-way kernel into a hash_many() that takes any number of inputs
+#define DEFINE_HASH_MANY(name, kernel, lanes) \
+static void name(const uint8_t* input, size_t stride, size_t num_inputs,\
+                 size_t blocks, const uint32_t key[8], uint64_t counter,\
+                 int increment_counter, uint8_t flags, uint8_t flags_start,\
+                 uint8_t flags_end, uint32_t* out)\
+{\
+    for (; num_inputs >= (lanes); num_inputs -= (lanes))\
+    {\
+        kernel(input, stride, blocks, key, counter, increment_counter,\
+               flags, flags_start, flags_end, out);\
+        input += (lanes) * stride;\
+        out += (lanes) * 8;\
+        if (increment_counter)\
+            counter += (lanes);\
+    }\
+    hash_many_portable(input, stride, num_inputs, blocks, key, counter,\
+                       increment_counter, flags, flags_start, flags_end, out);\
+}
+
+DEFINE_HASH_MANY(hash_many_sse41,  hash4_sse41,   4)
+DEFINE_HASH_MANY(hash_many_avx2,   hash8_avx2,    8)
+DEFINE_HASH_MANY(hash_many_avx512, hash16_avx512, 16)
+
+#endif
+
+#undef G
+#undef ROUND
+
+
+// === chunks, parents and the tree ===
+
+static void chunk_state_init(struct chunk_state* self, uint64_t chunk_counter)
+{
+    memcpy(self->cv, IV, sizeof(self->cv));
+    self->chunk_counter = chunk_counter;
+    memset(self->buf, 0, sizeof(self->buf));
+    self->buf_len = 0;
+    self->blocks_compressed = 0;
+}
+
+static size_t chunk_state_len(const struct chunk_state* self)
+{
+    return (BLOCK_LEN * (size_t)self->blocks_compressed) + self->buf_len;
+}
+
+static uint8_t chunk_state_start_flag(const struct chunk_state* self)
+{
+    return (self->blocks_compressed == 0) ? CHUNK_START : 0;
+}
+
+static void chunk_state_update(struct chunk_state* self, const uint8_t* input, size_t len)
+{
+    size_t take;
+
+    // Finish off a buffered block, but only once more input shows up,
+    // since the last block of the chunk needs the CHUNK_END flag
+    if (self->buf_len > 0)
+    {
+        take = BLOCK_LEN - self->buf_len;
+        if (take > len)
+            take = len;
+        memcpy(&self->buf[self->buf_len], input, take);
+        self->buf_len += take;
+        input += take;
+        len -= take;
+        if (len == 0)
+            return;
+
+        compress_in_place(self->cv, self->buf, BLOCK_LEN, self->chunk_counter,
+                          chunk_state_start_flag(self));
+        self->blocks_compressed++;
+        self->buf_len = 0;
+        memset(self->buf, 0, sizeof(self->buf));
+    }
+
+    while (len > BLOCK_LEN)
+    {
+        compress_in_place(self->cv, input, BLOCK_LEN, self->chunk_counter,
+                          chunk_state_start_flag(self));
+        self->blocks_compressed++;
+        input += BLOCK_LEN;
+        len -= BLOCK_LEN;
+    }
+
+    memcpy(self->buf, input, len);
+    self->buf_len = len;
+}
+
+static void chunk_state_output(const struct chunk_state* self, struct output* out)
+{
+    memcpy(out->input_cv, self->cv, sizeof(out->input_cv));
+    memcpy(out->block, self->buf, BLOCK_LEN);
+    out->block_len = self->buf_len;
+    out->counter = self->chunk_counter;
+    out->flags = chunk_state_start_flag(self) | CHUNK_END;
+}
+
+static void parent_output(const uint32_t left[8], const uint32_t right[8], struct output* out)
+{
+    int i;
+
+    memcpy(out->input_cv, IV, sizeof(out->input_cv));
+    for (i = 0; i < 8; ++i)
+    {
+        out->block[4 * i]          = left[i];
+        out->block[4 * i + 1]      = left[i] >> 8;
+        out->block[4 * i + 2]      = left[i] >> 16;
+        out->block[4 * i + 3]      = left[i] >> 24;
+        out->block[32 + 4 * i]     = right[i];
+        out->block[32 + 4 * i + 1] = right[i] >> 8;
+        out->block[32 + 4 * i + 2] = right[i] >> 16;
+        out->block[32 + 4 * i + 3] = right[i] >> 24;
+    }
+    out->block_len = BLOCK_LEN;
+    out->counter = 0;
+    out->flags = PARENT;
+}
+
+static void output_chaining_value(const struct output* self, uint32_t cv[8])
+{
+    memcpy(cv, self->input_cv, 8 * sizeof(uint32_t));
+    compress_in_place(cv, self->block, self->block_len, self->counter, self->flags);
+}
+
+// Merge 'num_cvs' sibling chaining values pairwise into the next level up.
+// An odd one out is carried up unchanged.  Returns the number of CVs left.
+static size_t compress_parents(uint32_t (*cvs)[8], size_t num_cvs)
+{
+    struct output out;
+    size_t i;
+
+    for (i = 0; i + 1 < num_cvs; i += 2)
+    {
+        parent_output(cvs[i], cvs[i + 1], &out);
+        output_chaining_value(&out, cvs[i / 2]);
+    }
+    if (num_cvs & 1)
+        memcpy(cvs[i / 2], cvs[i], sizeof(cvs[0]));
+
+    return (num_cvs + 1) / 2;
+}
+
+// Merge chaining values pairwise until only 'target' remain
+static void reduce_cvs(uint32_t (*cvs)[8], size_t num_cvs, size_t target)
+{
+    while (num_cvs > target)
+        num_cvs = compress_parents(cvs, num_cvs);
+}
+
+// Largest power-of-two number of whole chunks strictly smaller than 'len'
+static size_t left_len(size_t len)
+{
+    size_t full_chunks = (len - 1) / CHUNK_LEN;
+    size_t power = 1;
+
+    while (power * 2 <= full_chunks)
+        power *= 2;
+
+    return power * CHUNK_LEN;
+}
+
+// Arguments for hashing one side of a subtree on another thread
+struct subtree_job
+{
+    const uint8_t* input;
+    size_t         len;
+    uint64_t       chunk_counter;
+    unsigned       threads;
+    uint32_t       cv[8];
+};
+
+static void compress_subtree(const uint8_t* input, size_t len,
+                             uint64_t chunk_counter, unsigned threads,
+                             uint32_t cv[8]);
+
+static void* subtree_thread(void* arg)
+{
+    struct subtree_job* job = arg;
+
+    compress_subtree(job->input, job->len, job->chunk_counter, job->threads, job->cv);
+
+    return NULL;
+}
+
+// Hash the left and right halves of a subtree of more than one chunk,
+// handing the left half to another thread if it is worth it
+static void compress_subtree_halves(const uint8_t* input, size_t len,
+                                    uint64_t chunk_counter, unsigned threads,
+                                    uint32_t left_cv[8], uint32_t right_cv[8])
+{
+    struct subtree_job left;
+    pthread_t thread;
+    size_t split;
+
+    split = left_len(len);
+    left.input = input;
+    left.len = split;
+    left.chunk_counter = chunk_counter;
+    left.threads = threads - threads / 2;
+
+    if ((threads > 1) && (split >= MIN_THREAD_LEN) &&
+        (pthread_create(&thread, NULL, &subtree_thread, &left) == 0))
+    {
+        compress_subtree(&input[split], len - split,
+                         chunk_counter + split / CHUNK_LEN, threads / 2, right_cv);
+        pthread_join(thread, NULL);
+    }
+    else
+    {
+        left.threads = 1;
+        subtree_thread(&left);
+        compress_subtree(&input[split], len - split,
+                         chunk_counter + split / CHUNK_LEN, 1, right_cv);
+    }
+    memcpy(left_cv, left.cv, sizeof(left.cv));
+}
+
+// Hash a subtree of whole chunks down to a single chaining value.  Small
+// subtrees go through hash_many() in one go; larger ones are split in two.
+static void compress_subtree(const uint8_t* input, size_t len,
+                             uint64_t chunk_counter, unsigned threads,
+                             uint32_t cv[8])
+{
+    uint32_t cvs[MAX_SIMD_DEGREE][8];
+    size_t num_chunks;
+
+    if (len <= simd_degree * CHUNK_LEN)
+    {
+        num_chunks = len / CHUNK_LEN;
+        hash_many(input, CHUNK_LEN, num_chunks, CHUNK_LEN / BLOCK_LEN, IV,
+                  chunk_counter, 1, 0, CHUNK_START, CHUNK_END, &cvs[0][0]);
+    }
+    else
+    {
+        compress_subtree_halves(input, len, chunk_counter, threads, cvs[0], cvs[1]);
+        num_chunks = 2;
+    }
+
+    reduce_cvs(cvs, num_chunks, 1);
+    memcpy(cv, cvs[0], sizeof(cvs[0]));
+}
+
+// Merge completed subtrees on the CV stack, given the total number of
+// chunks hashed so far.  Exactly one entry is kept per set bit in the
+// count, but the most recent one is never merged here as it might turn
+// out to be the root.
+static void merge_cv_stack(struct blake3_context* self, uint64_t total_chunks)
+{
+    size_t post_merge_len = __builtin_popcountll(total_chunks);
+    struct output out;
+
+    while (self->cv_stack_len > post_merge_len)
+    {
+        parent_output(self->cv_stack[self->cv_stack_len - 2],
+                      self->cv_stack[self->cv_stack_len - 1], &out);
+        output_chaining_value(&out, self->cv_stack[self->cv_stack_len - 2]);
+        self->cv_stack_len--;
+    }
+}
+
+static void push_cv(struct blake3_context* self, const uint32_t cv[8], uint64_t chunk_counter)
+{
+    merge_cv_stack(self, chunk_counter);
+    memcpy(self->cv_stack[self->cv_stack_len], cv, sizeof(self->cv_stack[0]));
+    self->cv_stack_len++;
+}
+
+
+// === method API ===
+
+// Help text
+static void blake3_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+
+// Select a hash_many() implementation
+static int blake3_set_kernel(unsigned index, const char** name)
+{
+    switch (index)
+    {
+        case 0:
+            *name = "portable";
+            hash_many = &hash_many_portable;
+            simd_degree = 1;
+            return 0;
+#ifdef HAVE_X86_SIMD
+        case 1:
+            *name = "sse4.1";
+            if (!__builtin_cpu_supports("sse4.1"))
+                return 1;
+            hash_many = &hash_many_sse41;
+            simd_degree = 4;
+            return 0;
+        case 2:
+            *name = "avx2";
+            if (!__builtin_cpu_supports("avx2"))
+                return 1;
+            hash_many = &hash_many_avx2;
+            simd_degree = 8;
+            return 0;
+        case 3:
+            *name = "avx512";
+            if (!__builtin_cpu_supports("avx512f"))
+                return 1;
+            hash_many = &hash_many_avx512;
+            simd_degree = 16;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+// Initialize context structure
+static int blake3_init(struct context* ctx)
+{
+    struct blake3_context* context;
+
+    // Pick the widest kernel this processor supports
+    if (hash_many == NULL)
+    {
+        hash_many = &hash_many_portable;
+        simd_degree = 1;
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            hash_many = &hash_many_avx512;
+            simd_degree = 16;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            hash_many = &hash_many_avx2;
+            simd_degree = 8;
+        }
+        else if (__builtin_cpu_supports("sse4.1"))
+        {
+            hash_many = &hash_many_sse41;
+            simd_degree = 4;
+        }
+#endif
+    }
+
+    // Get a new context structure
+    context = context_alloc(ctx, sizeof(*context));
+    if (context == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    chunk_state_init(&context->chunk, 0);
+    context->cv_stack_len = 0;
+    context->threads = (ctx->threads > 0) ? ctx->threads : 1;
+
+    return 0;
+}
+
+// Process the next sequence of bytes
+static int blake3_process(struct context* ctx, void* data, size_t len)
+{
+    struct blake3_context* context = ctx->context;
+    const uint8_t* input = data;
+    uint32_t cv[8];
+    struct output out;
+    uint64_t count_so_far;
+    size_t subtree_len;
+    size_t take;
+
+    // Finish the chunk in progress.  It is only closed off once more input
+    // arrives, as the final chunk is handled differently.
+    if (chunk_state_len(&context->chunk) > 0)
+    {
+        take = CHUNK_LEN - chunk_state_len(&context->chunk);
+        if (take > len)
+            take = len;
+        chunk_state_update(&context->chunk, input, take);
+        input += take;
+        len -= take;
+        if (len == 0)
+            return 0;
+
+        chunk_state_output(&context->chunk, &out);
+        output_chaining_value(&out, cv);
+        push_cv(context, cv, context->chunk.chunk_counter);
+        chunk_state_init(&context->chunk, context->chunk.chunk_counter + 1);
+    }
+
+    // Hash the largest whole subtrees possible straight from the input.
+    // The size must be a power of two number of chunks and line up with
+    // the number of chunks hashed so far.  Both halves of each subtree are
+    // pushed separately, since the subtree could turn out to be the root.
+    while (len > CHUNK_LEN)
+    {
+        subtree_len = (size_t)1 << (63 - __builtin_clzll(len));
+        count_so_far = context->chunk.chunk_counter * CHUNK_LEN;
+        while (((subtree_len - 1) & count_so_far) != 0)
+            subtree_len /= 2;
+
+        if (subtree_len <= CHUNK_LEN)
+        {
+            struct chunk_state chunk;
+
+            chunk_state_init(&chunk, context->chunk.chunk_counter);
+            chunk_state_update(&chunk, input, subtree_len);
+            chunk_state_output(&chunk, &out);
+            output_chaining_value(&out, cv);
+            push_cv(context, cv, chunk.chunk_counter);
+        }
+        else
+        {
+            uint32_t right_cv[8];
+
+            compress_subtree_halves(input, subtree_len, context->chunk.chunk_counter,
+                                    context->threads, cv, right_cv);
+            push_cv(context, cv, context->chunk.chunk_counter);
+            push_cv(context, right_cv,
+                    context->chunk.chunk_counter + subtree_len / 2 / CHUNK_LEN);
+        }
+
+        context->chunk.chunk_counter += subtree_len / CHUNK_LEN;
+        input += subtree_len;
+        len -= subtree_len;
+    }
+
+    // Start the next chunk with whatever is left
+    if (len > 0)
+    {
+        chunk_state_update(&context->chunk, input, len);
+        merge_cv_stack(context, context->chunk.chunk_counter);
+    }
+
+    return 0;
+}
+
+// Finish up the hash and calculate the final value
+static int blake3_finish(struct context* ctx, uint8_t* digest)
+{
+    struct blake3_context* context = ctx->context;
+    struct output out;
+    uint32_t cv[8];
+    uint32_t v[16];
+    uint32_t word;
+    size_t remaining;
+    int i;
+
+    // Work out the root node: either the last chunk on its own, or the
+    // last chunk (or pair of subtrees) merged with everything on the stack
+    if (context->cv_stack_len == 0)
+    {
+        chunk_state_output(&context->chunk, &out);
+    }
+    else
+    {
+        if (chunk_state_len(&context->chunk) > 0)
+        {
+            remaining = context->cv_stack_len;
+            chunk_state_output(&context->chunk, &out);
+        }
+        else
+        {
+            remaining = context->cv_stack_len - 2;
+            parent_output(context->cv_stack[remaining], context->cv_stack[remaining + 1], &out);
+        }
+        while (remaining > 0)
+        {
+            remaining--;
+            output_chaining_value(&out, cv);
+            parent_output(context->cv_stack[remaining], cv, &out);
+        }
+    }
+
+    // Compress the root node
+    compress_pre(v, out.input_cv, out.block, out.block_len, 0, out.flags | ROOT);
+
+    // Output hash (the words are serialized little-endian)
+    for (i = 0; i < OUT_LEN / sizeof(uint32_t); ++i)
+    {
+        word = TO_LE32(v[i] ^ v[i + 8]);
+        memcpy(&digest[i * sizeof(word)], &word, sizeof(word));
+    }
+
+    // Clean up
+    context_free(ctx);
+
+    return 0;
+}
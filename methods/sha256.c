@@ -21,6 +21,10 @@
  *  - Variable and function names have been chosen to match the
  *    FIPS 180-4 spec as closely as possible.
  *  - Any undocumented magic numbers were taken directly from the spec.
+ *  - HMAC-SHA256 (RFC 2104) is also implemented here.  The key's inner
+ *    and outer padding blocks are hashed once, when the key is set, and
+ *    each message starts from a copy of those intermediate hash values,
+ *    so a short message costs two or three block updates in all.
  */
 
 #include <assert.h>
@@ -31,11 +35,18 @@
 #include <string.h>
 #include "method.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 // Algorithm parameters
 #define BLOCK_SIZE      (512 / 8) // size of input blocks (bytes)
 #define HASH_SIZE       (256 / 8) // size of output hash (bytes)
 #define HASH_SIZE_WORDS (HASH_SIZE / sizeof(uint32_t))
 
+// Number of messages hashed side by side by the multi-buffer kernel
+#define LANES           8
+
 
 // Module-specific context structure
 struct sha256_context
@@ -53,30 +64,109 @@ struct sha256_context
     uint64_t length;
 };
 
+// One message being hashed as part of a batch
+struct lane
+{
+    // whole blocks still to be hashed straight from the message
+    const uint8_t* data;
+    size_t         blocks;
+
+    // the rest of the message, padded
+    uint8_t        tail[2 * BLOCK_SIZE];
+    unsigned       tail_blocks;
+    unsigned       tail_done;
+
+    // position of the message in the batch
+    size_t         index;
+};
+
 
 static void     sha256_help     (void);
 static int      sha256_init     (struct context* ctx);
 static int      sha256_process  (struct context* ctx, void* data, size_t len);
-static int      sha256_finish   (struct context* ctx);
-static uint32_t Ch              (uint32_t x, uint32_t y, uint32_t z);
-static uint32_t Maj             (uint32_t x, uint32_t y, uint32_t z);
-static uint32_t ROTR            (uint32_t value, unsigned int places);
+static int      sha256_finish   (struct context* ctx, uint8_t* digest);
+static void     hmac_help       (void);
+static int      hmac_init       (struct context* ctx);
+static int      hmac_finish     (struct context* ctx, uint8_t* digest);
+static int      hmac_set_key    (const uint8_t* key, size_t len);
+static int      hmac_batch      (size_t count, const uint8_t* const* msgs,
+                                 const size_t* lens, uint8_t* digests);
+static void     hmac_outer      (const struct hmac_sha256_key* key,
+                                 const uint8_t* inner, uint8_t* mac);
+static int      sha256_set_kernel(unsigned index, const char** name);
 static int      sha256_update   (struct sha256_context* ctx);
+static void     sha256_compress_unrolled(uint32_t* H, const uint8_t* block);
+static void     sha256_compress_zeros(uint32_t* H);
+#ifdef SHA256_REFERENCE
+static void     sha256_compress_reference(uint32_t* H, const uint8_t* block);
+#endif
+static int      sha256_zeros    (struct context* ctx, uint64_t len);
+static void     sha256_final    (struct sha256_context* context, uint8_t* digest);
+static void     store_hash      (const uint32_t* H, uint8_t* digest);
+static int      sha256_batch    (size_t count, const uint8_t* const* msgs,
+                                 const size_t* lens, uint8_t* digests);
+static void     lane_start      (struct lane* lane, size_t index,
+                                 const uint8_t* msg, size_t len);
+static const uint8_t* lane_next (struct lane* lane);
+#ifdef HAVE_X86_SIMD
+static void     sha256_compress_x8(uint32_t (*S)[LANES], const uint8_t* const* blocks);
+#endif
 
 
 struct method_api sha256 =
 {
-    .name        = "SHA-256 hash",
-    .args        = "-sha256",
-    .type        = SHA256,
-    .output_size = HASH_SIZE,
-    .chunk_size  = 0,
-    .help        = &sha256_help,
-    .sum_init    = &sha256_init,
-    .sum_process = &sha256_process,
-    .sum_finish  = &sha256_finish
+    .name         = "SHA-256 hash",
+    .args         = "-sha256",
+    .type         = SHA256,
+    .output_size  = HASH_SIZE,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct sha256_context),
+    .crypto_hash  = 1,
+    .help         = &sha256_help,
+    .sum_init     = &sha256_init,
+    .sum_process  = &sha256_process,
+    .sum_finish   = &sha256_finish,
+    .set_kernel   = &sha256_set_kernel,
+    .sum_batch    = &sha256_batch,
+    .sum_zeros    = &sha256_zeros
 };
 
+struct method_api hmac_sha256 =
+{
+    .name         = "HMAC-SHA256 (key from --key or --key-file)",
+    .args         = "-hmac256",
+    .type         = HMAC_SHA256,
+    .output_size  = HASH_SIZE,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct sha256_context),
+    .crypto_hash  = 1,
+    .help         = &hmac_help,
+    .sum_init     = &hmac_init,
+    .sum_process  = &sha256_process,
+    .sum_finish   = &hmac_finish,
+    .set_kernel   = &sha256_set_kernel,
+    .set_key      = &hmac_set_key,
+    .sum_batch    = &hmac_batch,
+    .sum_zeros    = &sha256_zeros
+};
+
+// Initial hash value
+static const uint32_t H0[HASH_SIZE_WORDS] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// Compression function for single messages
+static void (*sha256_compress)(uint32_t* H, const uint8_t* block) = &sha256_compress_unrolled;
+
+// Non-zero if batches may use the multi-buffer kernel
+static int use_lanes = -1;
+
+// Key used by the HMAC method
+static struct hmac_sha256_key method_key;
+static int have_key = 0;
+
 // Constants
 static const uint32_t K[64] =
 {
@@ -102,6 +192,40 @@ static void sha256_help(void)
     printf("%s - TBD\n", __func__);
 }
 
+// Select an implementation of the compression function.  The
+// multi-buffer kernel for batches counts as one of them.
+static int sha256_set_kernel(unsigned index, const char** name)
+{
+    switch (index)
+    {
+        case 0:
+            *name = "unrolled";
+            sha256_compress = &sha256_compress_unrolled;
+            use_lanes = 0;
+            return 0;
+        case 1:
+            *name = "avx2 batches";
+#ifdef HAVE_X86_SIMD
+            if (!__builtin_cpu_supports("avx2"))
+                return 1;
+            sha256_compress = &sha256_compress_unrolled;
+            use_lanes = 1;
+            return 0;
+#else
+            return 1;
+#endif
+#ifdef SHA256_REFERENCE
+        case 2:
+            *name = "reference";
+            sha256_compress = &sha256_compress_reference;
+            use_lanes = 0;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
 // Initialize context structure
 static int sha256_init(struct context* ctx)
 {
@@ -113,29 +237,17 @@ static int sha256_init(struct context* ctx)
         return 1;
     }
 
-    // Ditch any old buffer, if present
-    if (ctx->context != NULL)
-        free(ctx->context);
-
-    // Allocate a fresh context buffer
-    context = malloc(sizeof(*context));
+    // Get a fresh context buffer
+    context = context_alloc(ctx, sizeof(*context));
     if (context == NULL)
     {
         fprintf(stderr, "Unable to allocate memory\n");
         return 1;
     }
     memset(context, 0, sizeof(*context));
-    ctx->context = context;
 
     // Initialize hash
-    context->H[0] = 0x6a09e667;
-    context->H[1] = 0xbb67ae85;
-    context->H[2] = 0x3c6ef372;
-    context->H[3] = 0xa54ff53a;
-    context->H[4] = 0x510e527f;
-    context->H[5] = 0x9b05688c;
-    context->H[6] = 0x1f83d9ab;
-    context->H[7] = 0x5be0cd19;
+    memcpy(context->H, H0, sizeof(H0));
 
     return 0;
 }
@@ -181,92 +293,251 @@ static int sha256_process(struct context* ctx, void* data, size_t len)
     return 0;
 }
 
-// Finish up the hash and calculate the final value
-static int sha256_finish(struct context* ctx)
+// Process a run of zeros.  Whole blocks of zeros skip copying the input
+// and expanding the message schedule.
+static int sha256_zeros(struct context* ctx, uint64_t len)
 {
     struct sha256_context* context = ctx->context;
-    int i;
-    uint64_t len_bits;
-    unsigned original_length;
+    unsigned fill;
 
-    assert(context->input_length < BLOCK_SIZE);
-
-    // Append the required '1' bit
-    context->input[context->input_length] = 0x80;
-    original_length = context->input_length;
-
-    // Pad message buffer and finalize the hash
-    if (context->input_length >= (BLOCK_SIZE - sizeof(len_bits)))
+    // Fill up the current block
+    if (context->input_length > 0)
     {
-        // Not enough room to finish with current block.
-        // Pad the current block ...
-        context->input_length = BLOCK_SIZE;
-        if (sha256_update(context))
+        fill = BLOCK_SIZE - context->input_length;
+        if (fill > len)
+            fill = len;
+        memset(&context->input[context->input_length], 0, fill);
+        context->input_length += fill;
+        len -= fill;
+        if ((context->input_length == BLOCK_SIZE) && sha256_update(context))
             return 1;
-        context->length -= BLOCK_SIZE; // padding bytes don't count
+        if (len == 0)
+            return 0;
+    }
 
-        // ... and add another to finish with.
+    for (; len >= BLOCK_SIZE; len -= BLOCK_SIZE)
+    {
+        sha256_compress_zeros(context->H);
+        context->length += BLOCK_SIZE;
     }
 
-    // Pad this block and append the message length
-    context->length += original_length;
-    len_bits = TO_BE64(context->length * 8);
-    memcpy(&context->input[BLOCK_SIZE - sizeof(len_bits)], &len_bits, sizeof(len_bits));
-    context->input_length = BLOCK_SIZE;
-    if (sha256_update(context))
-        return 1;
+    memset(context->input, 0, len);
+    context->input_length = len;
 
-    // Display hash
-    printf("0x");
-    for (i = 0; i < HASH_SIZE_WORDS; ++i)
+    return 0;
+}
+
+// Finish up the hash and calculate the final value
+static int sha256_finish(struct context* ctx, uint8_t* digest)
+{
+    sha256_final(ctx->context, digest);
+
+    // Clean up
+    context_free(ctx);
+
+    return 0;
+}
+
+
+// === HMAC-SHA256 ===
+
+// Help text
+static void hmac_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+
+// Start a message from the key's inner hash state
+static int hmac_init(struct context* ctx)
+{
+    struct sha256_context* context;
+
+    if (!have_key)
     {
-        printf("%08"PRIx32, context->H[i]);
+        fprintf(stderr, "HMAC needs a key (use --key or --key-file)\n");
+        return 1;
     }
-    putchar('\n');
 
-    // Clean up
-    free(ctx->context);
-    ctx->context = NULL;
+    if (sha256_init(ctx))
+        return 1;
+    context = ctx->context;
+    memcpy(context->H, method_key.inner, sizeof(context->H));
+    context->length = BLOCK_SIZE;
 
     return 0;
 }
 
+// Finish the inner hash, then run it through the outer one
+static int hmac_finish(struct context* ctx, uint8_t* digest)
+{
+    uint8_t inner[HASH_SIZE];
 
-// === algorithm helper functions ===
+    sha256_final(ctx->context, inner);
+    hmac_outer(&method_key, inner, digest);
+    context_free(ctx);
 
-static uint32_t Ch(uint32_t x, uint32_t y, uint32_t z)
+    return 0;
+}
+
+// Set the key for the HMAC method
+static int hmac_set_key(const uint8_t* key, size_t len)
 {
-    return (x & y) ^ ((~x) & z);
+    hmac_sha256_key_init(&method_key, key, len);
+    have_key = 1;
+
+    return 0;
 }
 
-static uint32_t Maj(uint32_t x, uint32_t y, uint32_t z)
+// Authenticate a batch of messages with the method's key
+static int hmac_batch(size_t count, const uint8_t* const* msgs,
+                      const size_t* lens, uint8_t* digests)
 {
-    return (x & y) ^ (x & z) ^ (y & z);
+    if (!have_key)
+    {
+        fprintf(stderr, "HMAC needs a key (use --key or --key-file)\n");
+        return 1;
+    }
+    hmac_sha256_batch(&method_key, count, msgs, lens, digests);
+
+    return 0;
 }
 
-// Circular-rotate a value to the right some number of places
-static uint32_t ROTR(uint32_t value, unsigned int places)
+// Prepare a key: hash the key XORed with the inner and outer pads
+void hmac_sha256_key_init(struct hmac_sha256_key* key, const uint8_t* data,
+                          size_t len)
 {
-    assert(places < 32);
-    return (value >> places) | (value << (32 - places));
+    struct sha256_context context;
+    uint8_t block[BLOCK_SIZE];
+    int i;
+
+    // Keys longer than a block are hashed first, shorter ones zero-padded
+    memset(block, 0, sizeof(block));
+    if (len > BLOCK_SIZE)
+    {
+        memset(&context, 0, sizeof(context));
+        memcpy(context.H, H0, sizeof(H0));
+        for (; len >= BLOCK_SIZE; data += BLOCK_SIZE, len -= BLOCK_SIZE)
+        {
+            sha256_compress(context.H, data);
+            context.length += BLOCK_SIZE;
+        }
+        memcpy(context.input, data, len);
+        context.input_length = len;
+        sha256_final(&context, block);
+    }
+    else
+    {
+        memcpy(block, data, len);
+    }
+
+    for (i = 0; i < BLOCK_SIZE; ++i)
+        block[i] ^= 0x36;
+    memcpy(key->inner, H0, sizeof(H0));
+    sha256_compress(key->inner, block);
+
+    for (i = 0; i < BLOCK_SIZE; ++i)
+        block[i] ^= 0x36 ^ 0x5c;
+    memcpy(key->outer, H0, sizeof(H0));
+    sha256_compress(key->outer, block);
 }
 
+// Authenticate a batch of messages under one key.  Whole blocks are
+// hashed straight from the caller's memory.
+void hmac_sha256_batch(const struct hmac_sha256_key* key, size_t count,
+                       const uint8_t* const* msgs, const size_t* lens,
+                       uint8_t* macs)
+{
+    struct sha256_context context;
+    uint8_t inner[HASH_SIZE];
+    const uint8_t* data;
+    size_t len;
+    size_t n;
+
+    for (n = 0; n < count; ++n)
+    {
+        memcpy(context.H, key->inner, sizeof(context.H));
+        context.length = BLOCK_SIZE;
+        for (data = msgs[n], len = lens[n]; len >= BLOCK_SIZE;
+             data += BLOCK_SIZE, len -= BLOCK_SIZE)
+        {
+            sha256_compress(context.H, data);
+            context.length += BLOCK_SIZE;
+        }
+        memcpy(context.input, data, len);
+        context.input_length = len;
+        sha256_final(&context, inner);
+        hmac_outer(key, inner, &macs[n * HASH_SIZE]);
+    }
+}
+
+// Outer hash: one block holding the inner hash, its padding and the
+// length (the key block plus the inner hash)
+static void hmac_outer(const struct hmac_sha256_key* key,
+                       const uint8_t* inner, uint8_t* mac)
+{
+    uint32_t H[HASH_SIZE_WORDS];
+    uint8_t block[BLOCK_SIZE];
+
+    memcpy(block, inner, HASH_SIZE);
+    md_pad(block, HASH_SIZE, BLOCK_SIZE, sizeof(uint64_t), BLOCK_SIZE + HASH_SIZE);
+    memcpy(H, key->outer, sizeof(H));
+    sha256_compress(H, block);
+    store_hash(H, mac);
+}
+
+
+// === algorithm helper functions ===
+
+// Circular-rotate a value to the right some number of places (0 < n < 32).
+// Compilers turn this form into a single rotate instruction.
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
 #define sigma0(x)   (ROTR((x), 2) ^ ROTR((x),13) ^ ROTR((x), 22))
 #define sigma1(x)   (ROTR((x), 6) ^ ROTR((x),11) ^ ROTR((x), 25))
 #define gamma0(x)   (ROTR((x), 7) ^ ROTR((x),18) ^ ((x) >> 3))
 #define gamma1(x)   (ROTR((x),17) ^ ROTR((x),19) ^ ((x) >> 10))
 
+// Ch() and Maj(), rewritten with one operation fewer each
+#define CH(x, y, z)     ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z)    (((x) & (y)) | ((z) & ((x) | (y))))
+
+// One round.  Rather than shuffling the working variables along, each
+// round is handed them under rotated names, so only d and h change.
+#define ROUND(a, b, c, d, e, f, g, h, t, w)                             \
+    do                                                                  \
+    {                                                                   \
+        uint32_t T1 = (h) + sigma1(e) + CH((e), (f), (g)) + K[t] + (w); \
+        (d) += T1;                                                      \
+        (h) = T1 + sigma0(a) + MAJ((a), (b), (c));                      \
+    } while (0)
+
+// Eight rounds, after which the names are back where they started.
+// 'W' gives the message word for round t.
+#define ROUNDS8(t, W)                                           \
+    ROUND(a, b, c, d, e, f, g, h, (t) + 0, W((t) + 0));         \
+    ROUND(h, a, b, c, d, e, f, g, (t) + 1, W((t) + 1));         \
+    ROUND(g, h, a, b, c, d, e, f, (t) + 2, W((t) + 2));         \
+    ROUND(f, g, h, a, b, c, d, e, (t) + 3, W((t) + 3));         \
+    ROUND(e, f, g, h, a, b, c, d, (t) + 4, W((t) + 4));         \
+    ROUND(d, e, f, g, h, a, b, c, (t) + 5, W((t) + 5));         \
+    ROUND(c, d, e, f, g, h, a, b, (t) + 6, W((t) + 6));         \
+    ROUND(b, c, d, e, f, g, h, a, (t) + 7, W((t) + 7))
+
+// Message words: the 16 loaded from the block, then the rest of the
+// schedule computed in place, word t overwriting word t-16 (which is its
+// last use); and the schedule of an all-zero block, which is all zeros
+// since gamma0(0) = gamma1(0) = 0.
+#define W_LOAD(t)   W[t]
+#define W_NEXT(t)   (W[(t) & 15] += gamma1(W[((t) - 2) & 15]) +        \
+                                    W[((t) - 7) & 15] +                 \
+                                    gamma0(W[((t) - 15) & 15]))
+#define W_ZERO(t)   0
+
 // Update the hash using a new block of data.
 // This function will clear out the message buffer and reset the relevant
 //  context data before returning.
 static int sha256_update(struct sha256_context* ctx)
 {
-    uint32_t a, b, c, d, e, f, g, h;
-    uint32_t W[64];
-    uint32_t T1, T2;
-    uint32_t* ptr;
-    int t;
-
     // Ensure that we have enough data to do an iteration
     if (ctx->input_length != BLOCK_SIZE)
     {
@@ -274,11 +545,107 @@ static int sha256_update(struct sha256_context* ctx)
         return 1;
     }
 
+    sha256_compress(ctx->H, ctx->input);
+
+    // Clean up and prepare for next block
+    memset(ctx->input, 0, sizeof(ctx->input));
+    ctx->length += ctx->input_length;
+    ctx->input_length = 0;
+
+    return 0;
+}
+
+// Run one message block through the compression function
+static void sha256_compress_unrolled(uint32_t* H, const uint8_t* block)
+{
+    uint32_t W[16];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t word;
+    int t;
+
+    for (t = 0; t < 16; ++t)
+    {
+        memcpy(&word, &block[t * sizeof(word)], sizeof(word));
+        W[t] = FROM_BE32(word);
+    }
+
+    a = H[0];
+    b = H[1];
+    c = H[2];
+    d = H[3];
+    e = H[4];
+    f = H[5];
+    g = H[6];
+    h = H[7];
+
+    ROUNDS8( 0, W_LOAD);
+    ROUNDS8( 8, W_LOAD);
+    ROUNDS8(16, W_NEXT);
+    ROUNDS8(24, W_NEXT);
+    ROUNDS8(32, W_NEXT);
+    ROUNDS8(40, W_NEXT);
+    ROUNDS8(48, W_NEXT);
+    ROUNDS8(56, W_NEXT);
+
+    H[0] += a;
+    H[1] += b;
+    H[2] += c;
+    H[3] += d;
+    H[4] += e;
+    H[5] += f;
+    H[6] += g;
+    H[7] += h;
+}
+
+// Run an all-zero block through the compression function
+static void sha256_compress_zeros(uint32_t* H)
+{
+    uint32_t a, b, c, d, e, f, g, h;
+
+    a = H[0];
+    b = H[1];
+    c = H[2];
+    d = H[3];
+    e = H[4];
+    f = H[5];
+    g = H[6];
+    h = H[7];
+
+    ROUNDS8( 0, W_ZERO);
+    ROUNDS8( 8, W_ZERO);
+    ROUNDS8(16, W_ZERO);
+    ROUNDS8(24, W_ZERO);
+    ROUNDS8(32, W_ZERO);
+    ROUNDS8(40, W_ZERO);
+    ROUNDS8(48, W_ZERO);
+    ROUNDS8(56, W_ZERO);
+
+    H[0] += a;
+    H[1] += b;
+    H[2] += c;
+    H[3] += d;
+    H[4] += e;
+    H[5] += f;
+    H[6] += g;
+    H[7] += h;
+}
+
+#ifdef SHA256_REFERENCE
+// Straightforward implementation of the compression function, following
+// the spec step by step, kept to check the unrolled one against
+static void sha256_compress_reference(uint32_t* H, const uint8_t* block)
+{
+    uint32_t W[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t T1, T2;
+    uint32_t word;
+    int t;
+
     // Prepare message schedule
-    ptr = (uint32_t*)&ctx->input;
     for (t = 0; t < 16; ++t)
     {
-        W[t] = FROM_BE32(ptr[t]);
+        memcpy(&word, &block[t * sizeof(word)], sizeof(word));
+        W[t] = FROM_BE32(word);
     }
     for (t = 16; t < 64; ++t)
     {
@@ -286,20 +653,20 @@ static int sha256_update(struct sha256_context* ctx)
     }
 
     // Initialize working variables
-    a = ctx->H[0];
-    b = ctx->H[1];
-    c = ctx->H[2];
-    d = ctx->H[3];
-    e = ctx->H[4];
-    f = ctx->H[5];
-    g = ctx->H[6];
-    h = ctx->H[7];
+    a = H[0];
+    b = H[1];
+    c = H[2];
+    d = H[3];
+    e = H[4];
+    f = H[5];
+    g = H[6];
+    h = H[7];
 
     // Compute hash update values
     for (t = 0; t < 64; ++t)
     {
-        T1 = h + sigma1(e) + Ch(e, f, g) + K[t] + W[t];
-        T2 = sigma0(a) + Maj(a, b, c);
+        T1 = h + sigma1(e) + ((e & f) ^ ((~e) & g)) + K[t] + W[t];
+        T2 = sigma0(a) + ((a & b) ^ (a & c) ^ (b & c));
         h = g;
         g = f;
         f = e;
@@ -311,20 +678,261 @@ static int sha256_update(struct sha256_context* ctx)
     }
 
     // Calculate new intermediate hash value
-    ctx->H[0] += a;
-    ctx->H[1] += b;
-    ctx->H[2] += c;
-    ctx->H[3] += d;
-    ctx->H[4] += e;
-    ctx->H[5] += f;
-    ctx->H[6] += g;
-    ctx->H[7] += h;
+    H[0] += a;
+    H[1] += b;
+    H[2] += c;
+    H[3] += d;
+    H[4] += e;
+    H[5] += f;
+    H[6] += g;
+    H[7] += h;
+}
+#endif
 
-    // Clean up and prepare for next block
-    memset(ctx->input, 0, sizeof(ctx->input));
-    ctx->length += ctx->input_length;
-    ctx->input_length = 0;
+// Pad the remaining input, run it through the hash and output the result
+static void sha256_final(struct sha256_context* context, uint8_t* digest)
+{
+    uint8_t pad[2 * BLOCK_SIZE];
+    size_t padded;
+    size_t offset;
+
+    assert(context->input_length < BLOCK_SIZE);
+
+    // Pad out the remaining input and append the message length
+    memcpy(pad, context->input, context->input_length);
+    padded = md_pad(pad, context->input_length, BLOCK_SIZE, sizeof(uint64_t),
+                    context->length + context->input_length);
+
+    // Run the padding block(s) through the hash
+    for (offset = 0; offset < padded; offset += BLOCK_SIZE)
+        sha256_compress(context->H, &pad[offset]);
+
+    store_hash(context->H, digest);
+}
+
+// Output a hash value, most significant byte first
+static void store_hash(const uint32_t* H, uint8_t* digest)
+{
+    uint32_t word;
+    int i;
+
+    for (i = 0; i < HASH_SIZE_WORDS; ++i)
+    {
+        word = TO_BE32(H[i]);
+        memcpy(&digest[i * sizeof(word)], &word, sizeof(word));
+    }
+}
+
+
+// === Batches ===
+
+// Hash a batch of separate messages.  With AVX2, LANES messages at a time
+// go through the multi-buffer kernel, each lane taking the next message
+// as soon as its current one is done.  Once too few messages are left to
+// keep the lanes busy, the rest are finished one at a time.
+static int sha256_batch(size_t count, const uint8_t* const* msgs,
+                        const size_t* lens, uint8_t* digests)
+{
+    struct lane lanes[LANES];
+    uint32_t H[HASH_SIZE_WORDS];
+    const uint8_t* block;
+    size_t next = 0;
+    unsigned i, w;
+#ifdef HAVE_X86_SIMD
+    static const uint8_t idle[BLOCK_SIZE];
+    uint32_t S[HASH_SIZE_WORDS][LANES] __attribute__((aligned(32)));
+    const uint8_t* blocks[LANES];
+    unsigned active = 0;
+
+    if (use_lanes < 0)
+        use_lanes = __builtin_cpu_supports("avx2");
+
+    if (use_lanes && (count >= LANES / 2))
+    {
+        for (i = 0; i < LANES; ++i)
+        {
+            lanes[i].index = SIZE_MAX;
+            if (next < count)
+            {
+                lane_start(&lanes[i], next, msgs[next], lens[next]);
+                for (w = 0; w < HASH_SIZE_WORDS; ++w)
+                    S[w][i] = H0[w];
+                ++next;
+                ++active;
+            }
+        }
+
+        while ((active >= LANES / 2) || ((active > 0) && (next < count)))
+        {
+            for (i = 0; i < LANES; ++i)
+                blocks[i] = (lanes[i].index != SIZE_MAX) ? lane_next(&lanes[i]) : idle;
+            sha256_compress_x8(S, blocks);
+
+            // Collect finished messages and start new ones in their lanes
+            for (i = 0; i < LANES; ++i)
+            {
+                if ((lanes[i].index == SIZE_MAX) ||
+                    (lanes[i].blocks > 0) || (lanes[i].tail_done < lanes[i].tail_blocks))
+                    continue;
+                for (w = 0; w < HASH_SIZE_WORDS; ++w)
+                    H[w] = S[w][i];
+                store_hash(H, &digests[lanes[i].index * HASH_SIZE]);
+
+                lanes[i].index = SIZE_MAX;
+                --active;
+                if (next < count)
+                {
+                    lane_start(&lanes[i], next, msgs[next], lens[next]);
+                    for (w = 0; w < HASH_SIZE_WORDS; ++w)
+                        S[w][i] = H0[w];
+                    ++next;
+                    ++active;
+                }
+            }
+        }
+
+        // Finish any stragglers on their own
+        for (i = 0; i < LANES; ++i)
+        {
+            if (lanes[i].index == SIZE_MAX)
+                continue;
+            for (w = 0; w < HASH_SIZE_WORDS; ++w)
+                H[w] = S[w][i];
+            while ((block = lane_next(&lanes[i])) != NULL)
+                sha256_compress(H, block);
+            store_hash(H, &digests[lanes[i].index * HASH_SIZE]);
+        }
+    }
+#endif
+
+    // One message at a time
+    for (; next < count; ++next)
+    {
+        lane_start(&lanes[0], next, msgs[next], lens[next]);
+        memcpy(H, H0, sizeof(H0));
+        while ((block = lane_next(&lanes[0])) != NULL)
+            sha256_compress(H, block);
+        store_hash(H, &digests[next * HASH_SIZE]);
+    }
 
     return 0;
 }
 
+// Set up a lane to hash a message
+static void lane_start(struct lane* lane, size_t index,
+                       const uint8_t* msg, size_t len)
+{
+    size_t rest;
+
+    lane->index = index;
+    lane->data = msg;
+    lane->blocks = len / BLOCK_SIZE;
+    rest = len % BLOCK_SIZE;
+    memcpy(lane->tail, &msg[len - rest], rest);
+    lane->tail_blocks = md_pad(lane->tail, rest, BLOCK_SIZE, sizeof(uint64_t), len) / BLOCK_SIZE;
+    lane->tail_done = 0;
+}
+
+// Get a lane's next block, or NULL if the message is done
+static const uint8_t* lane_next(struct lane* lane)
+{
+    const uint8_t* block;
+
+    if (lane->blocks > 0)
+    {
+        block = lane->data;
+        lane->data += BLOCK_SIZE;
+        --lane->blocks;
+        return block;
+    }
+    if (lane->tail_done < lane->tail_blocks)
+        return &lane->tail[BLOCK_SIZE * lane->tail_done++];
+
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Vector versions of the helper functions, working on one word from each
+// of eight messages
+#define ROTR_X8(x, n) \
+    _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define XOR3_X8(x, y, z) \
+    _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define Ch_X8(x, y, z) \
+    _mm256_xor_si256(_mm256_and_si256((x), (y)), _mm256_andnot_si256((x), (z)))
+#define Maj_X8(x, y, z) \
+    _mm256_xor_si256(_mm256_and_si256((x), (y)), \
+                     _mm256_and_si256((z), _mm256_xor_si256((x), (y))))
+#define sigma0_X8(x) XOR3_X8(ROTR_X8((x), 2), ROTR_X8((x), 13), ROTR_X8((x), 22))
+#define sigma1_X8(x) XOR3_X8(ROTR_X8((x), 6), ROTR_X8((x), 11), ROTR_X8((x), 25))
+#define gamma0_X8(x) XOR3_X8(ROTR_X8((x), 7), ROTR_X8((x), 18), _mm256_srli_epi32((x), 3))
+#define gamma1_X8(x) XOR3_X8(ROTR_X8((x), 17), ROTR_X8((x), 19), _mm256_srli_epi32((x), 10))
+
+// Word 't' of a block, converted from big-endian
+#define BLOCK_WORD(block, t) \
+    __extension__ ({ uint32_t w_; memcpy(&w_, &(block)[(t) * 4], 4); (int)__builtin_bswap32(w_); })
+
+// Update eight hashes at once, each with its own block.  S[i][lane] is
+// word i of the hash in that lane.
+__attribute__((target("avx2")))
+static void sha256_compress_x8(uint32_t (*S)[LANES], const uint8_t* const* blocks)
+{
+    __m256i W[64];
+    __m256i a, b, c, d, e, f, g, h;
+    __m256i T1, T2;
+    int t;
+
+    // Prepare message schedules
+    for (t = 0; t < 16; ++t)
+    {
+        W[t] = _mm256_setr_epi32(BLOCK_WORD(blocks[0], t), BLOCK_WORD(blocks[1], t),
+                                 BLOCK_WORD(blocks[2], t), BLOCK_WORD(blocks[3], t),
+                                 BLOCK_WORD(blocks[4], t), BLOCK_WORD(blocks[5], t),
+                                 BLOCK_WORD(blocks[6], t), BLOCK_WORD(blocks[7], t));
+    }
+    for (t = 16; t < 64; ++t)
+    {
+        W[t] = _mm256_add_epi32(_mm256_add_epi32(gamma1_X8(W[t-2]), W[t-7]),
+                                _mm256_add_epi32(gamma0_X8(W[t-15]), W[t-16]));
+    }
+
+    // Initialize working variables
+    a = _mm256_load_si256((const __m256i*)S[0]);
+    b = _mm256_load_si256((const __m256i*)S[1]);
+    c = _mm256_load_si256((const __m256i*)S[2]);
+    d = _mm256_load_si256((const __m256i*)S[3]);
+    e = _mm256_load_si256((const __m256i*)S[4]);
+    f = _mm256_load_si256((const __m256i*)S[5]);
+    g = _mm256_load_si256((const __m256i*)S[6]);
+    h = _mm256_load_si256((const __m256i*)S[7]);
+
+    // Compute hash update values
+    for (t = 0; t < 64; ++t)
+    {
+        T1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1_X8(e)),
+                              _mm256_add_epi32(Ch_X8(e, f, g),
+                                               _mm256_add_epi32(_mm256_set1_epi32(K[t]), W[t])));
+        T2 = _mm256_add_epi32(sigma0_X8(a), Maj_X8(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, T1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(T1, T2);
+    }
+
+    // Calculate new intermediate hash values
+    _mm256_store_si256((__m256i*)S[0], _mm256_add_epi32(a, _mm256_load_si256((const __m256i*)S[0])));
+    _mm256_store_si256((__m256i*)S[1], _mm256_add_epi32(b, _mm256_load_si256((const __m256i*)S[1])));
+    _mm256_store_si256((__m256i*)S[2], _mm256_add_epi32(c, _mm256_load_si256((const __m256i*)S[2])));
+    _mm256_store_si256((__m256i*)S[3], _mm256_add_epi32(d, _mm256_load_si256((const __m256i*)S[3])));
+    _mm256_store_si256((__m256i*)S[4], _mm256_add_epi32(e, _mm256_load_si256((const __m256i*)S[4])));
+    _mm256_store_si256((__m256i*)S[5], _mm256_add_epi32(f, _mm256_load_si256((const __m256i*)S[5])));
+    _mm256_store_si256((__m256i*)S[6], _mm256_add_epi32(g, _mm256_load_si256((const __m256i*)S[6])));
+    _mm256_store_si256((__m256i*)S[7], _mm256_add_epi32(h, _mm256_load_si256((const __m256i*)S[7])));
+}
+
+#endif
@@ -0,0 +1,545 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * SHA-512 family of hashes (SHA-512, SHA-384 and SHA-512/256)
+ *
+ * All three use the same compression function and only differ in their
+ * initial hash value and in how much of the final hash is output, so they
+ * share all of the code below.
+ *
+ * Notes:
+ *  - In this context, the term "word" refers to a 64-bit value.
+ *  - Variable and function names have been chosen to match the
+ *    FIPS 180-4 spec as closely as possible.
+ *  - Any undocumented magic numbers were taken directly from the spec.
+ *  - On x86 processors with AVX2, the message schedule is computed four
+ *    words at a time.  The selection is made at run time.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "method.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Algorithm parameters
+#define BLOCK_SIZE      (1024 / 8) // size of input blocks (bytes)
+#define STATE_SIZE      (512 / 8)  // size of the internal hash state (bytes)
+#define STATE_WORDS     (STATE_SIZE / sizeof(uint64_t))
+#define SCHEDULE_WORDS  80         // number of rounds/message schedule words
+
+
+// Module-specific context structure
+struct sha512_context
+{
+    // current hash value
+    uint64_t H[STATE_WORDS];
+
+    // current input block
+    uint8_t  input[BLOCK_SIZE];
+
+    // amount of data currently in the 'input' buffer (bytes)
+    unsigned input_length;
+
+    // total length of the input data compressed so far (bytes)
+    uint64_t length;
+};
+
+
+static void     sha384_help     (void);
+static void     sha512_help     (void);
+static void     sha512_256_help (void);
+static int      sha512_init     (struct context* ctx);
+static int      sha512_process  (struct context* ctx, void* data, size_t len);
+static int      sha512_finish   (struct context* ctx, uint8_t* digest);
+static int      sha512_set_kernel(unsigned index, const char** name);
+static int      sha512_zeros    (struct context* ctx, uint64_t len);
+static void     sha512_compress_scalar(uint64_t* H, const uint8_t* block);
+#ifdef HAVE_X86_SIMD
+static void     sha512_compress_avx2  (uint64_t* H, const uint8_t* block);
+#endif
+
+
+struct method_api sha384 =
+{
+    .name         = "SHA-384 hash",
+    .args         = "-sha384",
+    .type         = SHA384,
+    .output_size  = 384 / 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct sha512_context),
+    .crypto_hash  = 1,
+    .help         = &sha384_help,
+    .sum_init     = &sha512_init,
+    .sum_process  = &sha512_process,
+    .sum_finish   = &sha512_finish,
+    .set_kernel   = &sha512_set_kernel,
+    .sum_zeros    = &sha512_zeros
+};
+
+struct method_api sha512 =
+{
+    .name         = "SHA-512 hash",
+    .args         = "-sha512",
+    .type         = SHA512,
+    .output_size  = 512 / 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct sha512_context),
+    .crypto_hash  = 1,
+    .help         = &sha512_help,
+    .sum_init     = &sha512_init,
+    .sum_process  = &sha512_process,
+    .sum_finish   = &sha512_finish,
+    .set_kernel   = &sha512_set_kernel,
+    .sum_zeros    = &sha512_zeros
+};
+
+struct method_api sha512_256 =
+{
+    .name         = "SHA-512/256 hash",
+    .args         = "-sha512_256",
+    .type         = SHA512_256,
+    .output_size  = 256 / 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct sha512_context),
+    .crypto_hash  = 1,
+    .help         = &sha512_256_help,
+    .sum_init     = &sha512_init,
+    .sum_process  = &sha512_process,
+    .sum_finish   = &sha512_finish,
+    .set_kernel   = &sha512_set_kernel,
+    .sum_zeros    = &sha512_zeros
+};
+
+// Constants
+static const uint64_t K[SCHEDULE_WORDS] =
+{
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f,
+    0xe9b5dba58189dbbc, 0x3956c25bf348b538, 0x59f111f1b605d019,
+    0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242,
+    0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+    0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235,
+    0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3,
+    0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 0x2de92c6f592b0275,
+    0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+    0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f,
+    0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+    0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc,
+    0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+    0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6,
+    0x92722c851482353b, 0xa2bfe8a14cf10364, 0xa81a664bbc423001,
+    0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218,
+    0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+    0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99,
+    0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb,
+    0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc,
+    0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915,
+    0xc67178f2e372532b, 0xca273eceea26619c, 0xd186b8c721c0c207,
+    0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba,
+    0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+    0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc,
+    0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a,
+    0x5fcb6fab3ad6faec, 0x6c44198c4a475817
+};
+
+// Initial hash values for each variant
+static const uint64_t H0_384[STATE_WORDS] =
+{
+    0xcbbb9d5dc1059ed8, 0x629a292a367cd507, 0x9159015a3070dd17,
+    0x152fecd8f70e5939, 0x67332667ffc00b31, 0x8eb44a8768581511,
+    0xdb0c2e0d64f98fa7, 0x47b5481dbefa4fa4
+};
+static const uint64_t H0_512[STATE_WORDS] =
+{
+    0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b,
+    0xa54ff53a5f1d36f1, 0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+    0x1f83d9abfb41bd6b, 0x5be0cd19137e2179
+};
+static const uint64_t H0_512_256[STATE_WORDS] =
+{
+    0x22312194fc2bf72c, 0x9f555fa3c84c64c2, 0x2393b86b6f53b151,
+    0x963877195940eabd, 0x96283ee2a88effe3, 0xbe5e1e2553863992,
+    0x2b0199fc2c85b8aa, 0x0eb72ddc81c52ca2
+};
+
+// Compression function, chosen when the first context is initialized
+static void (*sha512_compress)(uint64_t* H, const uint8_t* block) = NULL;
+
+
+// Help text
+static void sha384_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+static void sha512_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+static void sha512_256_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+
+// Select an implementation of the compression function
+static int sha512_set_kernel(unsigned index, const char** name)
+{
+    switch (index)
+    {
+        case 0:
+            *name = "scalar";
+            sha512_compress = &sha512_compress_scalar;
+            return 0;
+#ifdef HAVE_X86_SIMD
+        case 1:
+            *name = "avx2";
+            if (!__builtin_cpu_supports("avx2"))
+                return 1;
+            sha512_compress = &sha512_compress_avx2;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+// Initialize context structure
+static int sha512_init(struct context* ctx)
+{
+    struct sha512_context* context;
+    const uint64_t* H0;
+
+    if (ctx == NULL)
+    {
+        fprintf(stderr, "Invalid context data\n");
+        return 1;
+    }
+
+    switch (ctx->which)
+    {
+        case SHA384:
+            H0 = H0_384;
+            break;
+        case SHA512:
+            H0 = H0_512;
+            break;
+        case SHA512_256:
+            H0 = H0_512_256;
+            break;
+        default:
+            fprintf(stderr, "Context information format error\n");
+            return 1;
+    }
+
+    // Pick the fastest kernel this processor supports
+    if (sha512_compress == NULL)
+    {
+        sha512_compress = &sha512_compress_scalar;
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2"))
+            sha512_compress = &sha512_compress_avx2;
+#endif
+    }
+
+    // Get a fresh context buffer
+    context = context_alloc(ctx, sizeof(*context));
+    if (context == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    memset(context, 0, sizeof(*context));
+
+    // Initialize hash
+    memcpy(context->H, H0, sizeof(context->H));
+
+    return 0;
+}
+
+// Process the next sequence of bytes
+static int sha512_process(struct context* ctx, void* data, size_t len)
+{
+    struct sha512_context* context;
+    uint8_t* ptr;
+    size_t bytes_to_read;
+
+    context = ctx->context;
+    ptr = data;
+
+    // Top up a partially-filled message block first
+    if (context->input_length > 0)
+    {
+        bytes_to_read = BLOCK_SIZE - context->input_length;
+        if (len < bytes_to_read)
+            bytes_to_read = len;
+
+        memcpy(&context->input[context->input_length], ptr, bytes_to_read);
+        context->input_length += bytes_to_read;
+        ptr += bytes_to_read;
+        len -= bytes_to_read;
+
+        if (context->input_length < BLOCK_SIZE)
+            return 0;
+
+        sha512_compress(context->H, context->input);
+        context->length += BLOCK_SIZE;
+        context->input_length = 0;
+    }
+
+    // Whole blocks can be hashed straight out of the caller's buffer
+    while (len >= BLOCK_SIZE)
+    {
+        sha512_compress(context->H, ptr);
+        context->length += BLOCK_SIZE;
+        ptr += BLOCK_SIZE;
+        len -= BLOCK_SIZE;
+    }
+
+    // Save any leftovers for next time
+    memcpy(context->input, ptr, len);
+    context->input_length = len;
+
+    return 0;
+}
+
+// Finish up the hash and calculate the final value
+static int sha512_finish(struct context* ctx, uint8_t* digest)
+{
+    struct sha512_context* context = ctx->context;
+    uint8_t pad[2 * BLOCK_SIZE];
+    size_t padded;
+    size_t offset;
+    uint64_t word;
+    int i;
+    int words;
+
+    assert(context->input_length < BLOCK_SIZE);
+
+    // Pad out the remaining input and append the message length
+    memcpy(pad, context->input, context->input_length);
+    padded = md_pad(pad, context->input_length, BLOCK_SIZE, 2 * sizeof(uint64_t),
+                    context->length + context->input_length);
+    for (offset = 0; offset < padded; offset += BLOCK_SIZE)
+        sha512_compress(context->H, &pad[offset]);
+
+    // Output the (possibly truncated) hash
+    switch (ctx->which)
+    {
+        case SHA384:     words = 384 / 64; break;
+        case SHA512_256: words = 256 / 64; break;
+        default:         words = 512 / 64; break;
+    }
+    for (i = 0; i < words; ++i)
+    {
+        word = TO_BE64(context->H[i]);
+        memcpy(&digest[i * sizeof(word)], &word, sizeof(word));
+    }
+
+    // Clean up
+    context_free(ctx);
+
+    return 0;
+}
+
+
+// === algorithm helper functions ===
+
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (64 - (n))))
+#define Ch(x, y, z) (((x) & (y)) ^ ((~(x)) & (z)))
+#define Maj(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+#define sigma0(x)   (ROTR((x),28) ^ ROTR((x),34) ^ ROTR((x),39))
+#define sigma1(x)   (ROTR((x),14) ^ ROTR((x),18) ^ ROTR((x),41))
+#define gamma0(x)   (ROTR((x), 1) ^ ROTR((x), 8) ^ ((x) >> 7))
+#define gamma1(x)   (ROTR((x),19) ^ ROTR((x),61) ^ ((x) >> 6))
+
+// Read a big-endian word from an arbitrarily-aligned buffer
+static inline uint64_t load_be64(const uint8_t* p)
+{
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+           ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+           ((uint64_t)p[6] <<  8) |  (uint64_t)p[7];
+}
+
+// One round of the hash.  Rather than shuffling all eight working
+// variables after every round, the callers rotate the argument order.
+#define ROUND(a, b, c, d, e, f, g, h, t) \
+do {\
+    uint64_t T1 = (h) + sigma1(e) + Ch((e), (f), (g)) + K[t] + W[t];\
+    (d) += T1;\
+    (h) = T1 + sigma0(a) + Maj((a), (b), (c));\
+} while (0)
+
+// Run all rounds over a prepared message schedule and update the hash
+static inline void sha512_rounds(uint64_t* H, const uint64_t* W)
+{
+    uint64_t a, b, c, d, e, f, g, h;
+    int t;
+
+    // Initialize working variables
+    a = H[0];
+    b = H[1];
+    c = H[2];
+    d = H[3];
+    e = H[4];
+    f = H[5];
+    g = H[6];
+    h = H[7];
+
+    // Compute hash update values, eight rounds at a time
+    for (t = 0; t < SCHEDULE_WORDS; t += 8)
+    {
+        ROUND(a, b, c, d, e, f, g, h, t + 0);
+        ROUND(h, a, b, c, d, e, f, g, t + 1);
+        ROUND(g, h, a, b, c, d, e, f, t + 2);
+        ROUND(f, g, h, a, b, c, d, e, t + 3);
+        ROUND(e, f, g, h, a, b, c, d, t + 4);
+        ROUND(d, e, f, g, h, a, b, c, t + 5);
+        ROUND(c, d, e, f, g, h, a, b, t + 6);
+        ROUND(b, c, d, e, f, g, h, a, t + 7);
+    }
+
+    // Calculate new intermediate hash value
+    H[0] += a;
+    H[1] += b;
+    H[2] += c;
+    H[3] += d;
+    H[4] += e;
+    H[5] += f;
+    H[6] += g;
+    H[7] += h;
+}
+
+// Update the hash with one block of data (portable version)
+static void sha512_compress_scalar(uint64_t* H, const uint8_t* block)
+{
+    uint64_t W[SCHEDULE_WORDS];
+    int t;
+
+    // Prepare message schedule
+    for (t = 0; t < 16; ++t)
+    {
+        W[t] = load_be64(&block[t * sizeof(uint64_t)]);
+    }
+    for (t = 16; t < SCHEDULE_WORDS; ++t)
+    {
+        W[t] = gamma1(W[t-2]) + W[t-7] + gamma0(W[t-15]) + W[t-16];
+    }
+
+    sha512_rounds(H, W);
+}
+
+// Process a run of zeros.  The message schedule of an all-zero block is
+// all zeros, so whole blocks of zeros only need the rounds.
+static int sha512_zeros(struct context* ctx, uint64_t len)
+{
+    static const uint64_t zero_schedule[SCHEDULE_WORDS];
+    struct sha512_context* context = ctx->context;
+    unsigned fill;
+
+    // Top up a partially-filled message block first
+    if (context->input_length > 0)
+    {
+        fill = BLOCK_SIZE - context->input_length;
+        if (fill > len)
+            fill = len;
+        memset(&context->input[context->input_length], 0, fill);
+        context->input_length += fill;
+        len -= fill;
+
+        if (context->input_length < BLOCK_SIZE)
+            return 0;
+
+        sha512_compress(context->H, context->input);
+        context->length += BLOCK_SIZE;
+        context->input_length = 0;
+    }
+
+    for (; len >= BLOCK_SIZE; len -= BLOCK_SIZE)
+    {
+        sha512_rounds(context->H, zero_schedule);
+        context->length += BLOCK_SIZE;
+    }
+
+    memset(context->input, 0, len);
+    context->input_length = len;
+
+    return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Vector versions of the message schedule functions
+#define ROTR_256(x, n) \
+    _mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64 - (n)))
+#define ROTR_128(x, n) \
+    _mm_or_si128(_mm_srli_epi64((x), (n)), _mm_slli_epi64((x), 64 - (n)))
+#define gamma0_256(x) \
+    _mm256_xor_si256(_mm256_xor_si256(ROTR_256((x), 1), ROTR_256((x), 8)), \
+                     _mm256_srli_epi64((x), 7))
+#define gamma1_128(x) \
+    _mm_xor_si128(_mm_xor_si128(ROTR_128((x), 19), ROTR_128((x), 61)), \
+                  _mm_srli_epi64((x), 6))
+
+// Update the hash with one block of data (AVX2 message schedule)
+//
+// W[t-16], W[t-15] and W[t-7] are always available for four words at a
+// time, but W[t] depends on W[t-2], so the gamma1 term for the upper two
+// words has to wait until the lower two are done.
+__attribute__((target("avx2")))
+static void sha512_compress_avx2(uint64_t* H, const uint8_t* block)
+{
+    uint64_t W[SCHEDULE_WORDS] __attribute__((aligned(32)));
+    const __m256i bswap = _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    __m256i s;
+    __m128i lo, hi;
+    int t;
+
+    // Load the message block, converting from big-endian
+    for (t = 0; t < 16; t += 4)
+    {
+        s = _mm256_loadu_si256((const __m256i*)&block[t * sizeof(uint64_t)]);
+        _mm256_store_si256((__m256i*)&W[t], _mm256_shuffle_epi8(s, bswap));
+    }
+
+    // Expand the rest of the schedule
+    for (t = 16; t < SCHEDULE_WORDS; t += 4)
+    {
+        s = _mm256_add_epi64(_mm256_load_si256((const __m256i*)&W[t-16]),
+                             gamma0_256(_mm256_loadu_si256((const __m256i*)&W[t-15])));
+        s = _mm256_add_epi64(s, _mm256_loadu_si256((const __m256i*)&W[t-7]));
+
+        lo = _mm_add_epi64(_mm256_castsi256_si128(s),
+                           gamma1_128(_mm_load_si128((const __m128i*)&W[t-2])));
+        _mm_store_si128((__m128i*)&W[t], lo);
+
+        hi = _mm_add_epi64(_mm256_extracti128_si256(s, 1), gamma1_128(lo));
+        _mm_store_si128((__m128i*)&W[t+2], hi);
+    }
+
+    sha512_rounds(H, W);
+}
+
+#endif
@@ -14,90 +14,281 @@
  * limitations under the License.
  */
 /*
- * Simple sum-of-bytes checksum
+ * Sum-based checksums
  *
- * Since the algorithm is the same, all checksum sizes use the same
- * code.  The only thing that differs is the number of digits that
- * get printed.
+ * Simple sum-of-bytes checksum:
+ *  Since the algorithm is the same, all checksum sizes use the same
+ *  code.  The only thing that differs is the number of digits that
+ *  get printed.
+ *
+ * Adler-32 and Fletcher-16/32/64:
+ *  These keep two running sums modulo M: s1 is the sum of the input
+ *  words and s2 is the sum of the successive values of s1, which makes
+ *  the result depend on the order of the input.  Fletcher-16 works on
+ *  bytes (M = 255), Fletcher-32 on little-endian 16-bit words
+ *  (M = 65535) and Fletcher-64 on little-endian 32-bit words
+ *  (M = 2^32 - 1).  A trailing partial word is padded with zeros.
+ *  Adler-32 works on bytes with M = 65521 and starts s1 at 1.
+ *
+ * Notes:
+ *  - Sums are kept in 64-bit variables so that the modulo reduction only
+ *    has to be done once per block of several thousand words.
+ *  - The SSSE3 and AVX2 kernels use the weighted-sum technique: for a
+ *    vector of m words, s2 grows by m*s1 plus the sum of the words
+ *    weighted m, m-1, ..., 1.  The weighted sums come from pmaddubsw.
+ *    Wider words are split into byte planes which are summed separately
+ *    and recombined when the block is reduced.
+ *  - When the context's thread count is above one, large buffers are
+ *    split between threads and the partial sums are combined afterwards.
+ *    The result does not depend on the number of threads used.
  */
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "method.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Words summed between modulo reductions (keeps the 64-bit sums in range
+// even for 32-bit words)
+#define NMAX            16384
+
+// Bytes summed by the vector kernels between reductions (keeps the 32-bit
+// vector lanes in range)
+#define VBLOCK          16384
+
+// Buffers smaller than this (per thread) are not worth splitting up
+#define MIN_THREAD_LEN  (256 * 1024)
+
+
+// Parameters of one member of the Adler/Fletcher family
+struct fletcher_param
+{
+    // modulus applied to both sums
+    uint64_t mod;
+
+    // size of an input word, in bytes
+    unsigned width;
+
+    // initial value of s1
+    uint64_t init;
+};
+
+// Running state of an Adler/Fletcher checksum
+struct fletcher_state
+{
+    uint64_t s1;
+    uint64_t s2;
+};
+
+// Fold 'len' bytes (a multiple of the word size) into a running state
+typedef void (*fletcher_kernel_fn)(const struct fletcher_param* param,
+                                   struct fletcher_state* state,
+                                   const uint8_t* data, size_t len);
+
+// Module-specific context structures
+struct simple_context
+{
+    uint64_t sum;
+    unsigned threads;
+};
+
+struct fletcher_context
+{
+    const struct fletcher_param* param;
+    struct fletcher_state        state;
+
+    // bytes of an incomplete word carried over to the next call
+    uint8_t  partial[4];
+    unsigned partial_len;
+
+    unsigned threads;
+};
+
+// A section of a buffer summed by one thread
+struct sum_part
+{
+    const struct fletcher_param* param; // NULL for the simple sums
+    const uint8_t*               data;
+    size_t                       len;
+    struct fletcher_state        state;
+    pthread_t                    thread;
+};
+
 static void simple8_help    (void);
 static void simple16_help   (void);
 static void simple32_help   (void);
 static void simple64_help   (void);
 static int  simple_init     (struct context* ctx);
 static int  simple_process  (struct context* ctx, void* data, size_t len);
-static int  simple_finish   (struct context* ctx);
+static int  simple_finish   (struct context* ctx, uint8_t* digest);
+static int  simple_zeros    (struct context* ctx, uint64_t len);
+static void adler32_help    (void);
+static void fletcher16_help (void);
+static void fletcher32_help (void);
+static void fletcher64_help (void);
+static int  fletcher_init   (struct context* ctx);
+static int  fletcher_process(struct context* ctx, void* data, size_t len);
+static int  fletcher_finish (struct context* ctx, uint8_t* digest);
+static int  fletcher_zeros  (struct context* ctx, uint64_t len);
+static int  fletcher_set_kernel(unsigned index, const char** name);
+static void fletcher_combine(const struct fletcher_param* param,
+                             struct fletcher_state* state,
+                             const struct fletcher_state* part,
+                             uint64_t words);
+static void simple_combine  (struct fletcher_state* state,
+                             const struct fletcher_state* part);
+static void kernel_scalar   (const struct fletcher_param* param,
+                             struct fletcher_state* state,
+                             const uint8_t* data, size_t len);
 
 // 8-bit version
 struct method_api simple_8 =
 {
-    .name        = "8-bit sum",
-    .args        = "-8",
-    .type        = SIMPLE8,
-    .output_size = 1,
-    .chunk_size  = 0,
-    .help        = &simple8_help,
-    .sum_init    = &simple_init,
-    .sum_process = &simple_process,
-    .sum_finish  = &simple_finish
+    .name         = "8-bit sum",
+    .args         = "-8",
+    .type         = SIMPLE8,
+    .output_size  = 1,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct simple_context),
+    .help         = &simple8_help,
+    .sum_init     = &simple_init,
+    .sum_process  = &simple_process,
+    .sum_finish   = &simple_finish,
+    .sum_zeros    = &simple_zeros
 };
 
 // 16-bit version
 struct method_api simple_16 =
 {
-    .name        = "16-bit sum",
-    .args        = "-16",
-    .type        = SIMPLE16,
-    .output_size = 2,
-    .chunk_size  = 0,
-    .help        = &simple16_help,
-    .sum_init    = &simple_init,
-    .sum_process = &simple_process,
-    .sum_finish  = &simple_finish
+    .name         = "16-bit sum",
+    .args         = "-16",
+    .type         = SIMPLE16,
+    .output_size  = 2,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct simple_context),
+    .help         = &simple16_help,
+    .sum_init     = &simple_init,
+    .sum_process  = &simple_process,
+    .sum_finish   = &simple_finish,
+    .sum_zeros    = &simple_zeros
 };
 
 // 32-bit version
 struct method_api simple_32 =
 {
-    .name        = "32-bit sum",
-    .args        = "-32",
-    .type        = SIMPLE32,
-    .output_size = 4,
-    .chunk_size  = 0,
-    .help        = &simple32_help,
-    .sum_init    = &simple_init,
-    .sum_process = &simple_process,
-    .sum_finish  = &simple_finish
+    .name         = "32-bit sum",
+    .args         = "-32",
+    .type         = SIMPLE32,
+    .output_size  = 4,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct simple_context),
+    .help         = &simple32_help,
+    .sum_init     = &simple_init,
+    .sum_process  = &simple_process,
+    .sum_finish   = &simple_finish,
+    .sum_zeros    = &simple_zeros
 };
 
 // 64-bit version
 struct method_api simple_64 =
 {
-    .name        = "64-bit sum",
-    .args        = "-64",
-    .type        = SIMPLE64,
-    .output_size = 8,
-    .chunk_size  = 0,
-    .help        = &simple64_help,
-    .sum_init    = &simple_init,
-    .sum_process = &simple_process,
-    .sum_finish  = &simple_finish
+    .name         = "64-bit sum",
+    .args         = "-64",
+    .type         = SIMPLE64,
+    .output_size  = 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct simple_context),
+    .help         = &simple64_help,
+    .sum_init     = &simple_init,
+    .sum_process  = &simple_process,
+    .sum_finish   = &simple_finish,
+    .sum_zeros    = &simple_zeros
 };
 
+// Adler-32
+struct method_api adler32 =
+{
+    .name         = "Adler-32",
+    .args         = "-adler32",
+    .type         = ADLER32,
+    .output_size  = 4,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct fletcher_context),
+    .help         = &adler32_help,
+    .sum_init     = &fletcher_init,
+    .sum_process  = &fletcher_process,
+    .sum_finish   = &fletcher_finish,
+    .sum_zeros    = &fletcher_zeros,
+    .set_kernel   = &fletcher_set_kernel
+};
 
-// Module-specific context structure
-struct simple_context
+// Fletcher-16
+struct method_api fletcher16 =
 {
-    uint64_t sum;
+    .name         = "Fletcher-16",
+    .args         = "-fletcher16",
+    .type         = FLETCHER16,
+    .output_size  = 2,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct fletcher_context),
+    .help         = &fletcher16_help,
+    .sum_init     = &fletcher_init,
+    .sum_process  = &fletcher_process,
+    .sum_finish   = &fletcher_finish,
+    .sum_zeros    = &fletcher_zeros,
+    .set_kernel   = &fletcher_set_kernel
+};
+
+// Fletcher-32
+struct method_api fletcher32 =
+{
+    .name         = "Fletcher-32",
+    .args         = "-fletcher32",
+    .type         = FLETCHER32,
+    .output_size  = 4,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct fletcher_context),
+    .help         = &fletcher32_help,
+    .sum_init     = &fletcher_init,
+    .sum_process  = &fletcher_process,
+    .sum_finish   = &fletcher_finish,
+    .sum_zeros    = &fletcher_zeros,
+    .set_kernel   = &fletcher_set_kernel
 };
 
+// Fletcher-64
+struct method_api fletcher64 =
+{
+    .name         = "Fletcher-64",
+    .args         = "-fletcher64",
+    .type         = FLETCHER64,
+    .output_size  = 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct fletcher_context),
+    .help         = &fletcher64_help,
+    .sum_init     = &fletcher_init,
+    .sum_process  = &fletcher_process,
+    .sum_finish   = &fletcher_finish,
+    .sum_zeros    = &fletcher_zeros,
+    .set_kernel   = &fletcher_set_kernel
+};
+
+static const struct fletcher_param adler32_param    = { 65521,      1, 1 };
+static const struct fletcher_param fletcher16_param = { 255,        1, 0 };
+static const struct fletcher_param fletcher32_param = { 65535,      2, 0 };
+static const struct fletcher_param fletcher64_param = { 0xffffffff, 4, 0 };
+
+// Fastest Adler/Fletcher kernel supported by this processor
+static fletcher_kernel_fn kernel = NULL;
+
+
 // Help text functions
 static void simple8_help(void)
 {
@@ -115,14 +306,113 @@ static void simple64_help(void)
 {
     printf("%s - TBD\n", __func__);
 }
+static void adler32_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+static void fletcher16_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+static void fletcher32_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+static void fletcher64_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+
+
+// Sum one section of a buffer, starting from an empty state
+static void* part_thread(void* arg)
+{
+    struct sum_part* part = arg;
+    const uint8_t* ptr;
+
+    part->state.s1 = 0;
+    part->state.s2 = 0;
+    if (part->param != NULL)
+    {
+        kernel(part->param, &part->state, part->data, part->len);
+    }
+    else
+    {
+        for (ptr = part->data; ptr < &part->data[part->len]; ++ptr)
+        {
+            part->state.s1 += *ptr;
+        }
+    }
+
+    return NULL;
+}
+
+// Sum a buffer by splitting it into sections (on 'align'-byte boundaries)
+// which are summed by separate threads, then combine the results in order
+static void split_sum(const struct fletcher_param* param,
+                      struct fletcher_state* state,
+                      const uint8_t* data, size_t len,
+                      unsigned threads, size_t align)
+{
+    struct sum_part parts[threads];
+    size_t section;
+    size_t offset = 0;
+    unsigned i;
+
+    section = (len / threads) / align * align;
+    for (i = 0; i < threads; ++i)
+    {
+        parts[i].param = param;
+        parts[i].data  = &data[offset];
+        parts[i].len   = (i == threads - 1) ? len - offset : section;
+        offset += parts[i].len;
+
+        // The last section is done by this thread, and so is any section
+        // that could not get a thread of its own
+        if ((i == threads - 1) ||
+            (pthread_create(&parts[i].thread, NULL, &part_thread, &parts[i]) != 0))
+        {
+            parts[i].thread = pthread_self();
+            part_thread(&parts[i]);
+        }
+    }
+
+    for (i = 0; i < threads; ++i)
+    {
+        if (!pthread_equal(parts[i].thread, pthread_self()))
+        {
+            pthread_join(parts[i].thread, NULL);
+        }
+        if (param != NULL)
+        {
+            fletcher_combine(param, state, &parts[i].state,
+                             parts[i].len / param->width);
+        }
+        else
+        {
+            simple_combine(state, &parts[i].state);
+        }
+    }
+}
+
+// Number of threads worth using for a buffer of 'len' bytes
+static unsigned split_threads(unsigned threads, size_t len)
+{
+    if (len / MIN_THREAD_LEN < threads)
+    {
+        threads = len / MIN_THREAD_LEN;
+    }
+
+    return (threads > 1) ? threads : 1;
+}
 
 // Initialize a context structure
 static int simple_init(struct context* ctx)
 {
     struct simple_context* context;
 
-    // Allocate a new context structure
-    context = malloc(sizeof(*context));
+    // Get a new context structure
+    context = context_alloc(ctx, sizeof(*context));
     if (context == NULL)
     {
         fprintf(stderr, "No memory\n");
@@ -131,7 +421,7 @@ static int simple_init(struct context* ctx)
 
     // Initialize context information
     context->sum = 0;
-    ctx->context = context;
+    context->threads = split_threads(ctx->threads, SIZE_MAX);
 
     return 0;
 }
@@ -140,9 +430,20 @@ static int simple_init(struct context* ctx)
 static int simple_process(struct context* ctx, void* data, size_t len)
 {
     struct simple_context* context;
+    struct fletcher_state state;
     uint8_t* ptr;
+    unsigned threads;
 
     context = ctx->context;
+    threads = split_threads(context->threads, len);
+    if (threads > 1)
+    {
+        state.s1 = context->sum;
+        split_sum(NULL, &state, data, len, threads, 1);
+        context->sum = state.s1;
+        return 0;
+    }
+
     for (ptr = data; ptr < &((uint8_t*)data)[len]; ++ptr)
     {
         context->sum += *ptr;
@@ -151,27 +452,485 @@ static int simple_process(struct context* ctx, void* data, size_t len)
     return 0;
 }
 
-// Display result and clean up context data
-static int simple_finish(struct context* ctx)
+// Zeros don't change a simple sum
+static int simple_zeros(struct context* ctx, uint64_t len)
+{
+    return 0;
+}
+
+// Combine the sum of a later section of the input into a running total
+static void simple_combine(struct fletcher_state* state,
+                           const struct fletcher_state* part)
+{
+    state->s1 += part->s1;
+}
+
+// Store the low 'size' bytes of a value, most significant first
+static void store_be(uint8_t* out, uint64_t value, size_t size)
+{
+    while (size-- > 0)
+    {
+        out[size] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+// Output result and clean up context data
+static int simple_finish(struct context* ctx, uint8_t* digest)
 {
     struct simple_context* context;
     int retval = 0;
 
-    // Display result
+    // Output result
     context = (ctx->context);
     switch (ctx->which)
     {
         case SIMPLE8:
-            printf("0x%02"PRIx8"\n",   (uint8_t)(context->sum & 0xff));
+            store_be(digest, context->sum, 1);
             break;
         case SIMPLE16:
-            printf("0x%04"PRIx16"\n",  (uint16_t)(context->sum & 0xffff));
+            store_be(digest, context->sum, 2);
             break;
         case SIMPLE32:
-            printf("0x%08"PRIx32"\n",  (uint32_t)(context->sum & 0xffffffff));
+            store_be(digest, context->sum, 4);
             break;
         case SIMPLE64:
-            printf("0x%016"PRIx64"\n", context->sum);
+            store_be(digest, context->sum, 8);
+            break;
+        default:
+            fprintf(stderr, "Context information format error\n");
+            retval = 1;
+    }
+
+    // Clean up
+    context_free(ctx);
+
+    return retval;
+}
+
+
+// Combine the sums of a later section of 'words' words (computed from an
+// empty state) into a running state.  Summing the section directly onto
+// the running state adds 'words' times the old s1 to s2; everything else
+// simply adds up.
+static void fletcher_combine(const struct fletcher_param* param,
+                             struct fletcher_state* state,
+                             const struct fletcher_state* part,
+                             uint64_t words)
+{
+    uint64_t mod = param->mod;
+
+    state->s2 = (state->s2 + (words % mod) * state->s1 + part->s2) % mod;
+    state->s1 = (state->s1 + part->s1) % mod;
+}
+
+// Read a little-endian word of 'width' bytes
+static inline uint64_t load_word(const uint8_t* ptr, unsigned width)
+{
+    uint64_t word = 0;
+
+    while (width-- > 0)
+    {
+        word = (word << 8) | ptr[width];
+    }
+
+    return word;
+}
+
+// Portable kernel
+static void kernel_scalar(const struct fletcher_param* param,
+                          struct fletcher_state* state,
+                          const uint8_t* data, size_t len)
+{
+    uint64_t s1 = state->s1;
+    uint64_t s2 = state->s2;
+    unsigned width = param->width;
+    size_t words = len / width;
+    size_t n;
+
+    while (words > 0)
+    {
+        n = (words < NMAX) ? words : NMAX;
+        words -= n;
+
+        // Separate loops let the compiler specialize each word size
+        switch (width)
+        {
+            case 1:
+                for (; n > 0; --n, data += 1)
+                {
+                    s1 += data[0];
+                    s2 += s1;
+                }
+                break;
+            case 2:
+                for (; n > 0; --n, data += 2)
+                {
+                    s1 += load_word(data, 2);
+                    s2 += s1;
+                }
+                break;
+            default:
+                for (; n > 0; --n, data += 4)
+                {
+                    s1 += load_word(data, 4);
+                    s2 += s1;
+                }
+                break;
+        }
+
+        s1 %= param->mod;
+        s2 %= param->mod;
+    }
+
+    state->s1 = s1;
+    state->s2 = s2;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Fold the per-plane sums of a block of vectors into a running state.
+// For byte plane p: 'a' is the sum of its bytes, 'prefix' is the sum,
+// over all vectors, of 'a' for the vectors before it, and 'b' is the sum
+// of its bytes weighted by their word's distance from the end of the
+// vector.  Each vector holds 'per_vec' words and the block holds 'words'.
+static void fold_planes(const struct fletcher_param* param,
+                        struct fletcher_state* state,
+                        const uint64_t a[4], const uint64_t prefix[4],
+                        const uint64_t b[4], unsigned per_vec, size_t words)
+{
+    struct fletcher_state part = { 0, 0 };
+    uint64_t mod = param->mod;
+    uint64_t scale = 1;
+    unsigned p;
+
+    for (p = 0; p < param->width; ++p)
+    {
+        part.s1 += (a[p] % mod) * scale % mod;
+        part.s2 += ((per_vec * prefix[p] + b[p]) % mod) * scale % mod;
+        scale = (scale << 8) % mod;
+    }
+    part.s1 %= mod;
+    part.s2 %= mod;
+
+    fletcher_combine(param, state, &part, words);
+}
+
+// Fill in the pmaddubsw weights and the byte masks for each byte plane of
+// a 'vec'-byte vector
+static void plane_weights(unsigned width, unsigned vec,
+                          int8_t weights[4][32], int8_t masks[4][32])
+{
+    unsigned p, i;
+
+    for (p = 0; p < width; ++p)
+    {
+        for (i = 0; i < vec; ++i)
+        {
+            weights[p][i] = (i % width == p) ? (int8_t)(vec / width - i / width) : 0;
+            masks[p][i]   = (i % width == p) ? -1 : 0;
+        }
+    }
+}
+
+// SSSE3 kernel
+__attribute__((target("ssse3")))
+static void kernel_ssse3(const struct fletcher_param* param,
+                         struct fletcher_state* state,
+                         const uint8_t* data, size_t len)
+{
+    int8_t weights[4][32];
+    int8_t masks[4][32];
+    uint64_t a[4], prefix[4], b[4];
+    uint64_t lanes[2];
+    uint32_t lanes32[4];
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned width = param->width;
+    size_t vecs, n, i;
+    unsigned p;
+
+    plane_weights(width, 16, weights, masks);
+
+    for (vecs = len / 16; vecs > 0; vecs -= n, data += n * 16)
+    {
+        n = (vecs < VBLOCK / 16) ? vecs : VBLOCK / 16;
+
+        for (p = 0; p < width; ++p)
+        {
+            const __m128i weight = _mm_loadu_si128((const __m128i*)weights[p]);
+            const __m128i mask   = _mm_loadu_si128((const __m128i*)masks[p]);
+            __m128i va = zero, vprefix = zero, vb = zero;
+
+            for (i = 0; i < n; ++i)
+            {
+                __m128i x = _mm_loadu_si128((const __m128i*)&data[i * 16]);
+
+                vprefix = _mm_add_epi64(vprefix, va);
+                va = _mm_add_epi64(va, _mm_sad_epu8(_mm_and_si128(x, mask), zero));
+                vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_maddubs_epi16(x, weight), ones));
+            }
+
+            _mm_storeu_si128((__m128i*)lanes, va);
+            a[p] = lanes[0] + lanes[1];
+            _mm_storeu_si128((__m128i*)lanes, vprefix);
+            prefix[p] = lanes[0] + lanes[1];
+            _mm_storeu_si128((__m128i*)lanes32, vb);
+            b[p] = (uint64_t)lanes32[0] + lanes32[1] + lanes32[2] + lanes32[3];
+        }
+
+        fold_planes(param, state, a, prefix, b, 16 / width, n * 16 / width);
+    }
+
+    kernel_scalar(param, state, data, len % 16);
+}
+
+// AVX2 kernel
+__attribute__((target("avx2")))
+static void kernel_avx2(const struct fletcher_param* param,
+                        struct fletcher_state* state,
+                        const uint8_t* data, size_t len)
+{
+    int8_t weights[4][32];
+    int8_t masks[4][32];
+    uint64_t a[4], prefix[4], b[4];
+    uint64_t lanes[4];
+    uint32_t lanes32[8];
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned width = param->width;
+    size_t vecs, n, i;
+    unsigned p, j;
+
+    plane_weights(width, 32, weights, masks);
+
+    for (vecs = len / 32; vecs > 0; vecs -= n, data += n * 32)
+    {
+        n = (vecs < VBLOCK / 32) ? vecs : VBLOCK / 32;
+
+        for (p = 0; p < width; ++p)
+        {
+            const __m256i weight = _mm256_loadu_si256((const __m256i*)weights[p]);
+            const __m256i mask   = _mm256_loadu_si256((const __m256i*)masks[p]);
+            __m256i va = zero, vprefix = zero, vb = zero;
+
+            for (i = 0; i < n; ++i)
+            {
+                __m256i x = _mm256_loadu_si256((const __m256i*)&data[i * 32]);
+
+                vprefix = _mm256_add_epi64(vprefix, va);
+                va = _mm256_add_epi64(va, _mm256_sad_epu8(_mm256_and_si256(x, mask), zero));
+                vb = _mm256_add_epi32(vb, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weight), ones));
+            }
+
+            _mm256_storeu_si256((__m256i*)lanes, va);
+            a[p] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_si256((__m256i*)lanes, vprefix);
+            prefix[p] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_si256((__m256i*)lanes32, vb);
+            for (b[p] = 0, j = 0; j < 8; ++j)
+            {
+                b[p] += lanes32[j];
+            }
+        }
+
+        fold_planes(param, state, a, prefix, b, 32 / width, n * 32 / width);
+    }
+
+    kernel_scalar(param, state, data, len % 32);
+}
+
+#endif
+
+// Select an Adler/Fletcher kernel
+static int fletcher_set_kernel(unsigned index, const char** name)
+{
+    switch (index)
+    {
+        case 0:
+            *name = "scalar";
+            kernel = &kernel_scalar;
+            return 0;
+#ifdef HAVE_X86_SIMD
+        case 1:
+            *name = "ssse3";
+            if (!__builtin_cpu_supports("ssse3"))
+                return 1;
+            kernel = &kernel_ssse3;
+            return 0;
+        case 2:
+            *name = "avx2";
+            if (!__builtin_cpu_supports("avx2"))
+                return 1;
+            kernel = &kernel_avx2;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+// Initialize a context structure
+static int fletcher_init(struct context* ctx)
+{
+    struct fletcher_context* context;
+
+    // Pick the fastest kernel this processor supports
+    if (kernel == NULL)
+    {
+        kernel = &kernel_scalar;
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2"))
+            kernel = &kernel_avx2;
+        else if (__builtin_cpu_supports("ssse3"))
+            kernel = &kernel_ssse3;
+#endif
+    }
+
+    // Get a new context structure
+    context = context_alloc(ctx, sizeof(*context));
+    if (context == NULL)
+    {
+        fprintf(stderr, "No memory\n");
+        return 1;
+    }
+
+    switch (ctx->which)
+    {
+        case ADLER32:
+            context->param = &adler32_param;
+            break;
+        case FLETCHER16:
+            context->param = &fletcher16_param;
+            break;
+        case FLETCHER32:
+            context->param = &fletcher32_param;
+            break;
+        case FLETCHER64:
+            context->param = &fletcher64_param;
+            break;
+        default:
+            fprintf(stderr, "Context information format error\n");
+            context_free(ctx);
+            return 1;
+    }
+
+    // Initialize context information
+    context->state.s1 = context->param->init;
+    context->state.s2 = 0;
+    context->partial_len = 0;
+    context->threads = split_threads(ctx->threads, SIZE_MAX);
+
+    return 0;
+}
+
+// Add more bytes to the running sums
+static int fletcher_process(struct context* ctx, void* data, size_t len)
+{
+    struct fletcher_context* context = ctx->context;
+    const struct fletcher_param* param = context->param;
+    uint8_t* ptr = data;
+    size_t bulk;
+    unsigned threads;
+
+    // Complete a word left over from the previous call
+    if (context->partial_len > 0)
+    {
+        while ((context->partial_len < param->width) && (len > 0))
+        {
+            context->partial[context->partial_len++] = *ptr++;
+            --len;
+        }
+        if (context->partial_len < param->width)
+        {
+            return 0;
+        }
+        kernel(param, &context->state, context->partial, param->width);
+        context->partial_len = 0;
+    }
+
+    // Sum all whole words
+    bulk = len - len % param->width;
+    threads = split_threads(context->threads, bulk);
+    if (threads > 1)
+    {
+        split_sum(param, &context->state, ptr, bulk, threads, 32);
+    }
+    else
+    {
+        kernel(param, &context->state, ptr, bulk);
+    }
+
+    // Keep any trailing bytes for next time
+    memcpy(context->partial, &ptr[bulk], len - bulk);
+    context->partial_len = len - bulk;
+
+    return 0;
+}
+
+// Process a run of zeros.  Each zero word leaves s1 alone and adds s1
+// to s2, so whole words take one multiplication.
+static int fletcher_zeros(struct context* ctx, uint64_t len)
+{
+    struct fletcher_context* context = ctx->context;
+    const struct fletcher_param* param = context->param;
+    const struct fletcher_state zero = { 0, 0 };
+    unsigned fill;
+
+    // Complete a word left over from the previous call
+    if (context->partial_len > 0)
+    {
+        fill = param->width - context->partial_len;
+        if (fill > len)
+            fill = len;
+        memset(&context->partial[context->partial_len], 0, fill);
+        context->partial_len += fill;
+        len -= fill;
+        if (context->partial_len < param->width)
+            return 0;
+        kernel(param, &context->state, context->partial, param->width);
+        context->partial_len = 0;
+    }
+
+    fletcher_combine(param, &context->state, &zero, len / param->width);
+
+    // Keep any trailing zeros for next time
+    context->partial_len = len % param->width;
+    memset(context->partial, 0, context->partial_len);
+
+    return 0;
+}
+
+// Output result and clean up context data
+static int fletcher_finish(struct context* ctx, uint8_t* digest)
+{
+    struct fletcher_context* context = ctx->context;
+    const struct fletcher_param* param = context->param;
+    uint64_t s1, s2;
+    int retval = 0;
+
+    // Pad a trailing partial word with zeros
+    if (context->partial_len > 0)
+    {
+        memset(&context->partial[context->partial_len], 0,
+               param->width - context->partial_len);
+        kernel(param, &context->state, context->partial, param->width);
+    }
+
+    // Output result
+    s1 = context->state.s1;
+    s2 = context->state.s2;
+    switch (ctx->which)
+    {
+        case FLETCHER16:
+            store_be(digest, (s2 << 8) | s1, 2);
+            break;
+        case ADLER32:
+        case FLETCHER32:
+            store_be(digest, (s2 << 16) | s1, 4);
+            break;
+        case FLETCHER64:
+            store_be(digest, (s2 << 32) | s1, 8);
             break;
         default:
             fprintf(stderr, "Context information format error\n");
@@ -179,8 +938,7 @@ static int simple_finish(struct context* ctx)
     }
 
     // Clean up
-    free(ctx->context);
-    ctx->context = NULL;
+    context_free(ctx);
 
     return retval;
 }
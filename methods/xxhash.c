@@ -0,0 +1,986 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * xxHash family of non-cryptographic hashes (XXH64, XXH3-64, XXH3-128)
+ *
+ * These are meant for fast integrity checks where a cryptographic hash
+ * is overkill.  They are NOT suitable for detecting deliberate tampering.
+ *
+ * Notes:
+ *  - All variants are unseeded and XXH3 uses the default secret, so the
+ *    output matches the reference 'xxhsum' tool.
+ *  - Values are printed in the canonical (big-endian) form; for XXH3-128
+ *    that is the high 64 bits followed by the low 64 bits.
+ *  - The XXH3 inner loop ("stripe" accumulation and scrambling) has
+ *    scalar, SSE2 and AVX2 versions, selected at run time.  XXH64 is
+ *    inherently serial within each of its four lanes and needs 64-bit
+ *    multiplies, so it only has a scalar version.
+ *  - Any undocumented magic numbers were taken directly from the
+ *    reference implementation.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "method.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Constants
+#define PRIME32_1   0x9E3779B1U
+#define PRIME32_2   0x85EBCA77U
+#define PRIME32_3   0xC2B2AE3DU
+#define PRIME64_1   0x9E3779B185EBCA87ULL
+#define PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3   0x165667B19E3779F9ULL
+#define PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define PRIME64_5   0x27D4EB2F165667C5ULL
+
+// XXH64 parameters
+#define XXH64_STRIPE        32  // bytes consumed by one pass over all lanes
+
+// XXH3 parameters
+#define STRIPE_LEN          64  // bytes consumed by one accumulate step
+#define SECRET_SIZE         192 // size of the default secret
+#define SECRET_CONSUME_RATE 8   // secret bytes advanced per stripe
+#define STRIPES_PER_BLOCK   ((SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define SECRET_MERGEACCS_START 11
+#define SECRET_LASTACC_START   7
+#define MIDSIZE_MAX         240 // longest input handled without the stripe loop
+#define BUFFER_SIZE         256 // internal buffer for streaming input
+#define BUFFER_STRIPES      (BUFFER_SIZE / STRIPE_LEN)
+#define ACC_NB              (STRIPE_LEN / sizeof(uint64_t))
+
+
+// Module-specific context structures
+struct xxh64_context
+{
+    // lane accumulators
+    uint64_t v[4];
+
+    // partial stripe carried over between calls
+    uint8_t  mem[XXH64_STRIPE];
+    unsigned mem_size;
+
+    // total length of the input data seen so far (bytes)
+    uint64_t total_len;
+};
+
+struct xxh3_context
+{
+    // stripe accumulators
+    uint64_t acc[ACC_NB] __attribute__((aligned(32)));
+
+    // buffered input; always holds the most recent stripe once the input
+    // is longer than the buffer, as the final step needs it
+    uint8_t  buffer[BUFFER_SIZE] __attribute__((aligned(32)));
+    unsigned buffered;
+
+    // stripes accumulated since the last scramble
+    unsigned nb_stripes_acc;
+
+    // total length of the input data seen so far (bytes)
+    uint64_t total_len;
+};
+
+// Inner-loop implementation for one instruction set
+struct xxh3_kernel
+{
+    // accumulate 'nb_stripes' stripes of input, advancing through the secret
+    void (*accumulate)(uint64_t* acc, const uint8_t* input,
+                       const uint8_t* secret, size_t nb_stripes);
+
+    // scramble the accumulators at the end of a block
+    void (*scramble)(uint64_t* acc, const uint8_t* secret);
+};
+
+
+static void xxh64_help      (void);
+static void xxh3_help       (void);
+static void xxh128_help     (void);
+static int  xxh64_init      (struct context* ctx);
+static int  xxh64_process   (struct context* ctx, void* data, size_t len);
+static int  xxh64_finish    (struct context* ctx, uint8_t* digest);
+static int  xxh3_init       (struct context* ctx);
+static int  xxh3_process    (struct context* ctx, void* data, size_t len);
+static int  xxh3_finish     (struct context* ctx, uint8_t* digest);
+static int  xxh3_set_kernel (unsigned index, const char** name);
+
+
+struct method_api xxh64 =
+{
+    .name         = "XXH64 hash (non-cryptographic)",
+    .args         = "-xxh64",
+    .type         = XXH64,
+    .output_size  = 64 / 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct xxh64_context),
+    .help         = &xxh64_help,
+    .sum_init     = &xxh64_init,
+    .sum_process  = &xxh64_process,
+    .sum_finish   = &xxh64_finish
+};
+
+struct method_api xxh3_64 =
+{
+    .name         = "XXH3 64-bit hash (non-cryptographic)",
+    .args         = "-xxh3",
+    .type         = XXH3_64,
+    .output_size  = 64 / 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct xxh3_context),
+    .help         = &xxh3_help,
+    .sum_init     = &xxh3_init,
+    .sum_process  = &xxh3_process,
+    .sum_finish   = &xxh3_finish,
+    .set_kernel   = &xxh3_set_kernel
+};
+
+struct method_api xxh3_128 =
+{
+    .name         = "XXH3 128-bit hash (non-cryptographic)",
+    .args         = "-xxh128",
+    .type         = XXH3_128,
+    .output_size  = 128 / 8,
+    .chunk_size   = 0,
+    .context_size = sizeof(struct xxh3_context),
+    .help         = &xxh128_help,
+    .sum_init     = &xxh3_init,
+    .sum_process  = &xxh3_process,
+    .sum_finish   = &xxh3_finish,
+    .set_kernel   = &xxh3_set_kernel
+};
+
+static const uint8_t secret[SECRET_SIZE] __attribute__((aligned(64))) =
+{
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static const uint64_t initial_acc[ACC_NB] =
+{
+    PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+    PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+};
+
+// XXH3 inner loop, chosen when the first context is initialized
+static const struct xxh3_kernel* kernel = NULL;
+
+
+// === helper functions ===
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static inline uint64_t rotl64(uint64_t x, unsigned n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+static inline uint64_t bswap64(uint64_t x)
+{
+    return __builtin_bswap64(x);
+}
+
+// Full 64x64 -> 128-bit multiply
+static inline void mul128(uint64_t a, uint64_t b, uint64_t* lo, uint64_t* hi)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *lo = (uint64_t)product;
+    *hi = (uint64_t)(product >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32)        * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32)        * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    *hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    *lo = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+#endif
+}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+    uint64_t lo, hi;
+    mul128(a, b, &lo, &hi);
+    return lo ^ hi;
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t rrmxmx(uint64_t h, uint64_t len)
+{
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= 0x9FB21C651E98DF25ULL;
+    h ^= (h >> 35) + len;
+    h *= 0x9FB21C651E98DF25ULL;
+    h ^= h >> 28;
+    return h;
+}
+
+// Store a 64-bit value in canonical (big-endian) form
+static void store64(uint8_t* out, uint64_t value)
+{
+    value = TO_BE64(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+
+// === XXH64 ===
+
+// Help text
+static void xxh64_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Initialize context structure
+static int xxh64_init(struct context* ctx)
+{
+    struct xxh64_context* context;
+
+    // Get a new context structure
+    context = context_alloc(ctx, sizeof(*context));
+    if (context == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    memset(context, 0, sizeof(*context));
+
+    // Initialize lanes
+    context->v[0] = PRIME64_1 + PRIME64_2;
+    context->v[1] = PRIME64_2;
+    context->v[2] = 0;
+    context->v[3] = -PRIME64_1;
+
+    return 0;
+}
+
+// Process the next sequence of bytes
+static int xxh64_process(struct context* ctx, void* data, size_t len)
+{
+    struct xxh64_context* context = ctx->context;
+    const uint8_t* ptr = data;
+    uint64_t v0, v1, v2, v3;
+    size_t fill;
+
+    context->total_len += len;
+
+    // Not enough for a full stripe yet
+    if (context->mem_size + len < XXH64_STRIPE)
+    {
+        memcpy(&context->mem[context->mem_size], ptr, len);
+        context->mem_size += len;
+        return 0;
+    }
+
+    // Finish the stripe left over from last time
+    if (context->mem_size > 0)
+    {
+        fill = XXH64_STRIPE - context->mem_size;
+        memcpy(&context->mem[context->mem_size], ptr, fill);
+        context->v[0] = xxh64_round(context->v[0], read64(&context->mem[0]));
+        context->v[1] = xxh64_round(context->v[1], read64(&context->mem[8]));
+        context->v[2] = xxh64_round(context->v[2], read64(&context->mem[16]));
+        context->v[3] = xxh64_round(context->v[3], read64(&context->mem[24]));
+        ptr += fill;
+        len -= fill;
+        context->mem_size = 0;
+    }
+
+    // Bulk of the data, with the lanes kept in registers
+    v0 = context->v[0];
+    v1 = context->v[1];
+    v2 = context->v[2];
+    v3 = context->v[3];
+    while (len >= XXH64_STRIPE)
+    {
+        v0 = xxh64_round(v0, read64(&ptr[0]));
+        v1 = xxh64_round(v1, read64(&ptr[8]));
+        v2 = xxh64_round(v2, read64(&ptr[16]));
+        v3 = xxh64_round(v3, read64(&ptr[24]));
+        ptr += XXH64_STRIPE;
+        len -= XXH64_STRIPE;
+    }
+    context->v[0] = v0;
+    context->v[1] = v1;
+    context->v[2] = v2;
+    context->v[3] = v3;
+
+    // Save any leftovers for next time
+    memcpy(context->mem, ptr, len);
+    context->mem_size = len;
+
+    return 0;
+}
+
+// Finish up the hash and calculate the final value
+static int xxh64_finish(struct context* ctx, uint8_t* digest)
+{
+    struct xxh64_context* context = ctx->context;
+    const uint8_t* ptr = context->mem;
+    unsigned len = context->mem_size;
+    uint64_t h;
+
+    // Merge lanes
+    if (context->total_len >= XXH64_STRIPE)
+    {
+        h = rotl64(context->v[0], 1) + rotl64(context->v[1], 7) +
+            rotl64(context->v[2], 12) + rotl64(context->v[3], 18);
+        h = xxh64_merge_round(h, context->v[0]);
+        h = xxh64_merge_round(h, context->v[1]);
+        h = xxh64_merge_round(h, context->v[2]);
+        h = xxh64_merge_round(h, context->v[3]);
+    }
+    else
+    {
+        h = context->v[2] + PRIME64_5;
+    }
+    h += context->total_len;
+
+    // Mix in the tail
+    for (; len >= 8; ptr += 8, len -= 8)
+    {
+        h ^= xxh64_round(0, read64(ptr));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (len >= 4)
+    {
+        h ^= (uint64_t)read32(ptr) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        ptr += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++ptr, --len)
+    {
+        h ^= (*ptr) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+    h = xxh64_avalanche(h);
+
+    // Output hash
+    store64(digest, h);
+
+    // Clean up
+    context_free(ctx);
+
+    return 0;
+}
+
+
+// === XXH3 inner loop kernels ===
+
+static void accumulate_scalar(uint64_t* acc, const uint8_t* input,
+                              const uint8_t* secret, size_t nb_stripes)
+{
+    uint64_t data, key;
+    size_t n;
+    int i;
+
+    for (n = 0; n < nb_stripes; ++n)
+    {
+        for (i = 0; i < ACC_NB; ++i)
+        {
+            data = read64(&input[8 * i]);
+            key  = data ^ read64(&secret[8 * i]);
+            acc[i ^ 1] += data;
+            acc[i]     += (key & 0xFFFFFFFF) * (key >> 32);
+        }
+        input  += STRIPE_LEN;
+        secret += SECRET_CONSUME_RATE;
+    }
+}
+
+static void scramble_scalar(uint64_t* acc, const uint8_t* secret)
+{
+    int i;
+
+    for (i = 0; i < ACC_NB; ++i)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= read64(&secret[8 * i]);
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static const struct xxh3_kernel kernel_scalar =
+{
+    .accumulate = &accumulate_scalar,
+    .scramble   = &scramble_scalar
+};
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t* acc, const uint8_t* input,
+                            const uint8_t* secret, size_t nb_stripes)
+{
+    __m128i* xacc = (__m128i*)acc;
+    __m128i data, key, data_key, data_key_lo, product, data_swap;
+    size_t n;
+    int i;
+
+    for (n = 0; n < nb_stripes; ++n)
+    {
+        for (i = 0; i < STRIPE_LEN / sizeof(__m128i); ++i)
+        {
+            data        = _mm_loadu_si128((const __m128i*)&input[16 * i]);
+            key         = _mm_loadu_si128((const __m128i*)&secret[16 * i]);
+            data_key    = _mm_xor_si128(data, key);
+            data_key_lo = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+            product     = _mm_mul_epu32(data_key, data_key_lo);
+            data_swap   = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            xacc[i]     = _mm_add_epi64(xacc[i], _mm_add_epi64(product, data_swap));
+        }
+        input  += STRIPE_LEN;
+        secret += SECRET_CONSUME_RATE;
+    }
+}
+
+__attribute__((target("sse2")))
+static void scramble_sse2(uint64_t* acc, const uint8_t* secret)
+{
+    __m128i* xacc = (__m128i*)acc;
+    const __m128i prime32 = _mm_set1_epi32((int)PRIME32_1);
+    __m128i data, key, data_key, data_key_hi, prod_lo, prod_hi;
+    int i;
+
+    for (i = 0; i < STRIPE_LEN / sizeof(__m128i); ++i)
+    {
+        data        = _mm_xor_si128(xacc[i], _mm_srli_epi64(xacc[i], 47));
+        key         = _mm_loadu_si128((const __m128i*)&secret[16 * i]);
+        data_key    = _mm_xor_si128(data, key);
+        data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+        prod_lo     = _mm_mul_epu32(data_key, prime32);
+        prod_hi     = _mm_mul_epu32(data_key_hi, prime32);
+        xacc[i]     = _mm_add_epi64(prod_lo, _mm_slli_epi64(prod_hi, 32));
+    }
+}
+
+static const struct xxh3_kernel kernel_sse2 =
+{
+    .accumulate = &accumulate_sse2,
+    .scramble   = &scramble_sse2
+};
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t* acc, const uint8_t* input,
+                            const uint8_t* secret, size_t nb_stripes)
+{
+    __m256i* xacc = (__m256i*)acc;
+    __m256i acc0 = xacc[0], acc1 = xacc[1];
+    __m256i data, key, data_key, product, data_swap;
+    size_t n;
+
+    // Both halves of the stripe are unrolled so the accumulators can stay
+    // in registers for the whole run
+    for (n = 0; n < nb_stripes; ++n)
+    {
+        data      = _mm256_loadu_si256((const __m256i*)&input[0]);
+        key       = _mm256_loadu_si256((const __m256i*)&secret[0]);
+        data_key  = _mm256_xor_si256(data, key);
+        product   = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+        data_swap = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        acc0      = _mm256_add_epi64(acc0, _mm256_add_epi64(product, data_swap));
+
+        data      = _mm256_loadu_si256((const __m256i*)&input[32]);
+        key       = _mm256_loadu_si256((const __m256i*)&secret[32]);
+        data_key  = _mm256_xor_si256(data, key);
+        product   = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+        data_swap = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        acc1      = _mm256_add_epi64(acc1, _mm256_add_epi64(product, data_swap));
+
+        input  += STRIPE_LEN;
+        secret += SECRET_CONSUME_RATE;
+    }
+
+    xacc[0] = acc0;
+    xacc[1] = acc1;
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t* acc, const uint8_t* secret)
+{
+    __m256i* xacc = (__m256i*)acc;
+    const __m256i prime32 = _mm256_set1_epi32((int)PRIME32_1);
+    __m256i data, key, data_key, prod_lo, prod_hi;
+    int i;
+
+    for (i = 0; i < STRIPE_LEN / sizeof(__m256i); ++i)
+    {
+        data     = _mm256_xor_si256(xacc[i], _mm256_srli_epi64(xacc[i], 47));
+        key      = _mm256_loadu_si256((const __m256i*)&secret[32 * i]);
+        data_key = _mm256_xor_si256(data, key);
+        prod_lo  = _mm256_mul_epu32(data_key, prime32);
+        prod_hi  = _mm256_mul_epu32(_mm256_srli_epi64(data_key, 32), prime32);
+        xacc[i]  = _mm256_add_epi64(prod_lo, _mm256_slli_epi64(prod_hi, 32));
+    }
+}
+
+static const struct xxh3_kernel kernel_avx2 =
+{
+    .accumulate = &accumulate_avx2,
+    .scramble   = &scramble_avx2
+};
+
+#endif
+
+
+// === XXH3 short-input paths (up to MIDSIZE_MAX bytes) ===
+
+static inline uint64_t mix16b(const uint8_t* input, const uint8_t* sec)
+{
+    return mul128_fold64(read64(input) ^ read64(sec),
+                         read64(input + 8) ^ read64(sec + 8));
+}
+
+static inline void mix32b(uint64_t* lo, uint64_t* hi, const uint8_t* input1,
+                          const uint8_t* input2, const uint8_t* sec)
+{
+    *lo += mix16b(input1, sec);
+    *lo ^= read64(input2) + read64(input2 + 8);
+    *hi += mix16b(input2, sec + 16);
+    *hi ^= read64(input1) + read64(input1 + 8);
+}
+
+static uint64_t xxh3_64_short(const uint8_t* input, size_t len)
+{
+    uint64_t acc, flip, flip2, lo, hi;
+    uint32_t combo;
+    size_t i;
+
+    if (len == 0)
+        return xxh64_avalanche(read64(&secret[56]) ^ read64(&secret[64]));
+
+    if (len <= 3)
+    {
+        combo = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24) |
+                (uint32_t)input[len - 1]   | ((uint32_t)len << 8);
+        flip  = read32(&secret[0]) ^ read32(&secret[4]);
+        return xxh64_avalanche(combo ^ flip);
+    }
+
+    if (len <= 8)
+    {
+        flip = read64(&secret[8]) ^ read64(&secret[16]);
+        acc  = (uint64_t)read32(&input[len - 4]) + ((uint64_t)read32(input) << 32);
+        return rrmxmx(acc ^ flip, len);
+    }
+
+    if (len <= 16)
+    {
+        flip  = read64(&secret[24]) ^ read64(&secret[32]);
+        flip2 = read64(&secret[40]) ^ read64(&secret[48]);
+        lo    = read64(input) ^ flip;
+        hi    = read64(&input[len - 8]) ^ flip2;
+        acc   = len + bswap64(lo) + hi + mul128_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+
+    acc = len * PRIME64_1;
+    if (len <= 128)
+    {
+        if (len > 32)
+        {
+            if (len > 64)
+            {
+                if (len > 96)
+                {
+                    acc += mix16b(&input[48], &secret[96]);
+                    acc += mix16b(&input[len - 64], &secret[112]);
+                }
+                acc += mix16b(&input[32], &secret[64]);
+                acc += mix16b(&input[len - 48], &secret[80]);
+            }
+            acc += mix16b(&input[16], &secret[32]);
+            acc += mix16b(&input[len - 32], &secret[48]);
+        }
+        acc += mix16b(&input[0], &secret[0]);
+        acc += mix16b(&input[len - 16], &secret[16]);
+        return xxh3_avalanche(acc);
+    }
+
+    // 129 to 240 bytes
+    for (i = 0; i < 8; ++i)
+        acc += mix16b(&input[16 * i], &secret[16 * i]);
+    acc = xxh3_avalanche(acc);
+    for (i = 8; i < len / 16; ++i)
+        acc += mix16b(&input[16 * i], &secret[16 * (i - 8) + 3]);
+    acc += mix16b(&input[len - 16], &secret[136 - 17]);
+    return xxh3_avalanche(acc);
+}
+
+static void xxh3_128_short(const uint8_t* input, size_t len,
+                           uint64_t* out_lo, uint64_t* out_hi)
+{
+    uint64_t lo, hi, flip, flip_hi, keyed, m_lo, m_hi;
+    uint32_t combo;
+    size_t i;
+
+    if (len == 0)
+    {
+        *out_lo = xxh64_avalanche(read64(&secret[64]) ^ read64(&secret[72]));
+        *out_hi = xxh64_avalanche(read64(&secret[80]) ^ read64(&secret[88]));
+        return;
+    }
+
+    if (len <= 3)
+    {
+        combo = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24) |
+                (uint32_t)input[len - 1]   | ((uint32_t)len << 8);
+        flip    = read32(&secret[0]) ^ read32(&secret[4]);
+        flip_hi = read32(&secret[8]) ^ read32(&secret[12]);
+        *out_lo = xxh64_avalanche(combo ^ flip);
+        combo   = __builtin_bswap32(combo);
+        combo   = (combo << 13) | (combo >> 19);
+        *out_hi = xxh64_avalanche(combo ^ flip_hi);
+        return;
+    }
+
+    if (len <= 8)
+    {
+        flip  = read64(&secret[16]) ^ read64(&secret[24]);
+        keyed = ((uint64_t)read32(input) + ((uint64_t)read32(&input[len - 4]) << 32)) ^ flip;
+        mul128(keyed, PRIME64_1 + (len << 2), &lo, &hi);
+        hi += lo << 1;
+        lo ^= hi >> 3;
+        lo ^= lo >> 35;
+        lo *= 0x9FB21C651E98DF25ULL;
+        lo ^= lo >> 28;
+        *out_lo = lo;
+        *out_hi = xxh3_avalanche(hi);
+        return;
+    }
+
+    if (len <= 16)
+    {
+        flip    = read64(&secret[32]) ^ read64(&secret[40]);
+        flip_hi = read64(&secret[48]) ^ read64(&secret[56]);
+        lo = read64(input);
+        hi = read64(&input[len - 8]);
+        mul128(lo ^ hi ^ flip, PRIME64_1, &m_lo, &m_hi);
+        m_lo += (uint64_t)(len - 1) << 54;
+        hi ^= flip_hi;
+        m_hi += hi + (hi & 0xFFFFFFFF) * (PRIME32_2 - 1);
+        m_lo ^= bswap64(m_hi);
+        mul128(m_lo, PRIME64_2, &lo, &hi);
+        hi += m_hi * PRIME64_2;
+        *out_lo = xxh3_avalanche(lo);
+        *out_hi = xxh3_avalanche(hi);
+        return;
+    }
+
+    lo = len * PRIME64_1;
+    hi = 0;
+    if (len <= 128)
+    {
+        if (len > 32)
+        {
+            if (len > 64)
+            {
+                if (len > 96)
+                    mix32b(&lo, &hi, &input[48], &input[len - 64], &secret[96]);
+                mix32b(&lo, &hi, &input[32], &input[len - 48], &secret[64]);
+            }
+            mix32b(&lo, &hi, &input[16], &input[len - 32], &secret[32]);
+        }
+        mix32b(&lo, &hi, &input[0], &input[len - 16], &secret[0]);
+    }
+    else
+    {
+        // 129 to 240 bytes
+        for (i = 0; i < 4; ++i)
+            mix32b(&lo, &hi, &input[32 * i], &input[32 * i + 16], &secret[32 * i]);
+        lo = xxh3_avalanche(lo);
+        hi = xxh3_avalanche(hi);
+        for (i = 4; i < len / 32; ++i)
+            mix32b(&lo, &hi, &input[32 * i], &input[32 * i + 16], &secret[32 * (i - 4) + 3]);
+        mix32b(&lo, &hi, &input[len - 16], &input[len - 32], &secret[136 - 17 - 16]);
+    }
+
+    *out_lo = xxh3_avalanche(lo + hi);
+    *out_hi = -xxh3_avalanche(lo * PRIME64_1 + hi * PRIME64_4 + len * PRIME64_2);
+}
+
+
+// === XXH3 streaming ===
+
+// Help text
+static void xxh3_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+static void xxh128_help(void)
+{
+    printf("%s - TBD\n", __func__);
+}
+
+// Select an inner loop implementation
+static int xxh3_set_kernel(unsigned index, const char** name)
+{
+    switch (index)
+    {
+        case 0:
+            *name = "scalar";
+            kernel = &kernel_scalar;
+            return 0;
+#ifdef HAVE_X86_SIMD
+        case 1:
+            *name = "sse2";
+            if (!__builtin_cpu_supports("sse2"))
+                return 1;
+            kernel = &kernel_sse2;
+            return 0;
+        case 2:
+            *name = "avx2";
+            if (!__builtin_cpu_supports("avx2"))
+                return 1;
+            kernel = &kernel_avx2;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+// Initialize context structure
+static int xxh3_init(struct context* ctx)
+{
+    struct xxh3_context* context;
+
+    // Pick the fastest kernel this processor supports
+    if (kernel == NULL)
+    {
+        kernel = &kernel_scalar;
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2"))
+            kernel = &kernel_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            kernel = &kernel_sse2;
+#endif
+    }
+
+    // Get a new context structure (64-byte aligned, for the accumulators)
+    context = context_alloc(ctx, sizeof(*context));
+    if (context == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    memset(context, 0, sizeof(*context));
+    memcpy(context->acc, initial_acc, sizeof(context->acc));
+
+    return 0;
+}
+
+// Accumulate whole stripes, scrambling whenever the secret runs out
+static void consume_stripes(uint64_t* acc, unsigned* nb_stripes_acc,
+                            const uint8_t* input, size_t nb_stripes)
+{
+    size_t to_end = STRIPES_PER_BLOCK - *nb_stripes_acc;
+
+    if (nb_stripes >= to_end)
+    {
+        kernel->accumulate(acc, input, &secret[*nb_stripes_acc * SECRET_CONSUME_RATE], to_end);
+        kernel->scramble(acc, &secret[SECRET_SIZE - STRIPE_LEN]);
+        kernel->accumulate(acc, &input[to_end * STRIPE_LEN], secret, nb_stripes - to_end);
+        *nb_stripes_acc = nb_stripes - to_end;
+    }
+    else
+    {
+        kernel->accumulate(acc, input, &secret[*nb_stripes_acc * SECRET_CONSUME_RATE], nb_stripes);
+        *nb_stripes_acc += nb_stripes;
+    }
+}
+
+// Process the next sequence of bytes
+static int xxh3_process(struct context* ctx, void* data, size_t len)
+{
+    struct xxh3_context* context = ctx->context;
+    const uint8_t* ptr = data;
+    size_t fill;
+
+    context->total_len += len;
+
+    // Just buffer small amounts of data
+    if (context->buffered + len <= BUFFER_SIZE)
+    {
+        memcpy(&context->buffer[context->buffered], ptr, len);
+        context->buffered += len;
+        return 0;
+    }
+
+    // Top up and consume the buffer
+    if (context->buffered > 0)
+    {
+        fill = BUFFER_SIZE - context->buffered;
+        memcpy(&context->buffer[context->buffered], ptr, fill);
+        ptr += fill;
+        len -= fill;
+        consume_stripes(context->acc, &context->nb_stripes_acc,
+                        context->buffer, BUFFER_STRIPES);
+        context->buffered = 0;
+    }
+
+    // Consume directly from the input, always leaving at least one byte
+    // behind since the final stripe is handled differently
+    if (len > BUFFER_SIZE)
+    {
+        do
+        {
+            consume_stripes(context->acc, &context->nb_stripes_acc,
+                            ptr, BUFFER_STRIPES);
+            ptr += BUFFER_SIZE;
+            len -= BUFFER_SIZE;
+        } while (len > BUFFER_SIZE);
+
+        // Keep the last consumed stripe around for the final step
+        memcpy(&context->buffer[BUFFER_SIZE - STRIPE_LEN], ptr - STRIPE_LEN, STRIPE_LEN);
+    }
+
+    memcpy(context->buffer, ptr, len);
+    context->buffered = len;
+
+    return 0;
+}
+
+static uint64_t merge_accs(const uint64_t* acc, const uint8_t* sec, uint64_t start)
+{
+    uint64_t result = start;
+    int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        result += mul128_fold64(acc[2 * i] ^ read64(&sec[16 * i]),
+                                acc[2 * i + 1] ^ read64(&sec[16 * i + 8]));
+    }
+
+    return xxh3_avalanche(result);
+}
+
+// Finish up the hash and calculate the final value
+static int xxh3_finish(struct context* ctx, uint8_t* digest)
+{
+    struct xxh3_context* context = ctx->context;
+    uint8_t last_stripe[STRIPE_LEN];
+    const uint8_t* last;
+    uint64_t lo, hi = 0;
+    size_t catchup;
+
+    if (context->total_len <= MIDSIZE_MAX)
+    {
+        // The whole input is still in the buffer
+        if (ctx->which == XXH3_64)
+            lo = xxh3_64_short(context->buffer, context->buffered);
+        else
+            xxh3_128_short(context->buffer, context->buffered, &lo, &hi);
+    }
+    else
+    {
+        // Consume the remaining stripes, then the last (overlapping) one
+        if (context->buffered >= STRIPE_LEN)
+        {
+            consume_stripes(context->acc, &context->nb_stripes_acc, context->buffer,
+                            (context->buffered - 1) / STRIPE_LEN);
+            last = &context->buffer[context->buffered - STRIPE_LEN];
+        }
+        else
+        {
+            catchup = STRIPE_LEN - context->buffered;
+            memcpy(last_stripe, &context->buffer[BUFFER_SIZE - catchup], catchup);
+            memcpy(&last_stripe[catchup], context->buffer, context->buffered);
+            last = last_stripe;
+        }
+        kernel->accumulate(context->acc, last,
+                           &secret[SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START], 1);
+
+        lo = merge_accs(context->acc, &secret[SECRET_MERGEACCS_START],
+                        context->total_len * PRIME64_1);
+        hi = merge_accs(context->acc,
+                        &secret[SECRET_SIZE - STRIPE_LEN - SECRET_MERGEACCS_START],
+                        ~(context->total_len * PRIME64_2));
+    }
+
+    // Output hash
+    if (ctx->which == XXH3_128)
+    {
+        store64(digest, hi);
+        digest += sizeof(hi);
+    }
+    store64(digest, lo);
+
+    // Clean up
+    context_free(ctx);
+
+    return 0;
+}
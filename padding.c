@@ -0,0 +1,61 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Message padding shared by the Merkle-Damgard style hashes
+ * (SHA-256 and the SHA-512 family).
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include "method.h"
+
+// Pad the final, partially-filled message block of a hash.
+//
+// 'buf' holds the 'used' bytes of unprocessed input at its start and must
+// have room for two blocks of 'block_size' bytes.  The required '1' bit,
+// zero fill and a big-endian message length of 'length_size' bytes (8 for
+// SHA-256, 16 for SHA-512) are appended.  'total' is the length of the
+// entire message in bytes.
+//
+// Returns the number of padded bytes in 'buf' (one or two blocks).
+size_t md_pad(uint8_t* buf, size_t used, size_t block_size,
+              size_t length_size, uint64_t total)
+{
+    size_t padded;
+    uint64_t len_bits;
+    int i;
+
+    // Append the required '1' bit
+    buf[used++] = 0x80;
+
+    // Use a second block if there's not enough room left for the length
+    padded = block_size;
+    if (used > (block_size - length_size))
+        padded *= 2;
+    memset(&buf[used], 0, padded - used);
+
+    // Message length in bits, most significant byte first.  The byte count
+    // is kept in 64 bits, so at most its top three bits spill over into the
+    // upper half of a 128-bit length field.
+    len_bits = total << 3;
+    for (i = 1; i <= 8; ++i, len_bits >>= 8)
+        buf[padded - i] = len_bits & 0xff;
+    if (length_size > 8)
+        buf[padded - 9] = (total >> 61) & 0xff;
+
+    return padded;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Static tracepoints
+ *
+ * USDT probes under the provider name "checksum", for use with perf,
+ * bpftrace or SystemTap, e.g.:
+ *   bpftrace -e 'usdt:./checksum:checksum:process_done { @[arg0] = hist(arg1); }'
+ *
+ * They are built in when the system has <sys/sdt.h> (SystemTap's
+ * header) unless NO_PROBES is defined, and are empty otherwise.  A probe
+ * that nothing is attached to is a single nop instruction, with its
+ * arguments left wherever they already are.
+ *
+ * Probes and their arguments:
+ *   file_open      method type, path
+ *   read_start     (none)
+ *   read_done      method type, bytes read
+ *   process_start  method type, bytes
+ *   process_done   method type, bytes
+ *   finish_start   method type, checksum size in bytes
+ *   finish_done    method type, checksum size in bytes
+ *   batch_start    method type, bytes over all messages
+ *   batch_done     method type, bytes over all messages
+ * The method type is the method's enum sum_type value.  read_start and
+ * read_done come in pairs on the thread doing the read.  Runs of zeros
+ * from sparse files count as processed bytes.  A batch of records, which
+ * is processed and finished in one call, fires batch_start and
+ * batch_done instead of the process and finish probes, so no time is
+ * counted twice.
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE0(name)            DTRACE_PROBE(checksum, name)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(checksum, name, a, b)
+#else
+#define PROBE0(name)            do { } while (0)
+#define PROBE2(name, a, b)      do { } while (0)
+#endif
+
+#endif
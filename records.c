@@ -0,0 +1,289 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Per-record mode
+ *
+ * Splits the input into records at a delimiter byte (such as a newline)
+ * and displays a checksum for each record, one per line, in order.  The
+ * delimiter is not part of the record.  A last record with no delimiter
+ * after it is still checksummed, but a delimiter at the very end of the
+ * input doesn't start an empty record.
+ *
+ * Notes:
+ *  - Input is read IO_SIZE bytes at a time.  Complete records in the
+ *    buffer are queued up and checksummed BATCH_SIZE at a time, through
+ *    the method's sum_batch() if it has one.  Otherwise, each record gets
+ *    a context in the same preallocated storage, so nothing is allocated
+ *    per record.
+ *  - A record too big for the buffer is fed to the method as it arrives.
+ *  - Output is collected in an OUT_SIZE buffer and written in one go.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "checksum.h"
+
+// Size of the input buffer
+#define IO_SIZE     (1024 * 1024)
+
+// Most records checksummed in one batch
+#define BATCH_SIZE  256
+
+// Size of the output buffer
+#define OUT_SIZE    (1024 * 1024)
+
+// State of a per-record run
+struct records
+{
+    struct method_api* api;
+
+    // context for records checksummed one at a time
+    struct context     ctx;
+
+    // queued records, which point into the input buffer
+    const uint8_t*     msgs[BATCH_SIZE];
+    size_t             lens[BATCH_SIZE];
+    size_t             count;
+    uint8_t*           digests;
+
+    // pending output
+    char*              out;
+    size_t             out_len;
+};
+
+// Local function prototypes
+static int  queue_record    (struct records* r, const uint8_t* data, size_t len);
+static int  flush_batch     (struct records* r);
+static int  start_record    (struct records* r);
+static int  finish_record   (struct records* r);
+static int  emit            (struct records* r, const uint8_t* digest);
+static int  flush_output    (struct records* r);
+
+
+// Display a checksum for each record of the input
+int records_run(struct method_api* api, FILE* input, int delim)
+{
+    struct records r;
+    uint8_t* buf;
+    uint8_t* end;
+    size_t have = 0;
+    size_t pos, got;
+    uint64_t start;
+    int streaming = 0;
+    int eof = 0;
+    int retval = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.api = api;
+    r.ctx.which = api->type;
+    r.ctx.threads = 1;
+    r.ctx.preallocated = 1;
+    buf = malloc(IO_SIZE);
+    r.digests = malloc(BATCH_SIZE * api->output_size);
+    r.out = malloc(OUT_SIZE);
+    if ((buf == NULL) || (r.digests == NULL) || (r.out == NULL) ||
+        posix_memalign(&r.ctx.context, CONTEXT_ALIGN, api->context_size))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        free(buf);
+        free(r.digests);
+        free(r.out);
+        return 1;
+    }
+
+    while (!eof && !retval)
+    {
+        start = throttle_start();
+        got = fread(&buf[have], 1, IO_SIZE - have, input);
+        throttle_read(got, start);
+        PROBE2(read_done, api->type, got);
+        if (got < IO_SIZE - have)
+        {
+            if (ferror(input))
+            {
+                fprintf(stderr, "Error reading from %s\n", (input == stdin) ? "stdin" : "input file");
+                retval = 1;
+                break;
+            }
+            eof = 1;
+        }
+        have += got;
+        pos = 0;
+
+        // Carry on with a record that didn't fit in the buffer
+        if (streaming)
+        {
+            end = memchr(buf, delim, have);
+            if (end == NULL)
+            {
+                retval = method_process(api, &r.ctx, buf, have);
+                have = 0;
+                continue;
+            }
+            retval = method_process(api, &r.ctx, buf, end - buf) || finish_record(&r);
+            streaming = 0;
+            pos = end - buf + 1;
+        }
+
+        // Queue up every complete record
+        while (!retval && ((end = memchr(&buf[pos], delim, have - pos)) != NULL))
+        {
+            retval = queue_record(&r, &buf[pos], end - &buf[pos]);
+            pos = end - buf + 1;
+        }
+
+        // The queue points into the buffer, so empty it before moving the
+        // remaining partial record to the front
+        if (retval || flush_batch(&r))
+        {
+            retval = 1;
+            break;
+        }
+        if (eof)
+        {
+            if (pos < have)
+                retval = queue_record(&r, &buf[pos], have - pos) || flush_batch(&r);
+            break;
+        }
+        if (pos == 0)
+        {
+            // One record fills the buffer
+            retval = start_record(&r) || method_process(api, &r.ctx, buf, have);
+            streaming = 1;
+            have = 0;
+            continue;
+        }
+        memmove(buf, &buf[pos], have - pos);
+        have -= pos;
+    }
+
+    if (streaming && !retval)
+        retval = finish_record(&r);
+    if (flush_output(&r))
+        retval = 1;
+
+    free(r.ctx.context);
+    free(buf);
+    free(r.digests);
+    free(r.out);
+
+    return retval;
+}
+
+
+// Add a record to the batch, checksumming the batch once it is full
+static int queue_record(struct records* r, const uint8_t* data, size_t len)
+{
+    r->msgs[r->count] = data;
+    r->lens[r->count] = len;
+    if (++r->count == BATCH_SIZE)
+        return flush_batch(r);
+
+    return 0;
+}
+
+// Checksum and output all of the queued records
+static int flush_batch(struct records* r)
+{
+    size_t i;
+
+    if (r->count == 0)
+        return 0;
+
+    if (r->api->sum_batch != NULL)
+    {
+        if (method_batch(r->api, r->count, r->msgs, r->lens, r->digests))
+        {
+            fprintf(stderr, "Error processing data\n");
+            return 1;
+        }
+        for (i = 0; i < r->count; ++i)
+        {
+            if (emit(r, &r->digests[i * r->api->output_size]))
+                return 1;
+        }
+    }
+    else
+    {
+        for (i = 0; i < r->count; ++i)
+        {
+            if (start_record(r))
+                return 1;
+            if (method_process(r->api, &r->ctx, (void*)r->msgs[i], r->lens[i]))
+            {
+                fprintf(stderr, "Error processing data\n");
+                return 1;
+            }
+            if (finish_record(r))
+                return 1;
+        }
+    }
+
+    r->count = 0;
+    return 0;
+}
+
+// Start checksumming a record in the reusable context
+static int start_record(struct records* r)
+{
+    if (r->api->sum_init(&r->ctx))
+    {
+        fprintf(stderr, "Unable to initialize algorithm\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Finish a record started with start_record() and output its checksum
+static int finish_record(struct records* r)
+{
+    uint8_t digest[MAX_OUTPUT_SIZE];
+
+    if (method_finish(r->api, &r->ctx, digest))
+    {
+        fprintf(stderr, "Error finalizing checksum\n");
+        return 1;
+    }
+
+    return emit(r, digest);
+}
+
+// Add a checksum to the output
+static int emit(struct records* r, const uint8_t* digest)
+{
+    if ((r->out_len + 2 * MAX_OUTPUT_SIZE + 3 > OUT_SIZE) && flush_output(r))
+        return 1;
+    r->out_len += format_digest(&r->out[r->out_len], digest, r->api->output_size);
+
+    return 0;
+}
+
+// Write out the pending output, making sure it got past stdio's buffer
+static int flush_output(struct records* r)
+{
+    size_t len = r->out_len;
+
+    r->out_len = 0;
+    if ((fwrite(r->out, 1, len, stdout) != len) || (fflush(stdout) != 0))
+    {
+        fprintf(stderr, "Error writing output\n");
+        return 1;
+    }
+
+    return 0;
+}
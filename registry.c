@@ -0,0 +1,146 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * List of known checksum methods.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "checksum.h"
+
+static struct method_list* list = NULL;
+static struct method_list* list_tail = NULL;
+
+// Local function prototypes
+static int  register_method (struct method_api* api);
+
+
+// Register a specific checksum method's API
+static int register_method(struct method_api* api)
+{
+    struct method_list* entry;
+
+    if (api == NULL)
+    {
+        return -1;
+    }
+
+    // Allocate a new list entry
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    entry->api = api;
+    entry->next = NULL;
+
+    // Add entry to list
+    if (list == NULL)
+    {
+        list = entry;
+    }
+    if (list_tail != NULL)
+    {
+        list_tail->next = entry;
+    }
+    list_tail = entry;
+
+    return 0;
+}
+
+// Helper macro to avoid duplicate code
+#define register_it(x) \
+do {\
+    int ret;\
+    ret = register_method(x);\
+    if (ret) return ret;\
+} while(0)
+
+// Register all checksum method APIs
+int register_methods(void)
+{
+    register_it(&simple_8);
+    register_it(&simple_16);
+    register_it(&simple_32);
+    register_it(&simple_64);
+    register_it(&adler32);
+    register_it(&fletcher16);
+    register_it(&fletcher32);
+    register_it(&fletcher64);
+    register_it(&sha256);
+    register_it(&sha384);
+    register_it(&sha512);
+    register_it(&sha512_256);
+    register_it(&xxh64);
+    register_it(&xxh3_64);
+    register_it(&xxh3_128);
+    register_it(&blake3);
+    register_it(&hmac_sha256);
+
+    return 0;
+}
+
+// Free the list of methods
+void unregister_methods(void)
+{
+    struct method_list* ptr;
+
+    // Recursively free memory
+    while (list != NULL)
+    {
+        ptr = list;
+        list = list->next;
+        free(ptr);
+    }
+
+    // Clear out pointers
+    list = list_tail = NULL;
+}
+
+// Get the first entry of the list of methods
+const struct method_list* method_list(void)
+{
+    return list;
+}
+
+// Look up a method by its command-line argument
+struct method_api* find_method(const char* args)
+{
+    struct method_list* ptr;
+
+    for (ptr = list; ptr != NULL; ptr = ptr->next)
+    {
+        if (strcmp(args, ptr->api->args) == 0)
+            return ptr->api;
+    }
+
+    return NULL;
+}
+
+// Find the largest context structure of any method
+size_t max_context_size(void)
+{
+    struct method_list* ptr;
+    size_t size = 0;
+
+    for (ptr = list; ptr != NULL; ptr = ptr->next)
+    {
+        if (ptr->api->context_size > size)
+            size = ptr->api->context_size;
+    }
+
+    return size;
+}
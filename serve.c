@@ -0,0 +1,781 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Daemon mode
+ *
+ * Listens on a Unix stream socket and checksums files for its clients.
+ * All integers in the protocol are big-endian.
+ *
+ * Request:
+ *   uint32  size of the rest of the request, in bytes
+ *   uint32  request ID, echoed in the reply
+ *   uint8   request type: 'P' (whole file, by path), 'R' (byte range of a
+ *           file, by path) or 'F' (byte range of a passed descriptor)
+ *   uint8   length of the method name
+ *   ...     method name, as on the command line (e.g. "-sha256")
+ *   uint64  offset ('R' and 'F' only)
+ *   uint64  length ('R' and 'F' only; all ones means "to the end")
+ *   ...     path ('P' and 'R' only; the rest of the request)
+ *
+ * Reply:
+ *   uint32  size of the rest of the reply, in bytes
+ *   uint32  request ID
+ *   uint8   status: 0 on success
+ *   ...     the checksum on success, otherwise an error message
+ *
+ * Notes:
+ *  - Clients may send any number of requests without waiting for the
+ *    replies.  Requests are spread over the worker pool, so replies may
+ *    come back in a different order; the ID matches them up.
+ *  - The descriptor for an 'F' request is sent as SCM_RIGHTS ancillary
+ *    data along with any part of that request.  Descriptors are matched
+ *    to 'F' requests in the order they arrive, and are closed once the
+ *    request is done or rejected.  Descriptors that cannot be read with
+ *    pread(), such as pipes, are read from their current position (offset
+ *    must be 0).
+ *  - Each worker has one read buffer and one block of context storage,
+ *    big enough for any method, which it reuses for every request.
+ *  - Each connection has a reader thread, which queues its requests for
+ *    the workers, and a writer thread, which sends the replies the workers
+ *    hand back.  Workers never write to a socket, so a client that stops
+ *    reading its replies only holds up its own connection.  If a reply
+ *    can't be sent, the connection is dropped.
+ *  - A connection may have up to MAX_IN_FLIGHT requests queued, in
+ *    progress or waiting for their replies to be sent; past that, reading
+ *    from it waits for replies to go out.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "checksum.h"
+
+// Largest request accepted (header excluded)
+#define MAX_REQUEST     (16 * 1024)
+
+// Requests per connection that may be queued or in progress at once
+#define MAX_IN_FLIGHT   256
+
+// Passed descriptors per connection that may wait for their requests
+#define MAX_FDS         64
+
+// Largest single read when checksumming
+#define IO_SIZE         (1024 * 1024)
+
+// Size of the fixed part of a reply
+#define REPLY_HEADER    (4 + 4 + 1)
+
+// Largest checksum or error message in a reply
+#define MAX_PAYLOAD     256
+
+// A reply waiting to be sent
+struct reply
+{
+    size_t          len;
+    uint8_t         data[REPLY_HEADER + MAX_PAYLOAD];
+};
+
+// One client connection
+struct connection
+{
+    int             fd;
+
+    // protects everything below, except 'fds' (only used by the reader)
+    pthread_mutex_t lock;
+    pthread_cond_t  drained;        // 'in_flight' went down
+    pthread_cond_t  ready;          // a reply was queued, or reading stopped
+    unsigned        refs;           // reader and writer threads plus requests
+    unsigned        in_flight;      // requests and replies not yet sent
+    int             reading;        // reader thread still running
+
+    // replies for the writer thread; each holds one of the in-flight
+    // slots, so there is always room
+    struct reply    replies[MAX_IN_FLIGHT];
+    unsigned        reply_head;
+    unsigned        reply_count;
+
+    // descriptors received but not yet claimed by an 'F' request
+    int             fds[MAX_FDS];
+    unsigned        fd_head;
+    unsigned        fd_count;
+};
+
+// One request waiting for (or being handled by) a worker
+struct request
+{
+    struct request*    next;
+    struct connection* conn;
+    uint32_t           id;
+    struct method_api* api;
+    int                fd;          // passed descriptor, or -1
+    uint64_t           offset;
+    uint64_t           length;
+    char               path[];
+};
+
+// Work queue shared by all connections
+struct server
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    struct request* head;
+    struct request* tail;
+    size_t          storage_size;
+};
+
+static struct server server =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+};
+
+// Socket path, removed on exit
+static const char* socket_path = NULL;
+
+// Local function prototypes
+static void     on_signal       (int sig);
+static void*    connection_main (void* arg);
+static void*    writer_main     (void* arg);
+static void     stop_reading    (struct connection* conn);
+static ssize_t  receive         (struct connection* conn, uint8_t* buf, size_t len);
+static int      parse_request   (struct connection* conn, const uint8_t* data,
+                                 size_t len);
+static void*    worker_main     (void* arg);
+static int      serve_request   (struct request* req, void* storage,
+                                 uint8_t* buf, uint8_t* digest,
+                                 const char** error);
+static void     claim_slot      (struct connection* conn);
+static void     reject          (struct connection* conn, uint32_t id,
+                                 const char* error);
+static void     queue_reply     (struct connection* conn, uint32_t id,
+                                 uint8_t status, const void* data, size_t len);
+static int      send_all        (int fd, const uint8_t* data, size_t len);
+static void     release         (struct connection* conn);
+static uint32_t get32           (const uint8_t* ptr);
+static uint64_t get64           (const uint8_t* ptr);
+
+
+// Accept connections until something goes badly wrong
+int serve_run(const char* path, unsigned threads)
+{
+    struct sockaddr_un addr;
+    struct connection* conn;
+    struct stat st;
+    pthread_attr_t attr;
+    pthread_t thread;
+    unsigned i;
+    int listener;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    server.storage_size = max_context_size();
+
+    // Replace a stale socket, but nothing else
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+    {
+        fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+        (listen(listener, SOMAXCONN) != 0))
+    {
+        fprintf(stderr, "Unable to listen on '%s': %s\n", path, strerror(errno));
+        close(listener);
+        return 1;
+    }
+    socket_path = path;
+    signal(SIGINT, &on_signal);
+    signal(SIGTERM, &on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Start the workers; connection threads are never joined
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < ((threads > 0) ? threads : 1); ++i)
+    {
+        if (pthread_create(&thread, &attr, &worker_main, NULL) != 0)
+        {
+            fprintf(stderr, "Unable to start worker threads\n");
+            unlink(path);
+            return 1;
+        }
+    }
+
+    while (1)
+    {
+        fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if ((errno == EINTR) || (errno == ECONNABORTED) ||
+                (errno == EMFILE) || (errno == ENFILE))
+                continue;
+            fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+            break;
+        }
+
+        conn = calloc(1, sizeof(*conn));
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->refs = 2;
+        conn->reading = 1;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->drained, NULL);
+        pthread_cond_init(&conn->ready, NULL);
+        if (pthread_create(&thread, &attr, &writer_main, conn) != 0)
+        {
+            release(conn);
+            release(conn);
+            continue;
+        }
+        if (pthread_create(&thread, &attr, &connection_main, conn) != 0)
+            stop_reading(conn);
+    }
+
+    unlink(path);
+    close(listener);
+    return 1;
+}
+
+
+// Remove the socket when asked to stop
+static void on_signal(int sig)
+{
+    if (socket_path != NULL)
+        unlink(socket_path);
+    _exit(0);
+}
+
+// Connection thread: read requests and queue them for the workers
+static void* connection_main(void* arg)
+{
+    struct connection* conn = arg;
+    uint8_t* buf;
+    size_t have = 0;
+    size_t pos;
+    uint32_t size;
+    ssize_t got;
+
+    buf = malloc(4 + MAX_REQUEST);
+    while (buf != NULL)
+    {
+        got = receive(conn, &buf[have], 4 + MAX_REQUEST - have);
+        if (got <= 0)
+            break;
+        have += got;
+
+        // Handle every complete request in the buffer
+        for (pos = 0; have - pos >= 4; pos += 4 + size)
+        {
+            size = get32(&buf[pos]);
+            if ((size > MAX_REQUEST) || (size < 4 + 1 + 1))
+                goto done;
+            if (have - pos - 4 < size)
+                break;
+            if (parse_request(conn, &buf[pos + 4], size))
+                goto done;
+        }
+        memmove(buf, &buf[pos], have - pos);
+        have -= pos;
+    }
+
+done:
+    // Stop reading, but let queued requests send their replies
+    shutdown(conn->fd, SHUT_RD);
+    free(buf);
+    stop_reading(conn);
+    return NULL;
+}
+
+// Writer thread: send a connection's replies as they are queued, until
+// the reader has stopped and every request has had its reply
+static void* writer_main(void* arg)
+{
+    struct connection* conn = arg;
+    struct reply* reply;
+    int failed = 0;
+
+    pthread_mutex_lock(&conn->lock);
+    while (1)
+    {
+        while ((conn->reply_count == 0) && (conn->reading || (conn->in_flight > 0)))
+            pthread_cond_wait(&conn->ready, &conn->lock);
+        if (conn->reply_count == 0)
+            break;
+        reply = &conn->replies[conn->reply_head];
+        pthread_mutex_unlock(&conn->lock);
+
+        // After a failed send the rest of the replies are dropped, and
+        // the reader is woken up to stop as well
+        if (!failed && send_all(conn->fd, reply->data, reply->len))
+        {
+            failed = 1;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        conn->reply_head = (conn->reply_head + 1) % MAX_IN_FLIGHT;
+        --conn->reply_count;
+        --conn->in_flight;
+        pthread_cond_signal(&conn->drained);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    release(conn);
+    return NULL;
+}
+
+// Note that no more requests will come from a connection, and drop the
+// reader's reference to it
+static void stop_reading(struct connection* conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->reading = 0;
+    pthread_cond_signal(&conn->ready);
+    pthread_mutex_unlock(&conn->lock);
+    release(conn);
+}
+
+// Read from a connection, collecting any passed descriptors.  Returns
+// the number of bytes read, or 0 at the end of the stream or on error.
+static ssize_t receive(struct connection* conn, uint8_t* buf, size_t len)
+{
+    union
+    {
+        struct cmsghdr header;
+        char           space[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    unsigned count, i;
+    ssize_t got;
+    int* fds;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    do
+    {
+        got = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while ((got < 0) && (errno == EINTR));
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+            continue;
+        fds = (int*)CMSG_DATA(cmsg);
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; ++i)
+        {
+            // Too many unclaimed descriptors is a protocol error
+            if (conn->fd_count == MAX_FDS)
+            {
+                close(fds[i]);
+                got = 0;
+                continue;
+            }
+            conn->fds[(conn->fd_head + conn->fd_count++) % MAX_FDS] = fds[i];
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+        got = 0;
+
+    return (got > 0) ? got : 0;
+}
+
+// Check a request and queue it.  Problems with the request itself get an
+// error reply; returns non-zero if the connection should be dropped.
+static int parse_request(struct connection* conn, const uint8_t* data, size_t len)
+{
+    struct request* req;
+    struct method_api* api;
+    const char* error;
+    char name[256];
+    uint32_t id;
+    uint8_t type;
+    size_t name_len;
+    size_t pos;
+    int fd = -1;
+
+    id = get32(data);
+    type = data[4];
+    name_len = data[5];
+    pos = 6 + name_len;
+
+    // An 'F' request takes the next descriptor even if it is rejected,
+    // so that later requests still get their own
+    if (type == 'F')
+    {
+        if (conn->fd_count == 0)
+        {
+            reject(conn, id, "No descriptor received");
+            return 0;
+        }
+        fd = conn->fds[conn->fd_head];
+        conn->fd_head = (conn->fd_head + 1) % MAX_FDS;
+        --conn->fd_count;
+    }
+
+    if ((pos > len) ||
+        ((type != 'P') && (pos + 16 > len)) ||
+        ((type == 'F') && (pos + 16 != len)))
+    {
+        error = "Malformed request";
+        goto fail;
+    }
+
+    memcpy(name, &data[6], name_len);
+    name[name_len] = '\0';
+    api = find_method(name);
+    if (api == NULL)
+    {
+        error = "Unknown method";
+        goto fail;
+    }
+
+    req = malloc(sizeof(*req) + len - pos + 1);
+    if (req == NULL)
+    {
+        error = "No memory";
+        goto fail;
+    }
+    req->id = id;
+    req->api = api;
+    req->fd = fd;
+    req->offset = 0;
+    req->length = UINT64_MAX;
+    req->path[0] = '\0';
+    switch (type)
+    {
+        case 'F':
+        case 'R':
+            req->offset = get64(&data[pos]);
+            req->length = get64(&data[pos + 8]);
+            pos += 16;
+            // Fall through
+        case 'P':
+            memcpy(req->path, &data[pos], len - pos);
+            req->path[len - pos] = '\0';
+            break;
+        default:
+            free(req);
+            error = "Unknown request type";
+            goto fail;
+    }
+
+    // Wait for room, then hand the request to the workers
+    claim_slot(conn);
+    pthread_mutex_lock(&conn->lock);
+    ++conn->refs;
+    pthread_mutex_unlock(&conn->lock);
+    req->conn = conn;
+    req->next = NULL;
+
+    pthread_mutex_lock(&server.lock);
+    if (server.tail != NULL)
+        server.tail->next = req;
+    else
+        server.head = req;
+    server.tail = req;
+    pthread_cond_signal(&server.work);
+    pthread_mutex_unlock(&server.lock);
+
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    reject(conn, id, error);
+    return 0;
+}
+
+// Worker thread: handle queued requests forever
+static void* worker_main(void* arg)
+{
+    struct request* req;
+    struct connection* conn;
+    const char* error;
+    uint8_t digest[MAX_OUTPUT_SIZE];
+    void* storage;
+    uint8_t* buf;
+
+    buf = malloc(IO_SIZE);
+    if ((buf == NULL) || posix_memalign(&storage, CONTEXT_ALIGN, server.storage_size))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&server.lock);
+        while (server.head == NULL)
+            pthread_cond_wait(&server.work, &server.lock);
+        req = server.head;
+        server.head = req->next;
+        if (server.head == NULL)
+            server.tail = NULL;
+        pthread_mutex_unlock(&server.lock);
+
+        // The reply takes over the request's in-flight slot
+        conn = req->conn;
+        if (serve_request(req, storage, buf, digest, &error))
+            queue_reply(conn, req->id, 1, error, strlen(error));
+        else
+            queue_reply(conn, req->id, 0, digest, req->api->output_size);
+        release(conn);
+        free(req);
+    }
+
+    return NULL;
+}
+
+// Checksum the data a request asks for
+static int serve_request(struct request* req, void* storage,
+                         uint8_t* buf, uint8_t* digest,
+                         const char** error)
+{
+    struct context ctx;
+    uint64_t offset = req->offset;
+    uint64_t remaining = req->length;
+    uint64_t start;
+    int streaming = 0;
+    ssize_t got;
+    size_t want;
+    int fd = req->fd;
+    int retval = 0;
+
+    if (fd < 0)
+    {
+        fd = open(req->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            *error = strerror(errno);
+            return 1;
+        }
+        PROBE2(file_open, req->api->type, req->path);
+    }
+
+    ctx.which = req->api->type;
+    ctx.context = storage;
+    ctx.threads = 1;
+    ctx.preallocated = 1;
+    if (req->api->sum_init(&ctx))
+    {
+        close(fd);
+        *error = "Unable to initialize algorithm";
+        return 1;
+    }
+
+    while (remaining > 0)
+    {
+        want = (remaining < IO_SIZE) ? remaining : IO_SIZE;
+        start = throttle_start();
+        if (streaming)
+            got = read(fd, buf, want);
+        else
+            got = pread(fd, buf, want, offset);
+
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                // Passed descriptors may be non-blocking
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if ((errno == ESPIPE) && !streaming && (offset == 0))
+            {
+                // Not seekable: read from the current position instead
+                streaming = 1;
+                continue;
+            }
+            *error = strerror(errno);
+            retval = 1;
+            break;
+        }
+        if (got == 0)
+        {
+            // Running out of data is only a problem for explicit ranges
+            if (req->length != UINT64_MAX)
+            {
+                *error = "Range extends past the end of the file";
+                retval = 1;
+            }
+            break;
+        }
+
+        throttle_read(got, start);
+        PROBE2(read_done, req->api->type, got);
+        if (method_process(req->api, &ctx, buf, got))
+        {
+            *error = "Error processing data";
+            retval = 1;
+            break;
+        }
+        offset += got;
+        if (req->length != UINT64_MAX)
+            remaining -= got;
+    }
+
+    if (method_finish(req->api, &ctx, digest) && !retval)
+    {
+        *error = "Error finalizing checksum";
+        retval = 1;
+    }
+    close(fd);
+
+    return retval;
+}
+
+// Wait until a connection has room for another request or reply, and
+// take a slot for it
+static void claim_slot(struct connection* conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    while (conn->in_flight >= MAX_IN_FLIGHT)
+        pthread_cond_wait(&conn->drained, &conn->lock);
+    ++conn->in_flight;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Answer a request that can't be handled with an error message
+static void reject(struct connection* conn, uint32_t id, const char* error)
+{
+    claim_slot(conn);
+    queue_reply(conn, id, 1, error, strlen(error));
+}
+
+// Hand a reply to the connection's writer thread, in a slot already taken
+// with claim_slot()
+static void queue_reply(struct connection* conn, uint32_t id,
+                        uint8_t status, const void* data, size_t len)
+{
+    struct reply* reply;
+    uint32_t value;
+
+    if (len > MAX_PAYLOAD)
+        len = MAX_PAYLOAD;
+
+    pthread_mutex_lock(&conn->lock);
+    reply = &conn->replies[(conn->reply_head + conn->reply_count) % MAX_IN_FLIGHT];
+    reply->len = REPLY_HEADER + len;
+    value = TO_BE32(reply->len - 4);
+    memcpy(reply->data, &value, 4);
+    value = TO_BE32(id);
+    memcpy(&reply->data[4], &value, 4);
+    reply->data[8] = status;
+    memcpy(&reply->data[REPLY_HEADER], data, len);
+    ++conn->reply_count;
+    pthread_cond_signal(&conn->ready);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Write all of a buffer to a socket.  Returns non-zero on failure.
+static int send_all(int fd, const uint8_t* data, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0)
+    {
+        ret = send(fd, data, len, MSG_NOSIGNAL);
+        if ((ret < 0) && (errno == EINTR))
+            continue;
+        if (ret <= 0)
+            return 1;
+        data += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+// Drop a reference to a connection, closing it after the last one
+static void release(struct connection* conn)
+{
+    unsigned refs;
+
+    pthread_mutex_lock(&conn->lock);
+    refs = --conn->refs;
+    pthread_mutex_unlock(&conn->lock);
+    if (refs > 0)
+        return;
+
+    while (conn->fd_count > 0)
+    {
+        close(conn->fds[conn->fd_head]);
+        conn->fd_head = (conn->fd_head + 1) % MAX_FDS;
+        --conn->fd_count;
+    }
+    close(conn->fd);
+    pthread_cond_destroy(&conn->ready);
+    pthread_cond_destroy(&conn->drained);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
+
+// Read big-endian integers from the protocol
+static uint32_t get32(const uint8_t* ptr)
+{
+    uint32_t value;
+
+    memcpy(&value, ptr, sizeof(value));
+    return FROM_BE32(value);
+}
+
+static uint64_t get64(const uint8_t* ptr)
+{
+    uint64_t value;
+
+    memcpy(&value, ptr, sizeof(value));
+    return FROM_BE64(value);
+}
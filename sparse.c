@@ -0,0 +1,174 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Sparse file reading
+ *
+ * Walks a regular file's data regions with lseek(SEEK_DATA/SEEK_HOLE)
+ * and only reads those.  Holes read as zeros, so they are fed to the
+ * method as runs of zeros: through its sum_zeros() if it has one, which
+ * usually costs far less than hashing the bytes, or from a zeroed buffer
+ * otherwise.  Either way the result is the same as reading every byte.
+ *
+ * The walk is only a guide: anything past the last region (a file that
+ * grew, say) is read until the end of the file, and files that report a
+ * size of 0, as many in /proc and /sys do, are left to a plain read.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.h"
+
+// Local function prototypes
+static int  feed_zeros  (struct method_api* api, struct context* ctx,
+                         uint64_t len, uint8_t* buf, size_t buf_size);
+static int  feed_data   (struct method_api* api, struct context* ctx, int fd,
+                         uint64_t offset, uint64_t len,
+                         uint8_t* buf, size_t buf_size);
+
+
+// Feed a file to the method, skipping I/O for its holes.  Returns -1
+// (having done nothing) if the input isn't a regular file or the file
+// system can't report holes, 0 on success and 1 on error.
+int sparse_read(struct method_api* api, struct context* ctx, int fd,
+                uint8_t* buf, size_t buf_size)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    struct stat st;
+    off_t first, pos, data, hole, end;
+
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size == 0))
+        return -1;
+    end = st.st_size;
+
+    // Start from the current position, as a plain read would
+    first = pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0)
+        return -1;
+
+    while (pos < end)
+    {
+        data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0)
+        {
+            // ENXIO means no more data: the rest of the file is a hole.
+            // Anything else on the first call means holes aren't
+            // supported, and the caller can still read the file normally.
+            if (errno != ENXIO)
+            {
+                if (pos == first)
+                    return -1;
+                fprintf(stderr, "Error reading from input file\n");
+                return 1;
+            }
+            data = end;
+        }
+        if (data > end)
+            data = end;
+        if ((data > pos) && feed_zeros(api, ctx, data - pos, buf, buf_size))
+            return 1;
+        pos = data;
+        if (pos == end)
+            break;
+
+        hole = lseek(fd, pos, SEEK_HOLE);
+        if ((hole < 0) || (hole > end))
+            hole = end;
+        if (feed_data(api, ctx, fd, pos, hole - pos, buf, buf_size))
+            return 1;
+        pos = hole;
+    }
+
+    // Pick up anything written since the size was read
+    return feed_data(api, ctx, fd, pos, UINT64_MAX, buf, buf_size);
+#else
+    return -1;
+#endif
+}
+
+
+// Feed 'len' zero bytes to the method
+static int feed_zeros(struct method_api* api, struct context* ctx,
+                      uint64_t len, uint8_t* buf, size_t buf_size)
+{
+    size_t piece;
+
+    if (api->sum_zeros != NULL)
+    {
+        if (method_zeros(api, ctx, len))
+        {
+            fprintf(stderr, "Error processing data\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    memset(buf, 0, (len < buf_size) ? len : buf_size);
+    for (; len > 0; len -= piece)
+    {
+        piece = (len < buf_size) ? len : buf_size;
+        if (method_process(api, ctx, buf, piece))
+        {
+            fprintf(stderr, "Error processing data\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Read 'len' bytes starting at 'offset' and feed them to the method.  A
+// length of UINT64_MAX reads to the end of the file, however far that is.
+static int feed_data(struct method_api* api, struct context* ctx, int fd,
+                     uint64_t offset, uint64_t len,
+                     uint8_t* buf, size_t buf_size)
+{
+    int to_end = (len == UINT64_MAX);
+    uint64_t start;
+    ssize_t got;
+
+    while (len > 0)
+    {
+        start = throttle_start();
+        got = pread(fd, buf, (len < buf_size) ? len : buf_size, offset);
+        if ((got < 0) && (errno == EINTR))
+            continue;
+        if ((got == 0) && to_end)
+            break;
+        if (got <= 0)
+        {
+            // Read error, or the file got shorter
+            fprintf(stderr, "Error reading from input file\n");
+            return 1;
+        }
+        throttle_read(got, start);
+        PROBE2(read_done, api->type, got);
+
+        if (method_process(api, ctx, buf, got))
+        {
+            fprintf(stderr, "Error processing data\n");
+            return 1;
+        }
+        offset += got;
+        if (!to_end)
+            len -= got;
+    }
+
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Tar archive mode
+ *
+ * Reads a tar stream and displays a checksum for each file in it, in
+ * archive order, one per line:
+ *   <checksum> <path>
+ * Nothing is extracted: member data is fed to the method straight from
+ * the read buffer as the archive streams past.
+ *
+ * Understands ustar headers (with the prefix field for long paths), pax
+ * extended headers ('x': path and size) and GNU long names ('L').  Only
+ * regular files are checksummed; directories, links and devices are
+ * skipped, as are pax global headers and GNU long link names.  The
+ * archive ends at the first all-zero header block, or at the end of the
+ * input.
+ *
+ * Notes:
+ *  - Input is read IO_SIZE bytes at a time.  Only headers and extended
+ *    header data are copied out of the buffer; file data never is.
+ *  - A header with a bad checksum, or input that ends in the middle of a
+ *    member, stops the run with an error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "checksum.h"
+
+// Size of the input buffer
+#define IO_SIZE         (1024 * 1024)
+
+// Tar archives are made of 512-byte records
+#define RECORD_SIZE     512
+
+// Largest pax header or GNU long name accepted
+#define MAX_META_SIZE   (1024 * 1024)
+
+// Fields of a ustar header, as offset and length
+#define NAME_OFFSET     0
+#define NAME_LEN        100
+#define SIZE_OFFSET     124
+#define SIZE_LEN        12
+#define CHKSUM_OFFSET   148
+#define CHKSUM_LEN      8
+#define TYPE_OFFSET     156
+#define MAGIC_OFFSET    257
+#define PREFIX_OFFSET   345
+#define PREFIX_LEN      155
+
+// State of a tar run
+struct tar_reader
+{
+    FILE*              input;
+    int                type;
+    uint8_t*           buf;
+    size_t             pos;
+    size_t             have;
+    int                eof;
+
+    // overrides for the next member, from a pax header or GNU long name
+    char*              path;
+    int                have_size;
+    uint64_t           size;
+};
+
+// Local function prototypes
+static int  fill            (struct tar_reader* r, size_t want);
+static int  read_header     (struct tar_reader* r, uint8_t* header);
+static int  member_data     (struct tar_reader* r, uint64_t size,
+                             struct method_api* api, struct context* ctx,
+                             uint8_t* copy);
+static int  parse_number    (const uint8_t* field, size_t len, uint64_t* value);
+static int  parse_pax       (struct tar_reader* r, const uint8_t* data, size_t len);
+static char* header_path    (const uint8_t* header);
+
+
+// Display a checksum for each file in a tar archive
+int tar_run(struct method_api* api, FILE* input)
+{
+    struct tar_reader r;
+    struct context ctx;
+    uint8_t header[RECORD_SIZE];
+    uint8_t digest[MAX_OUTPUT_SIZE];
+    char line[2 * MAX_OUTPUT_SIZE + 4];
+    uint8_t* meta;
+    uint64_t size;
+    char* path;
+    char type;
+    int retval = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.input = input;
+    r.type = api->type;
+    ctx.which = api->type;
+    ctx.threads = 1;
+    ctx.preallocated = 1;
+    r.buf = malloc(IO_SIZE);
+    if ((r.buf == NULL) ||
+        posix_memalign(&ctx.context, CONTEXT_ALIGN, api->context_size))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        free(r.buf);
+        return 1;
+    }
+
+    while (!retval)
+    {
+        retval = read_header(&r, header);
+        if (retval != 0)
+        {
+            // The end of the archive is not an error
+            retval = (retval < 0) ? 0 : 1;
+            break;
+        }
+        type = header[TYPE_OFFSET];
+        if (parse_number(&header[SIZE_OFFSET], SIZE_LEN, &size))
+        {
+            fprintf(stderr, "Invalid member size in tar header\n");
+            retval = 1;
+            break;
+        }
+        if (r.have_size && !memchr("xgLK", type, 4))
+            size = r.size;
+
+        switch (type)
+        {
+            case 'x':
+            case 'L':
+                // Metadata for the next member
+                if (size > MAX_META_SIZE)
+                {
+                    fprintf(stderr, "Tar extended header too large\n");
+                    retval = 1;
+                    break;
+                }
+                meta = malloc(size + 1);
+                if (meta == NULL)
+                {
+                    fprintf(stderr, "Unable to allocate memory\n");
+                    retval = 1;
+                    break;
+                }
+                retval = member_data(&r, size, NULL, NULL, meta);
+                if (!retval && (type == 'x'))
+                {
+                    retval = parse_pax(&r, meta, size);
+                }
+                else if (!retval)
+                {
+                    // The name is NUL-terminated within the data, usually
+                    meta[size] = '\0';
+                    free(r.path);
+                    r.path = (char*)meta;
+                    meta = NULL;
+                }
+                free(meta);
+                continue;
+
+            case '0':
+            case '\0':
+            case '7':
+                // A regular file
+                if (api->sum_init(&ctx))
+                {
+                    fprintf(stderr, "Unable to initialize algorithm\n");
+                    retval = 1;
+                    break;
+                }
+                retval = member_data(&r, size, api, &ctx, NULL);
+                if (method_finish(api, &ctx, digest))
+                {
+                    fprintf(stderr, "Error finalizing checksum\n");
+                    retval = 1;
+                }
+                if (retval)
+                    break;
+
+                path = (r.path != NULL) ? r.path : header_path(header);
+                printf("%.*s %s\n", (int)format_digest(line, digest, api->output_size) - 1,
+                       line, (path != NULL) ? path : "?");
+                if (path != r.path)
+                    free(path);
+                break;
+
+            case 'g':
+            case 'K':
+                // Metadata that doesn't matter here
+                retval = member_data(&r, size, NULL, NULL, NULL);
+                continue;
+
+            default:
+                // Anything else has no contents worth checksumming
+                retval = member_data(&r, size, NULL, NULL, NULL);
+                break;
+        }
+
+        // Overrides only apply to one member
+        free(r.path);
+        r.path = NULL;
+        r.have_size = 0;
+    }
+
+    free(r.path);
+    free(ctx.context);
+    free(r.buf);
+
+    return retval;
+}
+
+
+// Make at least 'want' bytes (at most IO_SIZE) available in the buffer.
+// Returns 0 on success, -1 if the input ends first and 1 on error.
+static int fill(struct tar_reader* r, size_t want)
+{
+    uint64_t start;
+    size_t got;
+
+    if (r->have - r->pos >= want)
+        return 0;
+
+    memmove(r->buf, &r->buf[r->pos], r->have - r->pos);
+    r->have -= r->pos;
+    r->pos = 0;
+    while (!r->eof && (r->have < want))
+    {
+        start = throttle_start();
+        got = fread(&r->buf[r->have], 1, IO_SIZE - r->have, r->input);
+        throttle_read(got, start);
+        PROBE2(read_done, r->type, got);
+        if (got < IO_SIZE - r->have)
+        {
+            if (ferror(r->input))
+            {
+                fprintf(stderr, "Error reading from %s\n", (r->input == stdin) ? "stdin" : "input file");
+                return 1;
+            }
+            r->eof = 1;
+        }
+        r->have += got;
+    }
+
+    return (r->have < want) ? -1 : 0;
+}
+
+// Read and check the next header.  Returns 0 on success, -1 at the end
+// of the archive and 1 on error.
+static int read_header(struct tar_reader* r, uint8_t* header)
+{
+    uint64_t stored, sum = 0;
+    int64_t signed_sum = 0;
+    int retval;
+    size_t i;
+
+    retval = fill(r, RECORD_SIZE);
+    if (retval < 0)
+    {
+        if (r->have - r->pos == 0)
+            return -1;
+        fprintf(stderr, "Unexpected end of tar archive\n");
+        return 1;
+    }
+    if (retval)
+        return 1;
+    memcpy(header, &r->buf[r->pos], RECORD_SIZE);
+    r->pos += RECORD_SIZE;
+
+    // The checksum field counts as spaces.  Some old archivers summed
+    // signed bytes, so accept either.
+    for (i = 0; i < RECORD_SIZE; ++i)
+    {
+        if ((i >= CHKSUM_OFFSET) && (i < CHKSUM_OFFSET + CHKSUM_LEN))
+        {
+            sum += ' ';
+            signed_sum += ' ';
+        }
+        else
+        {
+            sum += header[i];
+            signed_sum += (int8_t)header[i];
+        }
+    }
+    if (sum == 8 * ' ')
+    {
+        // An all-zero block marks the end
+        for (i = 0; (i < RECORD_SIZE) && (header[i] == 0); ++i)
+            ;
+        if (i == RECORD_SIZE)
+            return -1;
+    }
+    if (parse_number(&header[CHKSUM_OFFSET], CHKSUM_LEN, &stored) ||
+        ((stored != sum) && ((int64_t)stored != signed_sum)))
+    {
+        fprintf(stderr, "Invalid tar header checksum\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Consume a member's data and the padding after it.  The data is fed to
+// the method if 'api' is set and copied to 'copy' if that is set.
+static int member_data(struct tar_reader* r, uint64_t size,
+                       struct method_api* api, struct context* ctx,
+                       uint8_t* copy)
+{
+    uint64_t padded;
+    size_t len;
+    int retval;
+
+    padded = (size + RECORD_SIZE - 1) / RECORD_SIZE * RECORD_SIZE;
+    while (padded > 0)
+    {
+        retval = fill(r, 1);
+        if (retval < 0)
+        {
+            fprintf(stderr, "Unexpected end of tar archive\n");
+            return 1;
+        }
+        if (retval)
+            return 1;
+
+        len = r->have - r->pos;
+        if (len > padded)
+            len = padded;
+        if (size > 0)
+        {
+            // The data itself, rather than the padding
+            if (len < size)
+                size -= len;
+            else
+                len = size, size = 0;
+            if ((api != NULL) && method_process(api, ctx, &r->buf[r->pos], len))
+            {
+                fprintf(stderr, "Error processing data\n");
+                return 1;
+            }
+            if (copy != NULL)
+            {
+                memcpy(copy, &r->buf[r->pos], len);
+                copy += len;
+            }
+        }
+        r->pos += len;
+        padded -= len;
+    }
+
+    return 0;
+}
+
+// Parse a numeric header field: octal digits, optionally surrounded by
+// spaces and NULs, or (for large values) base-256 with the top bit set
+static int parse_number(const uint8_t* field, size_t len, uint64_t* value)
+{
+    uint64_t result = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80)
+    {
+        // Base-256; negative numbers make no sense for sizes
+        if (field[0] & 0x40)
+            return -1;
+        result = field[0] & 0x3f;
+        for (i = 1; i < len; ++i)
+        {
+            if (result >> 56)
+                return -1;
+            result = (result << 8) | field[i];
+        }
+        *value = result;
+        return 0;
+    }
+
+    while ((i < len) && (field[i] == ' '))
+        ++i;
+    for (; (i < len) && (field[i] >= '0') && (field[i] <= '7'); ++i)
+        result = (result << 3) | (field[i] - '0');
+    for (; i < len; ++i)
+    {
+        if ((field[i] != ' ') && (field[i] != '\0'))
+            return -1;
+    }
+
+    *value = result;
+    return 0;
+}
+
+// Parse a pax extended header, made of "<length> <key>=<value>\n" records
+// where the length covers the whole record.  Only the path and size keys
+// matter here.
+static int parse_pax(struct tar_reader* r, const uint8_t* data, size_t len)
+{
+    size_t pos = 0, start, record_len, end, value;
+    const uint8_t* eq;
+    uint64_t size;
+    char* path;
+
+    while (pos < len)
+    {
+        start = pos;
+        for (record_len = 0; (pos < len) && (data[pos] >= '0') && (data[pos] <= '9') &&
+                             (record_len <= len); ++pos)
+            record_len = record_len * 10 + (data[pos] - '0');
+        if ((pos >= len) || (data[pos] != ' ') || (record_len > len - start) ||
+            (record_len <= pos + 1 - start) || (data[start + record_len - 1] != '\n'))
+        {
+            fprintf(stderr, "Invalid pax extended header\n");
+            return 1;
+        }
+        end = start + record_len - 1;
+        eq = memchr(&data[pos + 1], '=', end - (pos + 1));
+        if (eq == NULL)
+        {
+            fprintf(stderr, "Invalid pax extended header\n");
+            return 1;
+        }
+        value = eq + 1 - data;
+
+        if ((eq - &data[pos + 1] == 4) && (memcmp(&data[pos + 1], "path", 4) == 0))
+        {
+            path = malloc(end - value + 1);
+            if (path == NULL)
+            {
+                fprintf(stderr, "Unable to allocate memory\n");
+                return 1;
+            }
+            memcpy(path, &data[value], end - value);
+            path[end - value] = '\0';
+            free(r->path);
+            r->path = path;
+        }
+        else if ((eq - &data[pos + 1] == 4) && (memcmp(&data[pos + 1], "size", 4) == 0))
+        {
+            for (size = 0; (value < end) && (data[value] >= '0') && (data[value] <= '9'); ++value)
+                size = size * 10 + (data[value] - '0');
+            if (value != end)
+            {
+                fprintf(stderr, "Invalid size in pax extended header\n");
+                return 1;
+            }
+            r->size = size;
+            r->have_size = 1;
+        }
+
+        pos = start + record_len;
+    }
+
+    return 0;
+}
+
+// Build a member's path from the name and (ustar) prefix fields
+static char* header_path(const uint8_t* header)
+{
+    size_t name_len, prefix_len = 0;
+    char* path;
+
+    name_len = strnlen((const char*)&header[NAME_OFFSET], NAME_LEN);
+    // Old GNU archives ("ustar  ") use the prefix field for other things
+    if (memcmp(&header[MAGIC_OFFSET], "ustar", 6) == 0)
+        prefix_len = strnlen((const char*)&header[PREFIX_OFFSET], PREFIX_LEN);
+
+    path = malloc(prefix_len + name_len + 2);
+    if (path == NULL)
+        return NULL;
+    if (prefix_len > 0)
+        sprintf(path, "%.*s/%.*s", (int)prefix_len, (const char*)&header[PREFIX_OFFSET],
+                (int)name_len, (const char*)&header[NAME_OFFSET]);
+    else
+        sprintf(path, "%.*s", (int)name_len, (const char*)&header[NAME_OFFSET]);
+
+    return path;
+}
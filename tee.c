@@ -0,0 +1,271 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Pass-through mode
+ *
+ * Copies the input to an output descriptor unchanged while checksumming
+ * it, so that the program can sit in the middle of a pipeline.
+ *
+ * On Linux, when the input is a pipe, tee(2) duplicates the data into the
+ * output pipe and only the copy read for checksumming passes through user
+ * space.  If the output isn't a pipe, the data is duplicated into a pipe
+ * of our own and moved to the output with splice(2).  Anything else (or a
+ * kernel that refuses) goes through the caller's read buffer and write(2).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.h"
+
+// Local function prototypes
+#ifdef __linux__
+static int  tee_pipes   (struct method_api* api, struct context* ctx,
+                         int in, int out, uint8_t* buf, size_t buf_size);
+#endif
+static int  tee_copy    (struct method_api* api, struct context* ctx,
+                         int in, int out, uint8_t* buf, size_t buf_size);
+static int  read_full   (int fd, uint8_t* buf, size_t len);
+static int  write_full  (int fd, const uint8_t* buf, size_t len);
+static void wait_for    (int fd, short events);
+
+
+// Copy 'in' to 'out' while feeding it to the method.  The context must
+// already be initialized; the caller finishes it.  Returns non-zero on
+// error, after displaying a message.
+int tee_run(struct method_api* api, struct context* ctx, int in, int out,
+            uint8_t* buf, size_t buf_size)
+{
+#ifdef __linux__
+    int retval;
+
+    retval = tee_pipes(api, ctx, in, out, buf, buf_size);
+    if (retval >= 0)
+        return retval;
+#endif
+
+    return tee_copy(api, ctx, in, out, buf, buf_size);
+}
+
+
+#ifdef __linux__
+// Forward data from an input pipe without copying it through user space.
+// Returns -1 if this isn't possible, in which case any data already
+// handled has been forwarded and checksummed and the caller can carry on
+// from where this left off.
+static int tee_pipes(struct method_api* api, struct context* ctx,
+                     int in, int out, uint8_t* buf, size_t buf_size)
+{
+    struct stat st;
+    int direct;
+    int staging[2] = { -1, -1 };
+    ssize_t len, moved;
+    size_t done;
+    uint64_t start;
+    int retval = 0;
+
+    if ((fstat(in, &st) != 0) || !S_ISFIFO(st.st_mode))
+        return -1;
+    direct = (fstat(out, &st) == 0) && S_ISFIFO(st.st_mode);
+    if (!direct)
+    {
+        // Stage the data in a pipe of our own so it can be spliced out
+        if (pipe2(staging, O_CLOEXEC) != 0)
+            return -1;
+        fcntl(staging[1], F_SETPIPE_SZ, (int)buf_size);
+    }
+
+    while (1)
+    {
+        start = throttle_start();
+        len = tee(in, direct ? out : staging[1], buf_size, 0);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_for(in, POLLIN);
+                wait_for(direct ? out : staging[1], POLLOUT);
+                continue;
+            }
+            if (errno == EINVAL)
+            {
+                retval = -1;
+                break;
+            }
+            fprintf(stderr, "Error forwarding data: %s\n", strerror(errno));
+            retval = 1;
+            break;
+        }
+        if (len == 0)
+            break;
+        throttle_read(len, start);
+        PROBE2(read_done, api->type, len);
+
+        // Consume the data from the input to checksum it
+        if (read_full(in, buf, len))
+        {
+            retval = 1;
+            break;
+        }
+        if (method_process(api, ctx, buf, len))
+        {
+            fprintf(stderr, "Error processing data\n");
+            retval = 1;
+            break;
+        }
+        if (direct)
+            continue;
+
+        for (done = 0; done < len; done += moved)
+        {
+            moved = splice(staging[0], NULL, out, NULL, len - done, SPLICE_F_MOVE);
+            if ((moved < 0) && (errno == EINTR))
+                moved = 0;
+            else if ((moved < 0) && (errno == EAGAIN))
+            {
+                wait_for(out, POLLOUT);
+                moved = 0;
+            }
+            else if (moved <= 0)
+                break;
+        }
+        if (done < len)
+        {
+            // The output can't be spliced to; the rest of this piece is
+            // still in the buffer, so send it from there
+            retval = (errno == EINVAL) ? -1 : 1;
+            if ((retval > 0) || write_full(out, &buf[done], len - done))
+            {
+                fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+                retval = 1;
+            }
+            break;
+        }
+    }
+
+    if (!direct)
+    {
+        close(staging[0]);
+        close(staging[1]);
+    }
+    return retval;
+}
+#endif
+
+// Forward data through the read buffer
+static int tee_copy(struct method_api* api, struct context* ctx,
+                    int in, int out, uint8_t* buf, size_t buf_size)
+{
+    uint64_t start;
+    ssize_t len;
+
+    while (1)
+    {
+        start = throttle_start();
+        len = read(in, buf, buf_size);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_for(in, POLLIN);
+                continue;
+            }
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            return 1;
+        }
+        if (len == 0)
+            return 0;
+        throttle_read(len, start);
+        PROBE2(read_done, api->type, len);
+
+        if (method_process(api, ctx, buf, len))
+        {
+            fprintf(stderr, "Error processing data\n");
+            return 1;
+        }
+        if (write_full(out, buf, len))
+        {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+}
+
+// Read exactly 'len' bytes that are known to be waiting
+static int read_full(int fd, uint8_t* buf, size_t len)
+{
+    ssize_t got;
+
+    while (len > 0)
+    {
+        got = read(fd, buf, len);
+        if ((got < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+            continue;
+        if (got <= 0)
+        {
+            fprintf(stderr, "Error reading input: %s\n",
+                    (got < 0) ? strerror(errno) : "unexpected end of data");
+            return 1;
+        }
+        buf += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+// Write all of a buffer, returning non-zero on error
+static int write_full(int fd, const uint8_t* buf, size_t len)
+{
+    ssize_t put;
+
+    while (len > 0)
+    {
+        put = write(fd, buf, len);
+        if (put < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_for(fd, POLLOUT);
+                continue;
+            }
+            return 1;
+        }
+        buf += put;
+        len -= put;
+    }
+
+    return 0;
+}
+
+// Wait until a non-blocking descriptor is ready
+static void wait_for(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+
+    poll(&pfd, 1, -1);
+}
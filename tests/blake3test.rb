@@ -0,0 +1,22 @@
+#!/usr/bin/ruby
+# Script for testing the BLAKE3 algorithm using the official test vectors
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+# Run known-answer tests, single-threaded and with the tree split up
+kat 'BLAKE3.rsp', '-blake3'
+kat 'BLAKE3.rsp', '--threads 4 -blake3'
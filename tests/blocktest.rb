@@ -0,0 +1,67 @@
+#!/usr/bin/ruby
+# Script for testing block list and diff modes
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+# Run the utility in diff mode on two binary data blobs
+def diff(message_a, message_b, args='')
+    File.open("test-diff-a", "wb") {|f| f.write message_a}
+    File.open("test-diff-b", "wb") {|f| f.write message_b}
+    stdout = `./checksum --diff #{args} test-diff-a test-diff-b 2>/dev/null`
+    status = $?.exitstatus
+    File.unlink("test-diff-a")
+    File.unlink("test-diff-b")
+    return stdout, status
+end
+
+failures = 0
+tests = 0
+srand(31)
+message = Array.new(300000) { rand(256).chr }.join
+block = 4096
+
+# Block list: one line per block, each matching a whole-file checksum
+[1, 4].each do |threads|
+    tests += 1
+    lines = checksum(message, "--threads #{threads} --block-size #{block} -sha256").lines.map(&:strip)
+    expected = (0...message.length).step(block).map do |o|
+        "#{o} #{message[o, block].length} #{checksum(message[o, block], '-sha256')}"
+    end
+    if lines != expected
+        puts "Failed block list with #{threads} thread(s)"
+        failures += 1
+    end
+end
+
+# Diff: identical inputs, scattered changes, a limit and a length change
+edited = message.dup
+[10, 5000, 9000, 200000].each { |o| edited.setbyte(o, edited.getbyte(o) ^ 1) }
+[
+    [message, '', 0],
+    [edited, "0 12288\n196608 4096\n", 1],
+    [edited, "0 4096\n", 1, '--max-mismatches 1'],
+    [message[0, 250000], "249856 50144\n", 1],
+].each do |other, expected, status, extra|
+    tests += 1
+    output, result = diff(message, other, "--threads 4 --block-size #{block} #{extra} -xxh3")
+    if output != expected or result != status
+        puts "Failed diff test ##{tests}"
+        failures += 1
+    end
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
@@ -0,0 +1,77 @@
+#!/usr/bin/ruby
+# Script for testing content-defined chunking mode
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+# Split a message into chunks and parse the result into [offset, length, digest]
+def chunks(message, args)
+    output = checksum(message, args)
+    return [] if output.nil?
+    output.lines.map { |line| line.split }.map { |o, l, d| [o.to_i, l.to_i, d] }
+end
+
+# Check that chunks cover the message exactly, respect the size limits and
+# carry the same checksum as the data they cover
+def check_chunks(message, list, min, max, method)
+    offset = 0
+    list.each_with_index do |(o, l, d), i|
+        return false unless o == offset
+        return false unless l <= max
+        return false unless l > min or i == list.length - 1
+        return false unless d == checksum(message[o, l], method)
+        offset += l
+    end
+    offset == message.length
+end
+
+failures = 0
+tests = 0
+srand(30)
+message = Array.new(1 << 20) { rand(256).chr }.join
+
+# Chunk boundaries and checksums must be correct for any thread count
+[1, 4].each do |threads|
+    tests += 1
+    list = chunks(message, "--threads #{threads} --cdc 4096 --cdc-min 1024 --cdc-max 16384 -xxh3")
+    if list.length < 16 or not check_chunks(message, list, 1024, 16384, '-xxh3')
+        puts "Failed chunk layout with #{threads} thread(s)"
+        failures += 1
+    end
+end
+
+# An insertion should only change the chunks around it
+tests += 1
+before = chunks(message, '--cdc 4096 -sha256').map { |o, l, d| d }
+edited = message[0, 500000] + "inserted" + message[500000..-1]
+after = chunks(edited, '--cdc 4096 -sha256').map { |o, l, d| d }
+if (before - after).length > 2
+    puts "Failed insertion test: #{(before - after).length} chunks changed"
+    failures += 1
+end
+
+# Sizes that don't fit in 64 bits, before or after the suffix, are refused
+['--cdc 18446744073709551616', '--cdc 99999999999999999999999K',
+ '--cdc 4096 --cdc-max 17179869184G', '--block-size 99999999999999999999999'].each do |options|
+    tests += 1
+    system("./checksum #{options} -xxh3 tests/cdctest.rb >/dev/null 2>&1")
+    if $?.success?
+        puts "Failed out-of-range size (#{options})"
+        failures += 1
+    end
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
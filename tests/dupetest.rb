@@ -0,0 +1,115 @@
+#!/usr/bin/ruby
+# Script for testing duplicate file finding
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'fileutils'
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(39)
+
+def random_bytes(len)
+    Array.new(len) { rand(256).chr }.join
+end
+
+# Files that only differ in the middle get past the partial checksums,
+# files that differ at either end don't, and small files are settled by
+# the partial stage alone
+big = random_bytes(100000)
+middle = big.dup
+middle[50000] = (middle[50000].ord ^ 1).chr
+head = big.dup
+head[0] = (head[0].ord ^ 1).chr
+small = random_bytes(300)
+other_small = random_bytes(300)
+
+FileUtils.rm_rf("test-dupes")
+FileUtils.mkdir_p(["test-dupes/a/deeper", "test-dupes/b"])
+{
+    "test-dupes/a/big1"          => big,
+    "test-dupes/a/deeper/big2"   => big,
+    "test-dupes/b/big3"          => big,
+    "test-dupes/a/middle"        => middle,
+    "test-dupes/b/head"          => head,
+    "test-dupes/a/small1"        => small,
+    "test-dupes/b/small2"        => small,
+    "test-dupes/b/other_small"   => other_small,
+    "test-dupes/a/unique"        => random_bytes(1234),
+    "test-dupes/a/empty1"        => "",
+    "test-dupes/b/empty2"        => "",
+}.each { |path, data| File.binwrite(path, data) }
+
+# Other names for a file are not duplicates of it
+File.link("test-dupes/a/big1", "test-dupes/b/hardlink")
+File.symlink("big1", "test-dupes/a/symlink")
+
+['-sha256', '-xxh3', '-fletcher32'].each do |method|
+    [1, 4].each do |threads|
+        tests += 1
+        expected = [[big, ["test-dupes/a/big1", "test-dupes/a/deeper/big2", "test-dupes/b/big3"]],
+                    [small, ["test-dupes/a/small1", "test-dupes/b/small2"]]]
+        expected = expected.map do |data, paths|
+            digest = checksum(data, method)
+            paths.map { |path| "#{digest} #{path}\n" }.join + "\n"
+        end.join
+
+        # Groups come largest first, with paths in order
+        output = `./checksum -t #{threads} --find-dupes #{method} test-dupes/a test-dupes/b`
+        if !$?.success? or output != expected
+            puts "Failed duplicate test ##{tests} (#{method}, #{threads} threads)"
+            failures += 1
+        end
+    end
+end
+
+# No duplicates at all
+tests += 1
+output = `./checksum --find-dupes -sha256 test-dupes/a/deeper`
+if !$?.success? or !output.empty?
+    puts "Failed duplicate test ##{tests} (no duplicates)"
+    failures += 1
+end
+
+# Files that collide under a weak checksum aren't duplicates unless their
+# contents match too, and files sharing a checksum can make up several groups
+FileUtils.mkdir_p("test-dupes/weak")
+File.binwrite("test-dupes/weak/aca1", "aca")
+File.binwrite("test-dupes/weak/bab1", "bab")
+['-8', '-16', '-adler32'].each do |method|
+    tests += 1
+    output = `./checksum --find-dupes #{method} test-dupes/weak`
+    if !$?.success? or !output.empty?
+        puts "Failed duplicate test ##{tests} (#{method} collision)"
+        failures += 1
+    end
+end
+File.binwrite("test-dupes/weak/aca2", "aca")
+File.binwrite("test-dupes/weak/bab2", "bab")
+digest = checksum("aca", '-8')
+expected = "#{digest} test-dupes/weak/aca1\n#{digest} test-dupes/weak/aca2\n\n" +
+           "#{digest} test-dupes/weak/bab1\n#{digest} test-dupes/weak/bab2\n\n"
+[1, 4].each do |threads|
+    tests += 1
+    output = `./checksum -t #{threads} --find-dupes -8 test-dupes/weak`
+    if !$?.success? or output != expected
+        puts "Failed duplicate test ##{tests} (split collision, #{threads} threads)"
+        failures += 1
+    end
+end
+
+FileUtils.rm_rf("test-dupes")
+puts "Tests passed: #{tests - failures} / #{tests}"
@@ -0,0 +1,74 @@
+#!/usr/bin/ruby
+# Script for testing multiple input files
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'fileutils'
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(42)
+
+FileUtils.rm_rf("test-files")
+FileUtils.mkdir_p("test-files")
+messages = {}
+30.times do |i|
+    path = "test-files/f#{i}"
+    messages[path] = Array.new(rand(300000)) { rand(256).chr }.join
+    File.binwrite(path, messages[path])
+end
+paths = messages.keys
+File.write("test-files/list", paths[10..-1].join("\n") + "\n")
+
+# Lines come out in list order whatever the readahead depth, command-line
+# files first
+['-sha256', '-xxh3'].each do |method|
+    expected = paths.map { |p| "#{checksum(messages[p], method)} #{p}\n" }.join
+    [0, 1, 8].each do |depth|
+        tests += 1
+        output = `./checksum --readahead #{depth} --files-from test-files/list #{method} #{paths[0, 10].join(' ')}`
+        if !$?.success? or output != expected
+            puts "Failed multiple file test ##{tests} (#{method}, readahead #{depth})"
+            failures += 1
+        end
+    end
+end
+
+# A missing file is reported and skipped, and the statistics count it
+tests += 1
+output = `./checksum --stats -sha256 #{paths[0]} test-files/missing #{paths[1]} 2>test-files/err`
+errors = File.read("test-files/err")
+if $?.success? or output.lines.length != 2 or !errors.include?("missing") or
+   !errors.include?("Files: 2 checksummed, 1 failed") or !errors.include?("Readahead: 8 files")
+    puts "Failed multiple file test ##{tests} (missing file)"
+    failures += 1
+end
+
+# Options that another mode would ignore are refused instead
+["--find-dupes --files-from test-files/list -sha256 test-files",
+ "--find-dupes --stats -sha256 test-files",
+ "--diff --stats -sha256 #{paths[0]} #{paths[1]}",
+ "--serve test-files/socket --key 6b6579"].each do |options|
+    tests += 1
+    output = `./checksum #{options} 2>&1`
+    if $?.success? or !output.include?("cannot be combined")
+        puts "Failed multiple file test ##{tests} (#{options})"
+        failures += 1
+    end
+end
+
+FileUtils.rm_rf("test-files")
+puts "Tests passed: #{tests - failures} / #{tests}"
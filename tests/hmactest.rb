@@ -0,0 +1,56 @@
+#!/usr/bin/ruby
+# Script for testing keyed methods (HMAC-SHA256) from the command line
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+key = ''
+msg = ''
+
+# RFC 4231 vectors, with the key given both ways
+IO.foreach(File.expand_path('HMAC_SHA256.rsp', File.dirname(__FILE__))) do |line|
+    label, value = line.strip.split(' = ')
+    case label
+    when 'Key'
+        key = value
+    when 'Msg'
+        msg = hex2bin(value)
+    when 'Mac'
+        File.open("test-hmac-key", "wb") {|f| f.write hex2bin(key)}
+        ["--key #{key}", "--key-file test-hmac-key"].each do |option|
+            tests += 1
+            mac = checksum(msg, "#{option} -hmac256")
+            if mac.nil? or not mac.start_with?("0x" + value)
+                puts "Failed HMAC test ##{tests} (#{option})"
+                failures += 1
+            end
+        end
+        File.unlink("test-hmac-key")
+    end
+end
+
+# A key is required, and only keyed methods take one
+[["-hmac256", nil], ["--key 00 -sha256", nil]].each do |args, expected|
+    tests += 1
+    if checksum("abc", "#{args} 2>/dev/null") != expected
+        puts "Failed key check '#{args}'"
+        failures += 1
+    end
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
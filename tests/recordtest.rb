@@ -0,0 +1,58 @@
+#!/usr/bin/ruby
+# Script for testing per-record mode
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(37)
+
+# Mostly short records, some empty and one bigger than the input buffer
+records = Array.new(300) { Array.new(rand(100)) { (97 + rand(26)).chr }.join }
+records[7] = ''
+records[150] = 'z' * (1024 * 1024 + 100)
+
+[["\n", '--per-line'], ["\0", '--per-record \\\\0'], [",", '--per-record ,']].each do |delim, option|
+    ['-sha256', '-xxh3'].each do |method|
+        expected = records.map { |r| checksum(r, method) }
+        [delim, ''].each do |ending|
+            tests += 1
+            output = checksum(records.join(delim) + ending, "#{option} #{method}")
+            if output.nil? or output.lines.map(&:strip) != expected
+                puts "Failed #{option} #{method} (#{ending.empty? ? 'no ' : ''}final delimiter)"
+                failures += 1
+            end
+        end
+    end
+end
+
+# A failed write to stdout must fail the run, even when all of the output
+# fits in stdio's buffer
+if File.exist?("/dev/full")
+    File.binwrite("test-records", records[0, 5].join("\n"))
+    ['-sha256', '-xxh3'].each do |method|
+        tests += 1
+        system("./checksum --per-line #{method} test-records >/dev/full 2>/dev/null")
+        if $?.success?
+            puts "Failed #{method} output error"
+            failures += 1
+        end
+    end
+    File.unlink("test-records")
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
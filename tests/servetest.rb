@@ -0,0 +1,146 @@
+#!/usr/bin/ruby
+# Script for testing daemon mode
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'socket'
+require_relative 'test_helpers'
+
+TO_END = 0xffffffffffffffff
+
+# Build one request frame
+def request(id, type, method, path: '', offset: nil, length: nil)
+    body = [id, type.ord, method.length].pack('NCC') + method
+    body += [offset >> 32, offset & 0xffffffff, length >> 32, length & 0xffffffff].pack('NNNN') if offset
+    body += path
+    [body.length].pack('N') + body
+end
+
+# Read one reply frame: [id, status, payload]
+def reply(sock)
+    size = sock.read(4).unpack1('N')
+    data = sock.read(size)
+    [data[0, 4].unpack1('N'), data.getbyte(4), data[5..-1]]
+end
+
+failures = 0
+tests = 0
+srand(33)
+message = Array.new(3000000) { rand(256).chr }.join
+File.open("test-serve-data", "wb") {|f| f.write message}
+socket = "test-serve-socket"
+server = spawn("./checksum --threads 3 --serve #{socket}")
+50.times { break if File.exist?(socket); sleep 0.1 }
+
+# Requests: [frame, expected status, expected payload (nil to skip)]
+cases = [
+    [request(1, 'P', '-sha256', path: 'test-serve-data'), 0, checksum(message, '-sha256')],
+    [request(2, 'R', '-xxh3', path: 'test-serve-data', offset: 12345, length: 100000), 0,
+        checksum(message[12345, 100000], '-xxh3')],
+    [request(3, 'R', '-sha512', path: 'test-serve-data', offset: 2999990, length: TO_END), 0,
+        checksum(message[2999990..-1], '-sha512')],
+    [request(4, 'F', '-blake3', offset: 0, length: 65536), 0, checksum(message[0, 65536], '-blake3')],
+    [request(5, 'P', '-adler32', path: 'test-serve-data'), 0, checksum(message, '-adler32')],
+    [request(6, 'P', '-nosuch', path: 'test-serve-data'), 1, nil],
+    [request(7, 'P', '-sha256', path: 'test-serve-missing'), 1, nil],
+    [request(8, 'R', '-sha256', path: 'test-serve-data', offset: 2999990, length: 11), 1, nil],
+]
+
+# Send everything before reading any replies, passing the descriptor
+# for the 'F' request along with it
+begin
+    sock = UNIXSocket.new(socket)
+    File.open("test-serve-data", "rb") do |file|
+        cases.each do |frame, _, _|
+            if frame[8] == 'F'
+                sock.sendmsg(frame, 0, nil, Socket::AncillaryData.unix_rights(file))
+            else
+                sock.write(frame)
+            end
+        end
+    end
+
+    replies = {}
+    cases.length.times do
+        id, status, payload = reply(sock)
+        replies[id] = [status, payload]
+    end
+    sock.close
+
+    cases.each_with_index do |(frame, status, expected), i|
+        tests += 1
+        got_status, payload = replies[i + 1]
+        if got_status != status or (expected and "0x" + bin2hex(payload) != expected)
+            puts "Failed request ##{i + 1}"
+            failures += 1
+        end
+    end
+
+    # A rejected 'F' request still uses up its descriptor, so the next
+    # one checksums the file it was sent with
+    tests += 1
+    File.binwrite("test-serve-one", "one")
+    sock = UNIXSocket.new(socket)
+    File.open("test-serve-one", "rb") do |file|
+        sock.sendmsg(request(1, 'F', '-nosuch', offset: 0, length: TO_END), 0, nil,
+                     Socket::AncillaryData.unix_rights(file))
+    end
+    File.open("test-serve-data", "rb") do |file|
+        sock.sendmsg(request(2, 'F', '-sha256', offset: 0, length: TO_END), 0, nil,
+                     Socket::AncillaryData.unix_rights(file))
+    end
+    replies = {}
+    2.times do
+        id, status, payload = reply(sock)
+        replies[id] = [status, payload]
+    end
+    sock.close
+    File.unlink("test-serve-one")
+    if replies[1].nil? or replies[1][0] != 1 or replies[2].nil? or replies[2][0] != 0 or
+       "0x" + bin2hex(replies[2][1]) != checksum(message, '-sha256')
+        puts "Failed descriptor after a rejected request"
+        failures += 1
+    end
+
+    # A client that sends requests but never reads the replies must not
+    # hold up the workers for everyone else
+    tests += 1
+    stalled = UNIXSocket.new(socket)
+    frames = (1..2000).map { |i| request(i, 'R', '-sha512', path: 'test-serve-data', offset: i, length: 1) }.join
+    writer = Thread.new { stalled.write(frames) rescue nil }
+    sleep 1
+    sock = UNIXSocket.new(socket)
+    sock.write(request(1, 'P', '-xxh3', path: 'test-serve-data'))
+    if IO.select([sock], nil, nil, 10).nil? or
+       reply(sock) != [1, 0, [checksum(message, '-xxh3')[2..-1]].pack('H*')]
+        puts "Failed request with a stalled client"
+        failures += 1
+    end
+    sock.close
+    stalled.close
+    writer.kill
+ensure
+    Process.kill('TERM', server)
+    Process.wait(server)
+    File.unlink("test-serve-data")
+end
+
+tests += 1
+if File.exist?(socket)
+    puts "Socket not removed on exit"
+    failures += 1
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
@@ -1,5 +1,5 @@
 #!/usr/bin/ruby
-# Script for testing the SHA256 algorithm using NIST test vectors
+# Script for testing the SHA-2 algorithms using NIST test vectors
 
 # Copyright 2015 Ben Allen
 #
@@ -17,87 +17,15 @@
 
 require_relative 'test_helpers'
 
-# Calculate the SHA256 hash of a message string
-def sha256(message)
-    checksum(message, "-sha256")
+# Calculate the SHA-2 hash of a message string, using the given method
+def sha(message, method)
+    checksum(message, method)
 end
 
 
-
-# Run a set of known-answer tests from a set of NIST-formatted sample vectors
-def sha256_kat(vector_file)
-    # Define these here so that their scopes will cover all case statements
-    failures = 0
-    tests = 0
-    target = ''
-    msg = ''
-    msg_string = ''
-    msg_len = 0
-
-    # Handle being run with pwd != this file's location
-    if not File.exist?(vector_file)
-        tmp = File.expand_path(vector_file, (File.dirname(__FILE__)))
-        if not File.exist?(tmp)
-            puts "Cannot locate file [#{vector_file}]"
-        end
-        vector_file = tmp
-    end
-
-    puts "Processing file #{vector_file} ..."
-
-    # Process file, one line at a time
-    IO.foreach(vector_file) do |line|
-        # Remove comments and skip blank lines
-        next if line.gsub(/[#].*$/,'').strip.empty?
-
-        # A line without an equals sign on it is malformed
-        next unless line.index(" = ")
-
-        # Split line into label and data
-        fields = line.strip.split
-        next unless fields.length == 3
-        case fields[0]
-        when "[L"
-            # We don't care about this particular line
-            next
-        when "Len"
-            msg_len = fields[2].to_i
-        when "Msg"
-            msg_string = fields[2]
-            if msg_len == 0
-                msg = ""
-            else
-                # Convert to binary sequence
-                msg = hex2bin(msg_string)
-            end
-        when "MD"
-            target = '0x' + fields[2]
-            # We have all our data now, so run the test
-            tests += 1
-
-            digest = sha256(msg)
-
-            # Validate result
-            if digest != target
-                puts "Failed test case ##{tests}"
-                failures += 1
-            end
-
-            # Reset variables for next test case
-            target = ''
-            msg = ''
-            msg_string = ''
-            msg_len = 0
-        else
-            next
-        end
-    end
-
-    puts "Tests passed: #{tests - failures} / #{tests}"
-end
-
 # Run Monte Carlo tests from a set of NIST-formatted sample vectors
-def sha256_mc(vector_file)
+# 'bits' is the size of the digest produced by the method
+def sha_mc(vector_file, method, bits)
     tests = 0
     failures = 0
     seed = ''
@@ -162,14 +90,14 @@ def sha256_mc(vector_file)
             md[2] = seed
             (3...1003).each do |i|
                 message = md[i-3] + md[i-2] + md[i-1]
-                if message.length != (256 * 3 / 8)
+                if message.length != (bits * 3 / 8)
                     puts "Error, message is wrong length (#{message.length})"
                     puts "message => #{bin2hex message}"
                     return
                 end
-                digest = sha256(message).sub(/^0[xX]/, '')
+                digest = sha(message, method).sub(/^0[xX]/, '')
                 md[i] = hex2bin(digest)
-                if md[i].length != (256 / 8)
+                if md[i].length != (bits / 8)
                     puts "Error, intermediate digest #{i} is wrong length (#{md[i].length})"
                     puts "  md[#{i}] => #{bin2hex md[i]}"
                     return
@@ -195,11 +123,20 @@ end
 
 
 # Run known-answer tests
-sha256_kat 'SHA256ShortMsg.rsp'
-sha256_kat 'SHA256LongMsg.rsp'
+kat 'SHA256ShortMsg.rsp', '-sha256'
+kat 'SHA256LongMsg.rsp', '-sha256'
+kat 'SHA384ShortMsg.rsp', '-sha384'
+kat 'SHA384LongMsg.rsp', '-sha384'
+kat 'SHA512ShortMsg.rsp', '-sha512'
+kat 'SHA512LongMsg.rsp', '-sha512'
+kat 'SHA512_256ShortMsg.rsp', '-sha512_256'
+kat 'SHA512_256LongMsg.rsp', '-sha512_256'
 
 # Run Monte-carlo tests
-sha256_mc 'SHA256Monte.rsp'
+sha_mc 'SHA256Monte.rsp', '-sha256', 256
+sha_mc 'SHA384Monte.rsp', '-sha384', 384
+sha_mc 'SHA512Monte.rsp', '-sha512', 512
+sha_mc 'SHA512_256Monte.rsp', '-sha512_256', 256
 
 #lines.map {|l|
 #  a = ""
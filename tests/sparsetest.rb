@@ -0,0 +1,74 @@
+#!/usr/bin/ruby
+# Script for testing sparse file reading
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(38)
+
+# Each layout is a list of [offset, length] data regions plus the final
+# file size; everything else is left as holes.  Offsets and lengths are
+# deliberately unaligned, so that data and zeros share blocks.
+layouts = [
+    [[[0, 70001]], 70001],
+    [[[0, 1000]], 3 * 1048576 + 7],
+    [[[1048576 * 2 + 13, 5000]], 1048576 * 2 + 5013],
+    [[[9, 4000], [200003, 70001], [1048576 + 61, 3]], 2 * 1048576 + 129],
+    [[], 500001],
+]
+methods = ['-8', '-16', '-32', '-64', '-adler32', '-fletcher16',
+           '-fletcher32', '-fletcher64', '-sha256', '-sha512', '-xxh3',
+           '-blake3', '--key 6b6579 -hmac256']
+
+layouts.each do |regions, size|
+    File.open("test-sparse", "wb") do |f|
+        regions.each do |offset, length|
+            f.seek(offset)
+            f.write(Array.new(length) { rand(256).chr }.join)
+        end
+        f.truncate(size)
+    end
+
+    # Reading through a pipe sees every byte, zeros included
+    methods.each do |method|
+        tests += 1
+        sparse = `./checksum #{method} test-sparse`.strip
+        dense = `cat test-sparse | ./checksum #{method} -`.strip
+        if sparse.empty? or sparse != dense
+            puts "Failed sparse file test ##{tests} (#{method}, #{regions.length} regions)"
+            failures += 1
+        end
+    end
+end
+
+File.unlink("test-sparse")
+
+# Files in /proc report a size of 0 but still have contents
+if File.exist?("/proc/version")
+    ['-sha256', '-xxh3'].each do |method|
+        tests += 1
+        direct = `./checksum #{method} /proc/version`.strip
+        piped = `cat /proc/version | ./checksum #{method} -`.strip
+        if direct.empty? or direct != piped or direct == checksum('', method)
+            puts "Failed /proc file test (#{method})"
+            failures += 1
+        end
+    end
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
@@ -0,0 +1,76 @@
+#!/usr/bin/ruby
+# Script for testing tar archive mode
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'fileutils'
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(40)
+
+def random_bytes(len)
+    Array.new(len) { rand(256).chr }.join
+end
+
+# Sizes around the record size and bigger than the read buffer, and paths
+# that need the ustar prefix, a GNU long name or a pax header
+long_dir = "test-tar/" + "d" * 90 + "/" + "e" * 60
+files = {
+    "test-tar/empty"               => "",
+    "test-tar/one"                 => "x",
+    "test-tar/record"              => random_bytes(512),
+    "test-tar/record_plus"         => random_bytes(513),
+    "test-tar/big"                 => random_bytes(2500000),
+    "#{long_dir}/prefixed"         => random_bytes(1000),
+    "#{long_dir}/" + "f" * 120     => random_bytes(3000),
+}
+FileUtils.rm_rf("test-tar")
+FileUtils.mkdir_p(long_dir)
+files.each { |path, data| File.binwrite(path, data) }
+File.symlink("one", "test-tar/link")
+paths = files.keys.sort
+
+['ustar', 'gnu', 'pax'].each do |format|
+    # ustar can't hold a name part over 100 bytes
+    members = (format == 'ustar') ? paths.reject { |p| File.basename(p).length > 100 } : paths
+    system("tar --format=#{format} -cf test-tar.tar #{members.join(' ')} test-tar/link 2>/dev/null")
+
+    ['-sha256', '-xxh3', '-adler32'].each do |method|
+        tests += 1
+        expected = members.map { |p| "#{checksum(files[p], method)} #{p}\n" }.join
+        output = `cat test-tar.tar | ./checksum --tar #{method} -`
+        if !$?.success? or output != expected
+            puts "Failed tar test ##{tests} (#{format}, #{method})"
+            failures += 1
+        end
+    end
+end
+
+# A damaged header is an error
+tests += 1
+archive = File.binread("test-tar.tar")
+archive[0] = (archive[0].ord ^ 1).chr
+File.binwrite("test-tar.tar", archive)
+`./checksum --tar -sha256 test-tar.tar 2>/dev/null`
+if $?.success?
+    puts "Failed tar test ##{tests} (bad header)"
+    failures += 1
+end
+
+FileUtils.rm_rf("test-tar")
+File.unlink("test-tar.tar")
+puts "Tests passed: #{tests - failures} / #{tests}"
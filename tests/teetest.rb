@@ -0,0 +1,55 @@
+#!/usr/bin/ruby
+# Script for testing pass-through mode
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(34)
+message = Array.new(1500000) { rand(256).chr }.join
+File.open("test-tee-in", "wb") {|f| f.write message}
+
+# Every combination of pipes and files on either side, since each takes
+# a different path through the forwarding code
+[
+    ['cat test-tee-in |', '- | cat > test-tee-out'],
+    ['cat test-tee-in |', '- > test-tee-out'],
+    ['', 'test-tee-in | cat > test-tee-out'],
+    ['', '- < test-tee-in > test-tee-out'],
+].each do |before, after|
+    ['-sha256', '-xxh3'].each do |method|
+        tests += 1
+        system("#{before} ./checksum --tee --digest-file test-tee-digest #{method} #{after}")
+        forwarded = File.binread("test-tee-out")
+        digest = File.read("test-tee-digest").strip
+        if forwarded != message or digest != checksum(message, method)
+            puts "Failed pass-through test ##{tests} (#{method} #{after})"
+            failures += 1
+        end
+    end
+end
+
+# Without --digest-file the checksum goes to standard error
+tests += 1
+digest = `./checksum --tee -sha512 test-tee-in 2>&1 >/dev/null`.strip
+if digest != checksum(message, '-sha512')
+    puts "Failed pass-through test ##{tests} (standard error)"
+    failures += 1
+end
+
+["test-tee-in", "test-tee-out", "test-tee-digest"].each { |f| File.unlink(f) if File.exist?(f) }
+puts "Tests passed: #{tests - failures} / #{tests}"
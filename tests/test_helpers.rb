@@ -41,3 +41,76 @@ def checksum(message, args='')
 
     return $?.success? ? stdout : nil
 end
+
+
+# Run a set of known-answer tests from a set of NIST-formatted sample vectors
+def kat(vector_file, method)
+    # Define these here so that their scopes will cover all case statements
+    failures = 0
+    tests = 0
+    target = ''
+    msg = ''
+    msg_string = ''
+    msg_len = 0
+
+    # Handle being run with pwd != this file's location
+    if not File.exist?(vector_file)
+        tmp = File.expand_path(vector_file, (File.dirname(__FILE__)))
+        if not File.exist?(tmp)
+            puts "Cannot locate file [#{vector_file}]"
+        end
+        vector_file = tmp
+    end
+
+    puts "Processing file #{vector_file} ..."
+
+    # Process file, one line at a time
+    IO.foreach(vector_file) do |line|
+        # Remove comments and skip blank lines
+        next if line.gsub(/[#].*$/,'').strip.empty?
+
+        # A line without an equals sign on it is malformed
+        next unless line.index(" = ")
+
+        # Split line into label and data
+        fields = line.strip.split
+        next unless fields.length == 3
+        case fields[0]
+        when "[L"
+            # We don't care about this particular line
+            next
+        when "Len"
+            msg_len = fields[2].to_i
+        when "Msg"
+            msg_string = fields[2]
+            if msg_len == 0
+                msg = ""
+            else
+                # Convert to binary sequence
+                msg = hex2bin(msg_string)
+            end
+        when "MD"
+            target = '0x' + fields[2]
+            # We have all our data now, so run the test
+            tests += 1
+
+            digest = checksum(msg, method)
+
+            # Validate result
+            if digest != target
+                puts "Failed test case ##{tests}"
+                failures += 1
+            end
+
+            # Reset variables for next test case
+            target = ''
+            msg = ''
+            msg_string = ''
+            msg_len = 0
+        else
+            next
+        end
+    end
+
+    puts "Tests passed: #{tests - failures} / #{tests}"
+end
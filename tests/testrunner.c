@@ -0,0 +1,432 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * In-process test runner
+ *
+ * Runs the known-answer and Monte Carlo tests from the NIST-formatted
+ * vector files directly against the method modules, once for every
+ * implementation variant the processor can run.  Each known-answer test
+ * is run twice: with the whole message in one sum_process() call, and
+ * with the message fed in small pieces of varying size.
+ *
+ * Usage: testrunner [vector directory]
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "checksum.h"
+
+// Kinds of test
+enum test_type
+{
+    KAT,
+    MONTE,
+    HMAC
+};
+
+// A vector file along with the method it tests
+struct test_file
+{
+    const char*        file;
+    struct method_api* api;
+    enum test_type     type;
+};
+
+static const struct test_file tests[] =
+{
+    { "SHA256ShortMsg.rsp",     &sha256,     KAT   },
+    { "SHA256LongMsg.rsp",      &sha256,     KAT   },
+    { "SHA256Monte.rsp",        &sha256,     MONTE },
+    { "SHA384ShortMsg.rsp",     &sha384,     KAT   },
+    { "SHA384LongMsg.rsp",      &sha384,     KAT   },
+    { "SHA384Monte.rsp",        &sha384,     MONTE },
+    { "SHA512ShortMsg.rsp",     &sha512,     KAT   },
+    { "SHA512LongMsg.rsp",      &sha512,     KAT   },
+    { "SHA512Monte.rsp",        &sha512,     MONTE },
+    { "SHA512_256ShortMsg.rsp", &sha512_256, KAT   },
+    { "SHA512_256LongMsg.rsp",  &sha512_256, KAT   },
+    { "SHA512_256Monte.rsp",    &sha512_256, MONTE },
+    { "XXH64.rsp",              &xxh64,      KAT   },
+    { "XXH3_64.rsp",            &xxh3_64,    KAT   },
+    { "XXH3_128.rsp",           &xxh3_128,   KAT   },
+    { "BLAKE3.rsp",             &blake3,     KAT   },
+    { "ADLER32.rsp",            &adler32,    KAT   },
+    { "FLETCHER16.rsp",         &fletcher16, KAT   },
+    { "FLETCHER32.rsp",         &fletcher32, KAT   },
+    { "FLETCHER64.rsp",         &fletcher64, KAT   },
+    { "HMAC_SHA256.rsp",        &hmac_sha256, HMAC },
+};
+
+// Known-answer tests saved up to be run again as one batch
+struct batch
+{
+    size_t    count;
+    uint8_t** msgs;
+    size_t*   lens;
+    uint8_t*  mds;
+};
+
+// Iterations per Monte Carlo checkpoint
+#define MONTE_ITERATIONS 1000
+
+// Local function prototypes
+static int  run_file    (const char* dir, const struct test_file* test,
+                         const char* variant);
+static int  kat_case    (struct method_api* api, const uint8_t* msg,
+                         size_t len, const uint8_t* md, size_t md_len);
+static int  monte_case  (struct method_api* api, uint8_t* seed,
+                         const uint8_t* md, size_t md_len);
+static int  hmac_case   (struct method_api* api, const uint8_t* key,
+                         size_t key_len, const uint8_t* msg, size_t len,
+                         const uint8_t* mac, size_t mac_len);
+static int  hash_pieces (struct method_api* api, const uint8_t* msg,
+                         size_t len, uint8_t* digest);
+static int  batch_add   (struct batch* batch, const uint8_t* msg, size_t len,
+                         const uint8_t* md, size_t md_len);
+static int  batch_run   (struct method_api* api, struct batch* batch);
+static int  parse_line  (char* line, char** label, char** value);
+static long hex2bin     (const char* hex, uint8_t** out);
+
+
+int main(int argc, char** argv)
+{
+    const char* dir = (argc > 1) ? argv[1] : ".";
+    const char* variant;
+    unsigned t, k;
+    int status;
+    int failed = 0;
+
+    for (t = 0; t < sizeof(tests) / sizeof(tests[0]); ++t)
+    {
+        // Methods without variants only have their default implementation
+        if (tests[t].api->set_kernel == NULL)
+        {
+            failed |= run_file(dir, &tests[t], "default");
+            continue;
+        }
+
+        for (k = 0; (status = tests[t].api->set_kernel(k, &variant)) >= 0; ++k)
+        {
+            if (status > 0)
+            {
+                printf("Skipping %s [%s]: not supported by this processor\n",
+                       tests[t].file, variant);
+                continue;
+            }
+            failed |= run_file(dir, &tests[t], variant);
+        }
+    }
+
+    printf("%s\n", failed ? "FAILED" : "All tests passed");
+    return failed;
+}
+
+
+// Run every test in a vector file.  Returns non-zero if any failed.
+static int run_file(const char* dir, const struct test_file* test,
+                    const char* variant)
+{
+    char path[4096];
+    FILE* file;
+    char* line = NULL;
+    size_t line_size = 0;
+    char* label;
+    char* value;
+    uint8_t* msg = NULL;
+    uint8_t* seed = NULL;
+    uint8_t* md = NULL;
+    uint8_t* key = NULL;
+    long msg_len = 0, seed_len = 0, key_len = 0, md_len;
+    long bits = 0;
+    unsigned cases = 0, failures = 0;
+    struct batch batch = { 0, NULL, NULL, NULL };
+
+    snprintf(path, sizeof(path), "%s/%s", dir, test->file);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printf("Cannot locate file [%s]\n", path);
+        return 1;
+    }
+    printf("Processing file %s [%s] ...\n", path, variant);
+
+    while (getline(&line, &line_size, file) > 0)
+    {
+        if (parse_line(line, &label, &value))
+            continue;
+
+        if (strcmp(label, "Len") == 0)
+        {
+            bits = strtol(value, NULL, 10);
+        }
+        else if (strcmp(label, "Msg") == 0)
+        {
+            free(msg);
+            msg_len = hex2bin(value, &msg);
+        }
+        else if (strcmp(label, "Seed") == 0)
+        {
+            free(seed);
+            seed_len = hex2bin(value, &seed);
+        }
+        else if (strcmp(label, "Key") == 0)
+        {
+            free(key);
+            key_len = hex2bin(value, &key);
+        }
+        else if ((strcmp(label, "Mac") == 0) && (test->type == HMAC))
+        {
+            md_len = hex2bin(value, &md);
+            ++cases;
+            if ((md_len > test->api->output_size) || (key_len < 0) ||
+                hmac_case(test->api, key, key_len, msg, msg_len, md, md_len))
+            {
+                printf("Failed test case #%u\n", cases);
+                ++failures;
+            }
+            free(md);
+            md = NULL;
+        }
+        else if (strcmp(label, "MD") == 0)
+        {
+            md_len = hex2bin(value, &md);
+            ++cases;
+            if ((md_len != test->api->output_size) ||
+                ((test->type == KAT) && ((msg_len < bits / 8) ||
+                  kat_case(test->api, msg, bits / 8, md, md_len))) ||
+                ((test->type == MONTE) && ((seed_len != md_len) ||
+                  monte_case(test->api, seed, md, md_len))))
+            {
+                printf("Failed test case #%u\n", cases);
+                ++failures;
+            }
+            if ((test->type == KAT) && (test->api->sum_batch != NULL) &&
+                batch_add(&batch, msg, bits / 8, md, md_len))
+                ++failures;
+            free(md);
+            md = NULL;
+        }
+    }
+
+    // Methods that can checksum several messages at once get all of the
+    // file's messages again in one batch
+    if (batch.count > 0)
+    {
+        ++cases;
+        if (batch_run(test->api, &batch))
+        {
+            printf("Failed batch of %zu messages\n", batch.count);
+            ++failures;
+        }
+    }
+
+    printf("Tests passed: %u / %u\n", cases - failures, cases);
+
+    free(line);
+    free(msg);
+    free(seed);
+    free(key);
+    fclose(file);
+
+    return (failures > 0) || (cases == 0);
+}
+
+// Check one known-answer test, fed both in one go and in pieces
+static int kat_case(struct method_api* api, const uint8_t* msg,
+                    size_t len, const uint8_t* md, size_t md_len)
+{
+    uint8_t digest[MAX_OUTPUT_SIZE];
+
+    if (hash_buffer(api, msg, len, digest) || memcmp(digest, md, md_len))
+        return 1;
+    if (hash_pieces(api, msg, len, digest) || memcmp(digest, md, md_len))
+        return 1;
+
+    return 0;
+}
+
+// Run one Monte Carlo checkpoint, updating the seed for the next one:
+//   MD[0] = MD[1] = MD[2] = Seed
+//   MD[i] = SHA(MD[i-3] || MD[i-2] || MD[i-1]), for i = 3 .. 1002
+//   Seed = MD[1002], which must match the checkpoint's MD
+static int monte_case(struct method_api* api, uint8_t* seed,
+                      const uint8_t* md, size_t md_len)
+{
+    uint8_t message[3 * MAX_OUTPUT_SIZE];
+    int i;
+
+    for (i = 0; i < 3; ++i)
+        memcpy(&message[i * md_len], seed, md_len);
+
+    for (i = 0; i < MONTE_ITERATIONS; ++i)
+    {
+        if (hash_buffer(api, message, 3 * md_len, seed))
+            return 1;
+        memmove(message, &message[md_len], 2 * md_len);
+        memcpy(&message[2 * md_len], seed, md_len);
+    }
+
+    return memcmp(seed, md, md_len) != 0;
+}
+
+// Check one keyed test, through the method (whole and in pieces) and
+// through the batch interface.  'mac' may be truncated.
+static int hmac_case(struct method_api* api, const uint8_t* key,
+                     size_t key_len, const uint8_t* msg, size_t len,
+                     const uint8_t* mac, size_t mac_len)
+{
+    struct hmac_sha256_key prepared;
+    const uint8_t* msgs[3] = { msg, msg, msg };
+    size_t lens[3] = { len, len, len };
+    uint8_t macs[3][32];
+    int i;
+
+    if (api->set_key(key, key_len) || kat_case(api, msg, len, mac, mac_len))
+        return 1;
+
+    hmac_sha256_key_init(&prepared, key, key_len);
+    hmac_sha256_batch(&prepared, 3, msgs, lens, &macs[0][0]);
+    for (i = 0; i < 3; ++i)
+    {
+        if (memcmp(macs[i], mac, mac_len))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Checksum a message by feeding it to the method in pieces of 1 to 67
+// bytes, to exercise the methods' buffering
+static int hash_pieces(struct method_api* api, const uint8_t* msg,
+                       size_t len, uint8_t* digest)
+{
+    struct context ctx;
+    size_t offset = 0;
+    size_t piece = 1;
+    int retval = 0;
+
+    ctx.which = api->type;
+    ctx.context = NULL;
+    ctx.threads = 1;
+    ctx.preallocated = 0;
+    if (api->sum_init(&ctx))
+        return 1;
+
+    while ((offset < len) && !retval)
+    {
+        if (piece > len - offset)
+            piece = len - offset;
+        retval = api->sum_process(&ctx, (void*)&msg[offset], piece);
+        offset += piece;
+        piece = piece % 67 + 1;
+    }
+
+    if (api->sum_finish(&ctx, digest))
+        retval = 1;
+
+    return retval;
+}
+
+// Save a known-answer test for a batch.  Returns non-zero on error.
+static int batch_add(struct batch* batch, const uint8_t* msg, size_t len,
+                     const uint8_t* md, size_t md_len)
+{
+    size_t n = batch->count;
+
+    batch->msgs = realloc(batch->msgs, (n + 1) * sizeof(*batch->msgs));
+    batch->lens = realloc(batch->lens, (n + 1) * sizeof(*batch->lens));
+    batch->mds = realloc(batch->mds, (n + 1) * md_len);
+    if ((batch->msgs == NULL) || (batch->lens == NULL) || (batch->mds == NULL) ||
+        ((batch->msgs[n] = malloc(len + 1)) == NULL))
+        return 1;
+
+    memcpy(batch->msgs[n], msg, len);
+    batch->lens[n] = len;
+    memcpy(&batch->mds[n * md_len], md, md_len);
+    batch->count = n + 1;
+    return 0;
+}
+
+// Checksum every saved message in one batch, then free them.  Returns
+// non-zero if any result is wrong.
+static int batch_run(struct method_api* api, struct batch* batch)
+{
+    uint8_t* digests;
+    size_t n;
+    int retval;
+
+    digests = malloc(batch->count * api->output_size);
+    retval = (digests == NULL) ||
+             api->sum_batch(batch->count, (const uint8_t* const*)batch->msgs,
+                            batch->lens, digests) ||
+             memcmp(digests, batch->mds, batch->count * api->output_size);
+
+    for (n = 0; n < batch->count; ++n)
+        free(batch->msgs[n]);
+    free(batch->msgs);
+    free(batch->lens);
+    free(batch->mds);
+    free(digests);
+    return retval;
+}
+
+// Split a "Label = value" line.  Returns non-zero for other lines.
+static int parse_line(char* line, char** label, char** value)
+{
+    char* equals;
+    char* end;
+
+    // Remove comments and trailing white space
+    if ((end = strchr(line, '#')) != NULL)
+        *end = '\0';
+    end = &line[strlen(line)];
+    while ((end > line) && ((end[-1] == '\n') || (end[-1] == '\r') || (end[-1] == ' ')))
+        *--end = '\0';
+
+    equals = strstr(line, " = ");
+    if ((equals == NULL) || (line[0] == '['))
+        return 1;
+
+    *equals = '\0';
+    *label = line;
+    *value = &equals[3];
+    return 0;
+}
+
+// Convert a hex string to a newly-allocated byte array.  Returns the
+// number of bytes, or -1 on error.
+static long hex2bin(const char* hex, uint8_t** out)
+{
+    size_t len = strlen(hex) / 2;
+    size_t i;
+    unsigned byte;
+
+    *out = malloc(len + 1);
+    if (*out == NULL)
+        return -1;
+
+    for (i = 0; i < len; ++i)
+    {
+        if (sscanf(&hex[2 * i], "%2x", &byte) != 1)
+            return -1;
+        (*out)[i] = byte;
+    }
+
+    return len;
+}
@@ -0,0 +1,40 @@
+#!/usr/bin/ruby
+# Script for testing background (rate-limited) operation
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+failures = 0
+tests = 0
+srand(35)
+message = Array.new(3 * 1024 * 1024) { rand(256).chr }.join
+expected = checksum(message, '-sha256')
+
+# 3 MB at 4 MB/s should take about 0.75 s in every mode, with the
+# same result as an unthrottled run
+['', '--adaptive', '--idle', '--threads 3 --block-size 256K'].each do |extra|
+    tests += 1
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    output = checksum(message, "--max-rate 4 #{extra} -sha256")
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    correct = extra.include?('--block-size') ? (output and output.lines.length == 12) : (output == expected)
+    if not correct or elapsed < 0.6 or elapsed > 3
+        puts "Failed rate test '#{extra}' (#{elapsed.round(2)} s)"
+        failures += 1
+    end
+end
+
+puts "Tests passed: #{tests - failures} / #{tests}"
@@ -0,0 +1,23 @@
+#!/usr/bin/ruby
+# Script for testing the xxHash algorithms using reference test vectors
+
+# Copyright 2015 Ben Allen
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative 'test_helpers'
+
+# Run known-answer tests
+kat 'XXH64.rsp', '-xxh64'
+kat 'XXH3_64.rsp', '-xxh3'
+kat 'XXH3_128.rsp', '-xxh128'
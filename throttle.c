@@ -0,0 +1,193 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Background operation: read pacing and low priority
+ *
+ * Every read loop in the program reports each read to throttle_read(),
+ * which paces the whole process (all threads together) to a byte rate
+ * with a token bucket.  The bucket is kept as the time at which it will
+ * next be empty: each read pushes that time forward by its size divided
+ * by the rate, and a reader sleeps until it is no longer in the future.
+ * Up to BURST_NS worth of unused rate can build up while idle.
+ *
+ * In adaptive mode the time taken by each read is also measured, per
+ * byte.  A smoothed latency well above the baseline (the lowest seen
+ * recently) means the storage is busy with other work, so the rate is
+ * halved; once the latency settles, it creeps back up to the limit.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "checksum.h"
+
+// Unused rate that may build up, in nanoseconds of reading
+#define BURST_NS        (100 * 1000 * 1000ULL)
+
+// Adaptive mode: how often the rate may change, the latency (relative to
+// the baseline) that causes a back-off, and the lowest rate allowed
+// (as a fraction of the limit)
+#define ADAPT_NS        (100 * 1000 * 1000ULL)
+#define BACKOFF_RATIO   2.0
+#define MIN_FACTOR      (1.0 / 64)
+
+// Values from the kernel's ioprio interface, which C libraries don't wrap
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+#endif
+
+// Shared pacing state
+static struct
+{
+    pthread_mutex_t lock;
+    int             active;
+    int             adaptive;
+    double          rate;           // bytes per nanosecond
+    double          factor;         // adaptive share of the rate
+    uint64_t        empty_at;       // when the bucket runs dry
+    uint64_t        adapted_at;     // last adaptive change
+    double          latency;        // smoothed ns per KiB
+    double          baseline;       // lowest recent latency
+} throttle =
+{
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .factor = 1.0,
+};
+
+// Local function prototypes
+static uint64_t now_ns      (void);
+static void     adapt       (uint64_t now, size_t bytes, uint64_t elapsed);
+
+
+// Limit reads to 'rate' bytes per second (0 for no limit)
+void throttle_init(uint64_t rate, int adaptive)
+{
+    throttle.active = (rate != 0);
+    throttle.adaptive = adaptive;
+    throttle.rate = (double)rate / 1e9;
+    throttle.empty_at = now_ns();
+}
+
+// Lower the CPU and I/O priority of the process, including any threads
+// it creates afterwards.  Returns non-zero if either could not be set.
+int set_idle(void)
+{
+    int retval = 0;
+
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+        retval = 1;
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        retval = 1;
+#endif
+
+    return retval;
+}
+
+// Note the start of a read.  The value is only meaningful to
+// throttle_read().  Also marks the start of the read for tracing; the
+// caller fires read_done once the read completes.
+uint64_t throttle_start(void)
+{
+    PROBE0(read_start);
+    return throttle.active ? now_ns() : 0;
+}
+
+// Account for a completed read of 'bytes' bytes, sleeping as long as
+// needed to keep to the rate
+void throttle_read(size_t bytes, uint64_t start)
+{
+    struct timespec wake;
+    uint64_t now, until;
+
+    if (!throttle.active || (bytes == 0))
+        return;
+    now = now_ns();
+
+    pthread_mutex_lock(&throttle.lock);
+    if (throttle.adaptive)
+        adapt(now, bytes, now - start);
+    if (throttle.empty_at + BURST_NS < now)
+        throttle.empty_at = now - BURST_NS;
+    throttle.empty_at += (uint64_t)(bytes / (throttle.rate * throttle.factor));
+    until = throttle.empty_at;
+    pthread_mutex_unlock(&throttle.lock);
+
+    if (until <= now)
+        return;
+    wake.tv_sec = until / 1000000000ULL;
+    wake.tv_nsec = until % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+        ;
+}
+
+
+// Current time on the monotonic clock
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Adjust the rate according to how long reads are taking.  Called with
+// the lock held.
+static void adapt(uint64_t now, size_t bytes, uint64_t elapsed)
+{
+    double sample = elapsed * 1024.0 / bytes;
+
+    if (throttle.latency == 0)
+    {
+        throttle.latency = sample;
+        throttle.baseline = sample;
+        throttle.adapted_at = now;
+        return;
+    }
+    throttle.latency += (sample - throttle.latency) / 8;
+
+    // The baseline follows drops at once but rises only slowly, so that
+    // it tracks changes in the workload without chasing congestion
+    if (throttle.latency < throttle.baseline)
+        throttle.baseline = throttle.latency;
+    else
+        throttle.baseline += (throttle.latency - throttle.baseline) / 256;
+
+    if (now - throttle.adapted_at < ADAPT_NS)
+        return;
+    throttle.adapted_at = now;
+    if (throttle.latency > BACKOFF_RATIO * throttle.baseline)
+    {
+        throttle.factor /= 2;
+        if (throttle.factor < MIN_FACTOR)
+            throttle.factor = MIN_FACTOR;
+    }
+    else if (throttle.factor < 1.0)
+    {
+        throttle.factor += 1.0 / 16;
+        if (throttle.factor > 1.0)
+            throttle.factor = 1.0;
+    }
+}
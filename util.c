@@ -0,0 +1,179 @@
+/*
+ * Copyright 2015 Ben Allen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Helper functions shared by the processing modes.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "checksum.h"
+
+
+// Display a checksum as a hexadecimal number
+void print_digest(FILE* stream, const uint8_t* digest, size_t size)
+{
+    char line[2 * MAX_OUTPUT_SIZE + 4];
+
+    fwrite(line, 1, format_digest(line, digest, size), stream);
+}
+
+// Format a checksum the way print_digest() displays it, newline included.
+// Returns the number of characters written to 'out' (2 * size + 3).
+size_t format_digest(char* out, const uint8_t* digest, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    out[0] = '0';
+    out[1] = 'x';
+    for (i = 0; i < size; ++i)
+    {
+        out[2 + 2 * i] = hex[digest[i] >> 4];
+        out[3 + 2 * i] = hex[digest[i] & 0xf];
+    }
+    out[2 + 2 * size] = '\n';
+
+    return 2 * size + 3;
+}
+
+// Feed data to a method.  The modes call methods through here and the
+// other method_*() functions so that the tracepoints in probes.h see all
+// hashing.
+int method_process(struct method_api* api, struct context* ctx,
+                   void* data, size_t len)
+{
+    int retval;
+
+    PROBE2(process_start, api->type, len);
+    retval = api->sum_process(ctx, data, len);
+    PROBE2(process_done, api->type, len);
+
+    return retval;
+}
+
+// Finish a checksum started with the method's sum_init()
+int method_finish(struct method_api* api, struct context* ctx, uint8_t* digest)
+{
+    int retval;
+
+    PROBE2(finish_start, api->type, api->output_size);
+    retval = api->sum_finish(ctx, digest);
+    PROBE2(finish_done, api->type, api->output_size);
+
+    return retval;
+}
+
+// Feed a run of zeros to a method that has sum_zeros()
+int method_zeros(struct method_api* api, struct context* ctx, uint64_t len)
+{
+    int retval;
+
+    PROBE2(process_start, api->type, len);
+    retval = api->sum_zeros(ctx, len);
+    PROBE2(process_done, api->type, len);
+
+    return retval;
+}
+
+// Checksum a batch of messages with a method that has sum_batch().  This
+// has probes of its own, since processing and finishing happen together.
+int method_batch(struct method_api* api, size_t count, const uint8_t* const* msgs,
+                 const size_t* lens, uint8_t* digests)
+{
+    uint64_t bytes = 0;
+    size_t i;
+    int retval;
+
+    for (i = 0; i < count; ++i)
+        bytes += lens[i];
+
+    PROBE2(batch_start, api->type, bytes);
+    retval = api->sum_batch(count, msgs, lens, digests);
+    PROBE2(batch_done, api->type, bytes);
+
+    return retval;
+}
+
+// Checksum a single buffer in one go
+int hash_buffer(struct method_api* api, const void* data, size_t len,
+                uint8_t* digest)
+{
+    struct context ctx;
+    int retval;
+
+    ctx.which = api->type;
+    ctx.context = NULL;
+    ctx.threads = 1;
+    ctx.preallocated = 0;
+    if (api->sum_init(&ctx))
+        return 1;
+
+    // Always finish, so that the context gets cleaned up
+    retval = method_process(api, &ctx, (void*)data, len);
+    if (method_finish(api, &ctx, digest))
+        retval = 1;
+
+    return retval;
+}
+
+// Parse a non-negative decimal number from a command-line argument
+int parse_uint(const char* str, unsigned* value)
+{
+    unsigned long result;
+    char* end;
+
+    if ((*str < '0') || (*str > '9'))
+        return -1;
+    errno = 0;
+    result = strtoul(str, &end, 10);
+    if ((*end != '\0') || (errno == ERANGE) || (result > UINT_MAX))
+        return -1;
+
+    *value = result;
+    return 0;
+}
+
+// Parse a size in bytes, with an optional K, M or G (binary) suffix
+int parse_size(const char* str, uint64_t* value)
+{
+    unsigned long long result;
+    unsigned shift = 0;
+    char* end;
+
+    if ((*str < '0') || (*str > '9'))
+        return -1;
+    errno = 0;
+    result = strtoull(str, &end, 10);
+    if ((errno == ERANGE) || (result > UINT64_MAX))
+        return -1;
+    switch (*end)
+    {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        default: break;
+    }
+
+    // The suffix must not push the value past 64 bits
+    if ((*end != '\0') || (result > (UINT64_MAX >> shift)))
+        return -1;
+
+    *value = (uint64_t)result << shift;
+    return 0;
+}